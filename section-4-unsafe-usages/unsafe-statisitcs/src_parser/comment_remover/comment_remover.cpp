@@ -1,6 +1,23 @@
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 enum class ParseState {
@@ -12,27 +29,332 @@ enum class ParseState {
 	RIGHTSTAR
 };
 
-int remove_comment(std::string& src_code) {
+// Input that cannot be mapped, e.g. a pipe, is read in chunks of this size.
+static const size_t CHUNK_SIZE = 1 << 20;
+static const size_t OUT_BUF_SIZE = 1 << 20;
 
-	auto state = ParseState::INIT;
-	std::string nocomment;
-	for (auto& ch : src_code) {
+// Collects the output and writes it to fd in large blocks.
+class OutBuf {
+public:
+	explicit OutBuf(int fd = STDOUT_FILENO) : fd(fd), buf(new char[OUT_BUF_SIZE]), len(0) {}
+
+	~OutBuf() {
+		flush();
+		delete[] buf;
+	}
+
+	void write(const char* src, size_t n) {
+		if (n > OUT_BUF_SIZE - len) {
+			flush();
+			if (n >= OUT_BUF_SIZE) {
+				write_all(src, n);
+				return;
+			}
+		}
+		memcpy(buf + len, src, n);
+		len += n;
+	}
+
+	void put(char ch) {
+		if (len == OUT_BUF_SIZE) {
+			flush();
+		}
+		buf[len++] = ch;
+	}
+
+	void flush() {
+		write_all(buf, len);
+		len = 0;
+	}
+
+private:
+	void write_all(const char* src, size_t n) {
+		while (n > 0) {
+			ssize_t written = ::write(fd, src, n);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				cerr << "Cannot write output\n";
+				return;
+			}
+			src += written;
+			n -= written;
+		}
+	}
+
+	int fd;
+	char* buf;
+	size_t len;
+};
+
+// First byte of [p, end) that is a or b, or end. memchr finds a single
+// byte; this is for block comments, where both the end of the comment and
+// the newlines to keep matter.
+static const char* find_either(const char* p, const char* end, char a, char b) {
+#ifdef __SSE2__
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	for (; p < end; ++p) {
+		if (*p == a || *p == b) {
+			return p;
+		}
+	}
+	return end;
+}
+
+// Counts of one file, or totals of a directory.
+struct UnsafeCounts {
+	UnsafeCounts() : block_num(0), block_LOC(0), fn_num(0), fn_LOC(0), trait_num(0), LOC(0), files(0) {}
+
+	void add(const UnsafeCounts& other) {
+		block_num += other.block_num;
+		block_LOC += other.block_LOC;
+		fn_num += other.fn_num;
+		fn_LOC += other.fn_LOC;
+		trait_num += other.trait_num;
+		LOC += other.LOC;
+		files += other.files;
+	}
+
+	// "<unsafe blocks> <their LOC> <unsafe fns> <their LOC> <unsafe traits> <LOC>"
+	std::string to_string(char sep) const {
+		return std::to_string(block_num) + sep + std::to_string(block_LOC) + sep +
+			std::to_string(fn_num) + sep + std::to_string(fn_LOC) + sep +
+			std::to_string(trait_num) + sep + std::to_string(LOC);
+	}
+
+	long block_num;
+	long block_LOC;
+	long fn_num;
+	long fn_LOC;
+	long trait_num;
+	long LOC;
+	long files;
+};
+
+// Counts the unsafe constructs of the comment-free code as it is produced,
+// instead of writing it out. The counts are those of the earlier scripts
+// on the stripped file:
+// - unsafe blocks and their LOC as unsafe_block_extractor.py + sum.py,
+// - LOC of unsafe fns as unsafe_fn_extractor.py + sum.py,
+// - unsafe fns as egrep 'unsafe (\w )*fn .+\(' | grep -v ';$',
+// - unsafe traits as grep 'unsafe trait .*{',
+// - LOC as grep -v '^$'.
+class UnsafeCounter {
+public:
+	UnsafeCounter() : py_line_no(0) {
+		counts.files = 1;
+	}
+
+	void write(const char* src, size_t n) {
+		const char* end = src + n;
+		while (src < end) {
+			auto newline = static_cast<const char*>(memchr(src, '\n', end - src));
+			if (!newline) {
+				line.append(src, end);
+				return;
+			}
+			line.append(src, newline);
+			finish_line(true);
+			src = newline + 1;
+		}
+	}
+
+	void put(char ch) {
+		if (ch == '\n') {
+			finish_line(true);
+		} else {
+			line.push_back(ch);
+		}
+	}
+
+	// Counts a last line without newline.
+	void finish() {
+		if (!line.empty()) {
+			finish_line(false);
+		}
+	}
+
+	const UnsafeCounts& get_counts() const {
+		return counts;
+	}
+
+private:
+	// Brace matching of one kind of unsafe region, line by line, like the
+	// extractors: a region starts after the first match on a line outside
+	// of a region, and every '}' that brings the depth back to 0 ends one.
+	struct Region {
+		Region() : in_region(false), left(0), start_line_no(0) {}
+
+		template <typename Record>
+		void scan(const char* p, const char* end, long line_no, Record record) {
+			for (; p < end; ++p) {
+				if (*p == '{') {
+					++left;
+				} else if (*p == '}') {
+					--left;
+					if (left == 0) {
+						in_region = false;
+						record(start_line_no, line_no);
+						start_line_no = 0;
+					}
+				}
+			}
+		}
+
+		bool in_region;
+		long left;
+		long start_line_no;
+	};
+
+	// sum.py takes the LOC of a "start,end" record as
+	// len("<end>\n") - len("<start>") + 1; kept so totals match earlier runs.
+	static long record_LOC(long start, long end) {
+		return (long)std::to_string(end).size() + 1 - (long)std::to_string(start).size() + 1;
+	}
+
+	static const char* find(const char* p, const char* end, const char* pattern) {
+		size_t n = strlen(pattern);
+		auto found = static_cast<const char*>(memmem(p, end - p, pattern, n));
+		return found ? found : end;
+	}
+
+	static bool is_word(char ch) {
+		return isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+	}
+
+	// egrep 'unsafe (\w )*fn .+\('
+	static bool is_unsafe_fn(const char* p, const char* end) {
+		for (const char* u = find(p, end, "unsafe "); u != end; u = find(u + 1, end, "unsafe ")) {
+			const char* q = u + 7;
+			while (end - q >= 2 && is_word(q[0]) && q[1] == ' ') {
+				q += 2;
+			}
+			if (end - q >= 3 && memcmp(q, "fn ", 3) == 0 && end - q > 4 && memchr(q + 4, '(', end - q - 4)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// One line of what the extractors read; Python splits lines at '\r' too.
+	void scan_py_line(const char* p, const char* end) {
+		long line_no = ++py_line_no;
+		if (!block.in_region) {
+			const char* pos = find(p, end, "unsafe {");
+			if (pos != end) {
+				block.in_region = true;
+				block.start_line_no = line_no;
+				block.left = 1;
+				scan_block(pos + 8, end, line_no);
+			}
+		} else {
+			scan_block(p, end, line_no);
+		}
+		if (!fn.in_region) {
+			const char* pos = find(p, end, "unsafe ");
+			if (pos != end) {
+				pos = find(pos + 7, end, "fn ");
+			}
+			if (pos != end) {
+				pos = static_cast<const char*>(memchr(pos + 3, '{', end - pos - 3));
+			}
+			if (pos && pos != end) {
+				fn.in_region = true;
+				fn.start_line_no = line_no;
+				fn.left = 1;
+				scan_fn(pos + 1, end, line_no);
+			}
+		} else {
+			scan_fn(p, end, line_no);
+		}
+	}
+
+	void scan_block(const char* p, const char* end, long line_no) {
+		block.scan(p, end, line_no, [this](long start, long end) {
+			++counts.block_num;
+			counts.block_LOC += record_LOC(start, end);
+		});
+	}
+
+	void scan_fn(const char* p, const char* end, long line_no) {
+		fn.scan(p, end, line_no, [this](long start, long end) {
+			counts.fn_LOC += record_LOC(start, end);
+		});
+	}
+
+	void finish_line(bool terminated) {
+		const char* p = line.data();
+		const char* end = p + line.size();
+		if (p != end) {
+			++counts.LOC;
+		}
+		if (is_unsafe_fn(p, end) && !(p != end && end[-1] == ';')) {
+			++counts.fn_num;
+		}
+		const char* trait = find(p, end, "unsafe trait ");
+		if (trait != end && memchr(trait + 13, '{', end - trait - 13)) {
+			++counts.trait_num;
+		}
+
+		// "a\rb\n" is two lines for Python, and "a\r\n" or a last "a\r" one.
+		while (true) {
+			auto cr = static_cast<const char*>(memchr(p, '\r', end - p));
+			if (!cr) {
+				if (p != end || (terminated && p == line.data())) {
+					scan_py_line(p, end);
+				}
+				break;
+			}
+			scan_py_line(p, cr);
+			p = cr + 1;
+		}
+		line.clear();
+	}
+
+	std::string line;
+	long py_line_no;
+	Region block;
+	Region fn;
+	UnsafeCounts counts;
+};
+
+// Removes the comments of [begin, end) and writes the rest to out. Each
+// state skips to the next byte that can change it (memchr for code and line
+// comments, find_either for block comments) and copies or drops the span in
+// between as a whole. state is carried from one chunk of the file to the
+// next.
+template <typename Out>
+void remove_comment(const char* begin, const char* end, ParseState& state, Out& out) {
+	const char* p = begin;
+	while (p < end) {
 		switch (state) {
-			case ParseState::INIT: {
-				switch (ch) {
-					case '/': {
-						state = ParseState::ONESLASH;
-						break;
-						  }
-					default: {
-						state = ParseState::NOCOMMENT;
-						nocomment.push_back(ch);
-						break;
-						 }
+			case ParseState::INIT:
+			case ParseState::NOCOMMENT: {
+				auto slash = static_cast<const char*>(memchr(p, '/', end - p));
+				if (!slash) {
+					state = ParseState::NOCOMMENT;
+					out.write(p, end - p);
+					p = end;
+					break;
 				}
+				state = ParseState::ONESLASH;
+				out.write(p, slash - p);
+				p = slash + 1;
 				break;
 			}
 			case ParseState::ONESLASH: {
+				char ch = *p++;
 				switch (ch) {
 					case '/': {
 						state = ParseState::TWOSLASH;
@@ -44,92 +366,370 @@ int remove_comment(std::string& src_code) {
 						  }
 					default: {
 						state = ParseState::NOCOMMENT;
-						nocomment.push_back('/');
-						nocomment.push_back(ch);
+						out.put('/');
+						out.put(ch);
 						break;
 						 }
 				}
 				break;
 			}
 			case ParseState::TWOSLASH: {
-				switch (ch) {
-					case '\n': {
-						state = ParseState::NOCOMMENT;
-						nocomment.push_back(ch);
-						break;
-					}
-					default: {
-						break;
-						 }
-
-				}
-				break;
-					
-			}
-			case ParseState::NOCOMMENT: {
-				switch (ch) {
-					case '/': {
-						state = ParseState::ONESLASH;
-						break;
-					}
-					default: {
-						state = ParseState::NOCOMMENT;
-						nocomment.push_back(ch);
-						break;
-					}
-				}
-				break;
-			}
-			case ParseState::LEFTSTAR: {
-				switch (ch) {
-					case '*': {
-						state = ParseState::RIGHTSTAR;
-						break;
-					}
-					case '\n': {
-						nocomment.push_back(ch);
-						break;
-					}
-					default: {
-						break;
-					}
+				auto newline = static_cast<const char*>(memchr(p, '\n', end - p));
+				if (!newline) {
+					p = end;
+					break;
 				}
+				state = ParseState::NOCOMMENT;
+				out.put('\n');
+				p = newline + 1;
 				break;
 			}
+			case ParseState::LEFTSTAR:
 			case ParseState::RIGHTSTAR: {
-				switch (ch) {
-					case '/': {
-						state = ParseState::NOCOMMENT;
-						break;
-					}
-					case '\n': {
-						nocomment.push_back(ch);
-						break;
-					}
-					default: {
-						break;
-					}
+				// A block comment ends at the first '/' after a '*'. Its
+				// newlines are kept.
+				char stop = state == ParseState::LEFTSTAR ? '*' : '/';
+				auto next = find_either(p, end, stop, '\n');
+				if (next == end) {
+					p = end;
+					break;
 				}
+				p = next + 1;
+				if (*next == '\n') {
+					out.put('\n');
+					break;
+				}
+				state = state == ParseState::LEFTSTAR ? ParseState::RIGHTSTAR : ParseState::NOCOMMENT;
 				break;
 			}
 			default: {
 				cerr << "Unreachable!\n";
-				break;
+				return;
 
 				 }
 		}
 	}
-	cout << nocomment;
+}
+
+// Maps the file if possible, otherwise reads it chunk by chunk.
+template <typename Out>
+int remove_comment_file(const char* path, Out& out) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		cerr << "Cannot open " << path << "\n";
+		return 1;
+	}
+
+	auto state = ParseState::INIT;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size == 0) {
+			close(fd);
+			return 0;
+		}
+		void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			const char* begin = static_cast<const char*>(data);
+			remove_comment(begin, begin + st.st_size, state, out);
+			munmap(data, st.st_size);
+			close(fd);
+			return 0;
+		}
+	}
+
+	std::string chunk(CHUNK_SIZE, '\0');
+	while (true) {
+		ssize_t n = read(fd, &chunk[0], CHUNK_SIZE);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			cerr << "Cannot read " << path << "\n";
+			close(fd);
+			return 1;
+		}
+		if (n == 0) {
+			break;
+		}
+		remove_comment(chunk.data(), chunk.data() + n, state, out);
+	}
+	close(fd);
 	return 0;
 }
 
+// Appends the *.rs files under dir, like find dir -type f -name "*.rs".
+static void find_rs_files(const std::string& dir, std::vector<std::string>& files) {
+	DIR* d = opendir(dir.c_str());
+	if (!d) {
+		cerr << "Cannot open " << dir << "\n";
+		return;
+	}
+	while (struct dirent* entry = readdir(d)) {
+		std::string name = entry->d_name;
+		if (name == "." || name == "..") {
+			continue;
+		}
+		std::string path = dir + "/" + name;
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			find_rs_files(path, files);
+		} else if (S_ISREG(st.st_mode) && name.size() > 3 && name.compare(name.size() - 3, 3, ".rs") == 0) {
+			files.push_back(path);
+		}
+	}
+	closedir(d);
+}
+
+// Writes the i-th file to out_dir/<i>.rs, taking the next file from next
+// until all are done. Files that cannot be processed are counted in failed.
+static void remove_comment_batch(const std::vector<std::string>& files, const std::string& out_dir,
+		std::atomic<size_t>& next, std::atomic<int>& failed) {
+	for (size_t i = next++; i < files.size(); i = next++) {
+		std::string out_path = out_dir + "/" + std::to_string(i) + ".rs";
+		int fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			cerr << "Cannot create " << out_path << "\n";
+			++failed;
+			continue;
+		}
+		{
+			OutBuf out(fd);
+			if (remove_comment_file(files[i].c_str(), out) != 0) {
+				++failed;
+			}
+		}
+		close(fd);
+	}
+}
+
+// Counts the i-th file into counts[i], taking the next file from next
+// until all are done. Files that cannot be read keep files == 0.
+static void count_unsafe_batch(const std::vector<std::string>& files, std::vector<UnsafeCounts>& counts,
+		std::atomic<size_t>& next, std::atomic<int>& failed) {
+	for (size_t i = next++; i < files.size(); i = next++) {
+		UnsafeCounter counter;
+		if (remove_comment_file(files[i].c_str(), counter) != 0) {
+			++failed;
+			continue;
+		}
+		counter.finish();
+		counts[i] = counter.get_counts();
+	}
+}
+
+// Totals of every directory under root, from the counts of the files
+// found under it. Keys are relative to root, "." being root itself.
+static std::map<std::string, UnsafeCounts> roll_up(const std::string& root, const std::vector<std::string>& files,
+		const std::vector<UnsafeCounts>& counts) {
+	std::map<std::string, UnsafeCounts> totals;
+	for (size_t i = 0; i < files.size(); ++i) {
+		totals["."].add(counts[i]);
+		// Files found under root are "root/<rel>"; anything else only
+		// counts for root itself.
+		const std::string& path = files[i];
+		if (path.size() <= root.size() + 1 || path.compare(0, root.size(), root) != 0 || path[root.size()] != '/') {
+			continue;
+		}
+		std::string rel = path.substr(root.size() + 1);
+		for (size_t slash = rel.find('/'); slash != std::string::npos; slash = rel.find('/', slash + 1)) {
+			totals[rel.substr(0, slash)].add(counts[i]);
+		}
+	}
+	return totals;
+}
+
+static std::string csv_quote(const std::string& field) {
+	if (field.find_first_of(",\"\n") == std::string::npos) {
+		return field;
+	}
+	std::string quoted = "\"";
+	for (char ch : field) {
+		if (ch == '"') {
+			quoted.push_back('"');
+		}
+		quoted.push_back(ch);
+	}
+	return quoted + "\"";
+}
+
+static std::string json_quote(const std::string& str) {
+	std::string quoted = "\"";
+	for (char ch : str) {
+		if (ch == '"' || ch == '\\') {
+			quoted.push_back('\\');
+			quoted.push_back(ch);
+		} else if (static_cast<unsigned char>(ch) < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", ch);
+			quoted += buf;
+		} else {
+			quoted.push_back(ch);
+		}
+	}
+	return quoted + "\"";
+}
+
+static void write_totals(const std::map<std::string, UnsafeCounts>& totals, bool json, OutBuf& out) {
+	std::string text;
+	if (json) {
+		text = "{";
+		const char* sep = "\n";
+		for (auto& dir : totals) {
+			const UnsafeCounts& c = dir.second;
+			text += sep;
+			text += "  " + json_quote(dir.first) + ": {\"unsafe_blocks\": " + std::to_string(c.block_num) +
+				", \"unsafe_block_LOC\": " + std::to_string(c.block_LOC) +
+				", \"unsafe_fns\": " + std::to_string(c.fn_num) +
+				", \"unsafe_fn_LOC\": " + std::to_string(c.fn_LOC) +
+				", \"unsafe_traits\": " + std::to_string(c.trait_num) +
+				", \"LOC\": " + std::to_string(c.LOC) +
+				", \"files\": " + std::to_string(c.files) + "}";
+			sep = ",\n";
+		}
+		text += "\n}\n";
+	} else {
+		text = "directory,unsafe_blocks,unsafe_block_LOC,unsafe_fns,unsafe_fn_LOC,unsafe_traits,LOC,files\n";
+		for (auto& dir : totals) {
+			text += csv_quote(dir.first) + "," + dir.second.to_string(',') + "," + std::to_string(dir.second.files) + "\n";
+		}
+	}
+	out.write(text.data(), text.size());
+}
+
+static int usage() {
+	cerr << "Usage: comment_remover FILE\n"
+		"       comment_remover [-j N] -o DIR FILE|DIR...\n"
+		"       comment_remover [-j N] -c FILE|DIR...\n"
+		"       comment_remover [-j N] -t csv|json DIR\n";
+	return 1;
+}
+
 int main(int argc, char** argv) {
 	if (argc < 2 || std::string(argv[1]) == "") {
 		cerr << "Wrong input\n";
 		return 1;
 	}
-	
-	std::ifstream t(argv[1]);
-	std::string content((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
-	remove_comment(content);
+
+	std::string out_dir;
+	bool count = false;
+	std::string tree_format;
+	unsigned jobs = std::thread::hardware_concurrency();
+	std::vector<std::string> inputs;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc) {
+			out_dir = argv[++i];
+		} else if (arg == "-c") {
+			count = true;
+		} else if (arg == "-t" && i + 1 < argc) {
+			tree_format = argv[++i];
+			if (tree_format != "csv" && tree_format != "json") {
+				return usage();
+			}
+		} else if (arg == "-j" && i + 1 < argc) {
+			jobs = std::atoi(argv[++i]);
+		} else if (arg.size() > 1 && arg[0] == '-') {
+			return usage();
+		} else {
+			inputs.push_back(arg);
+		}
+	}
+
+	int modes = !out_dir.empty() + count + !tree_format.empty();
+	if (modes == 0) {
+		if (inputs.size() != 1) {
+			return usage();
+		}
+		OutBuf out;
+		return remove_comment_file(inputs[0].c_str(), out);
+	}
+	if (modes > 1 || (!tree_format.empty() && inputs.size() != 1)) {
+		return usage();
+	}
+	if (!tree_format.empty()) {
+		struct stat st;
+		if (stat(inputs[0].c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+			cerr << "Not a directory: " << inputs[0] << "\n";
+			return usage();
+		}
+		// Keys of the totals are relative to the root without trailing '/'.
+		while (inputs[0].size() > 1 && inputs[0].back() == '/') {
+			inputs[0].pop_back();
+		}
+	}
+
+	std::vector<std::string> files;
+	for (auto& input : inputs) {
+		struct stat st;
+		if (stat(input.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+			find_rs_files(input, files);
+		} else {
+			files.push_back(input);
+		}
+	}
+	std::atomic<size_t> next(0);
+	std::atomic<int> failed(0);
+	jobs = std::max(1u, std::min<unsigned>(jobs, files.size()));
+	std::vector<std::thread> workers;
+
+	// Counting modes: the files are counted on all threads, each taking the
+	// next uncounted file, so a few huge files do not hold up the others.
+	// -c prints one record per file, in input order; -t the totals of every
+	// directory under DIR.
+	if (count || !tree_format.empty()) {
+		std::vector<UnsafeCounts> counts(files.size());
+		for (unsigned i = 1; i < jobs; ++i) {
+			workers.emplace_back(count_unsafe_batch, std::cref(files), std::ref(counts), std::ref(next), std::ref(failed));
+		}
+		count_unsafe_batch(files, counts, next, failed);
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		OutBuf out;
+		if (count) {
+			for (size_t i = 0; i < files.size(); ++i) {
+				if (counts[i].files) {
+					std::string record = counts[i].to_string(' ') + " " + files[i] + "\n";
+					out.write(record.data(), record.size());
+				}
+			}
+		} else {
+			write_totals(roll_up(inputs[0], files, counts), tree_format == "json", out);
+		}
+		return failed ? 1 : 0;
+	}
+
+	// Batch mode: the comment-free copy of the i-th file goes to
+	// DIR/<i>.rs, and DIR/index.txt lists "<i> <path>" per file.
+	if (mkdir(out_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		cerr << "Cannot create " << out_dir << "\n";
+		return 1;
+	}
+	{
+		int fd = open((out_dir + "/index.txt").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			cerr << "Cannot create " << out_dir << "/index.txt\n";
+			return 1;
+		}
+		OutBuf index(fd);
+		for (size_t i = 0; i < files.size(); ++i) {
+			std::string line = std::to_string(i) + " " + files[i] + "\n";
+			index.write(line.data(), line.size());
+		}
+		index.flush();
+		close(fd);
+	}
+
+	for (unsigned i = 1; i < jobs; ++i) {
+		workers.emplace_back(remove_comment_batch, std::cref(files), std::cref(out_dir), std::ref(next), std::ref(failed));
+	}
+	remove_comment_batch(files, out_dir, next, failed);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	return failed ? 1 : 0;
 }
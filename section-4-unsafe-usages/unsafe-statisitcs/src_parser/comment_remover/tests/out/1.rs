@@ -0,0 +1,43 @@
+
+
+
+use std::ptr;
+
+
+
+
+pub unsafe fn read_at(p: *const u8) -> u8 {
+    
+    *p
+}
+
+
+pub unsafe trait Zeroable {
+    fn zeroed() -> Self;
+}
+
+unsafe impl Zeroable for u32 {
+    fn zeroed() -> u32 {
+        0 
+    }
+}
+
+pub fn swap(a: &mut u32, b: &mut u32) {
+    unsafe {
+        
+        ptr::swap(a, b);
+    }
+}
+
+pub fn first(v: &[u8]) -> u8 {
+    let x = unsafe { *v.as_ptr() };
+    x
+}
+
+pub fn copy(src: &[u8], dst: &mut [u8]) {
+    unsafe {
+        if src.len() <= dst.len() {
+            ptr::copy_nonoverlapping(src.as_ptr(), dst.as_mut_ptr(), src.len());
+        }
+    }
+}
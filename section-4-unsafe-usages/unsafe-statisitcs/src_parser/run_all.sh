@@ -2,6 +2,11 @@
 
 count_dir="$1"
 
+if [ ! -d "${count_dir}" ]; then
+    echo "Usage: $0 COUNT_DIR" >&2
+    exit 1
+fi
+
 g_unsafe_region_num=0
 g_unsafe_region_LOC=0
 g_unsafe_fn_num=0
@@ -45,74 +50,57 @@ function reset() {
     total_LOC=0
 }
 
-function count_one_file() {
-    comment_remover="comment_remover/comment_remover"
-    unsafe_block_extractor="unsafe_block_extractor/unsafe_block_extractor.py"
-    unsafe_fn_extractor="unsafe_fn_extractor/unsafe_fn_extractor.py"
+comment_remover="comment_remover/comment_remover"
+rollup="unsafe_rollup.csv"
 
-    $comment_remover $1 > tmp
-    $unsafe_block_extractor tmp >> unsafe_block.info
-    $unsafe_fn_extractor tmp >> unsafe_fn_LOC.info
-    egrep 'unsafe (\w )*fn .+\(' tmp | grep -v ';$' >> unsafe_fn.info
-    grep 'unsafe trait .*{' tmp >> unsafe_trait.info
-    let total_LOC+=$(cat tmp | grep -v '^$' | wc -l | cut -d' ' -f1)
-}
+# comment_remover is built from source when it is missing or out of date.
+if [ ! -x ${comment_remover} ] || [ ${comment_remover}.cpp -nt ${comment_remover} ]; then
+    g++ -O2 -pthread -o ${comment_remover} ${comment_remover}.cpp || exit 1
+fi
 
-function count_one_file_fast() {
-    comment_remover="comment_remover/comment_remover"
-    unsafe_block_extractor="unsafe_block_extractor/unsafe_block_extractor.py"
-    unsafe_fn_extractor="unsafe_fn_extractor/unsafe_fn_extractor.py"
+# Counts the unsafe constructs of all the *.rs files under COUNT_DIR with a
+# single comment_remover run; JOBS=N limits its threads. ${rollup} gets the
+# totals of every directory.
+function count_tree() {
+    $comment_remover ${JOBS:+-j $JOBS} -t csv "${count_dir}" > ${rollup} || exit 1
+}
 
-    $comment_remover $1 > tmp
-    $unsafe_block_extractor tmp >> unsafe_block.info
-    egrep 'unsafe (\w )*fn .+\(' tmp | grep -v ';$' >> unsafe_fn.info
-    grep 'unsafe trait .*{' tmp >> unsafe_trait.info
+# Sets totals to "URN URLOC UFN UFLOC UTN TLOC" of the directory $1 under
+# COUNT_DIR, from ${rollup}.
+function count_files() {
+    local dir="${1#${count_dir}}"
+    dir="${dir#/}"
+    dir="${dir%/}"
+    totals=$(awk -F, -v dir="${dir:-.}" '$1 == dir { print $2, $3, $4, $5, $6, $7 }' ${rollup})
+    totals=${totals:-0 0 0 0 0 0}
 }
 
 function count_dir() {
-    rm tmp unsafe_block.info unsafe_fn.info unsafe_fn_LOC.info unsafe_trait.info
     input_dir="$1"
-    array=()
-    while IFS=  read -r -d $'\0'; do
-        array+=("$REPLY")
-    done < <(find "${input_dir}" -type f -name "*.rs" -print0)
-
-    for i in "${array[@]}"; do
-        #echo $i
-        count_one_file "$i"
-    done
+    count_files "${input_dir}"
     #echo "# and LOC of unsafe block:"
-    unsafe_regions=$(./sum.py unsafe_block.info)
-    unsafe_region_num=$(echo $unsafe_regions | cut -d' ' -f1)
-    unsafe_region_LOC=$(echo $unsafe_regions | cut -d' ' -f2)
+    unsafe_region_num=$(echo $totals | cut -d' ' -f1)
+    unsafe_region_LOC=$(echo $totals | cut -d' ' -f2)
     #echo "# and LOC of unsafe fn:"
-    unsafe_fn_num=$(wc -l unsafe_fn.info | cut -d' ' -f1)
-    unsafe_fn_LOC=$(./sum.py unsafe_fn_LOC.info | cut -d' ' -f2)
+    unsafe_fn_num=$(echo $totals | cut -d' ' -f3)
+    unsafe_fn_LOC=$(echo $totals | cut -d' ' -f4)
     let unsafe_fn_LOC+=unsafe_fn_num
     let unsafe_total_LOC=unsafe_region_LOC+unsafe_fn_LOC
     #echo "# of unsafe trait:"
-    unsafe_trait_num=$(wc -l unsafe_trait.info | cut -d' ' -f1)
+    unsafe_trait_num=$(echo $totals | cut -d' ' -f5)
+    let total_LOC+=$(echo $totals | cut -d' ' -f6)
 }
 
 function count_dir_fast() {
-    rm tmp unsafe_block.info unsafe_fn.info unsafe_trait.info
     input_dir="$1"
-    array=()
-    while IFS=  read -r -d $'\0'; do
-        array+=("$REPLY")
-    done < <(find "${input_dir}" -type f -name "*.rs" -print0)
-
-    for i in "${array[@]}"; do
-        #echo $i
-        count_one_file "$i"
-    done
+    count_files "${input_dir}"
     #echo "# and LOC of unsafe block:"
-    unsafe_regions=$(./sum.py unsafe_block.info)
-    unsafe_region_num=$(echo $unsafe_regions | cut -d' ' -f1)
+    unsafe_region_num=$(echo $totals | cut -d' ' -f1)
     #echo "# and LOC of unsafe fn:"
-    unsafe_fn_num=$(wc -l unsafe_fn.info | cut -d' ' -f1)
+    unsafe_fn_num=$(echo $totals | cut -d' ' -f3)
     #echo "# of unsafe trait:"
-    unsafe_trait_num=$(wc -l unsafe_trait.info | cut -d' ' -f1)
+    unsafe_trait_num=$(echo $totals | cut -d' ' -f5)
+    let total_LOC+=$(echo $totals | cut -d' ' -f6)
 }
 
 function parse_libstd() {
@@ -284,6 +272,7 @@ function count_std_pub_mod() {
     echo "thread" ${unsafe_fn_num} ${unsafe_region_num} ${unsafe_trait_num} ${unsafe_total_LOC} ${total_LOC}
 }
 
+count_tree
 count_std
 count_apps
 count_std_pub_mod
@@ -3,7 +3,21 @@
 
 import sys
 
+def sum_counts(input_file_path):
+    # Records of comment_remover -c: six counts followed by the path.
+    totals = [0] * 6
+    with open(input_file_path, errors="replace") as infile:
+        for line in infile:
+            fields = line.split(" ", 6)
+            assert len(fields) == 7
+            for i in range(6):
+                totals[i] += int(fields[i])
+    print(" ".join(str(total) for total in totals))
+
 def main():
+    if sys.argv[1] == "-c":
+        sum_counts(sys.argv[2])
+        return
     input_file_path =sys.argv[1]
     sum_LOC = 0
     with open(input_file_path) as infile:
@@ -61,8 +61,15 @@ def extract_macro(lines):
     return unsafe_block_infos
 
 def main():
-    with open(sys.argv[1]) as infile:
-        lines = infile.readlines()
+    # Several files can be given at once, e.g. the output directory of
+    # comment_remover -o; each is parsed on its own.
+    for input_file_path in sys.argv[1:]:
+        try:
+            with open(input_file_path) as infile:
+                lines = infile.readlines()
+        except UnicodeDecodeError as e:
+            print(input_file_path + ": " + str(e), file=sys.stderr)
+            continue
         unsafe_block_infos = extract_macro(lines)
         for unsafe_block_info in unsafe_block_infos:
             print(unsafe_block_info)
@@ -67,8 +67,15 @@ def extract_unsafe_fn(lines):
     return unsafe_fn_infos
 
 def main():
-    with open(sys.argv[1]) as infile:
-        lines = infile.readlines()
+    # Several files can be given at once, e.g. the output directory of
+    # comment_remover -o; each is parsed on its own.
+    for input_file_path in sys.argv[1:]:
+        try:
+            with open(input_file_path) as infile:
+                lines = infile.readlines()
+        except UnicodeDecodeError as e:
+            print(input_file_path + ": " + str(e), file=sys.stderr)
+            continue
         unsafe_fn_infos = extract_unsafe_fn(lines)
         for unsafe_fn_info in unsafe_fn_infos:
             print(unsafe_fn_info)
@@ -0,0 +1,274 @@
+#ifndef PRINTPASS_LOCKSITEANALYSIS_H
+#define PRINTPASS_LOCKSITEANALYSIS_H
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/MD5.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Common/DenseIndex.h"
+#include "Common/LockAPI.h"
+
+namespace llvm {
+    class PassRegistry;
+
+    void initializeLockSiteAnalysisPass(PassRegistry &Registry);
+}
+
+typedef llvm::SmallPtrSet<llvm::Instruction *, 8> DropSet;
+
+// Intermediate sets of the guard pattern behind a bitcast of a lock result
+// (see traceResult). They are cleared and kept per bitcast, so that their
+// storage is reused by all lock sites of a module.
+struct CastTraceSets {
+    typedef llvm::SmallPtrSet<llvm::Instruction *, 4> InstSet;
+
+    InstSet setCastLoad;
+    InstSet setICmp0;
+    InstSet setGEP01;
+    InstSet setGEP00;
+    InstSet setLoad;
+    InstSet setStore;
+    InstSet setGEPGuard;
+    InstSet setLockGuard;
+    InstSet setLoadLockGuard;
+
+    void clear() {
+        setCastLoad.clear();
+        setICmp0.clear();
+        setGEP01.clear();
+        setGEP00.clear();
+        setLoad.clear();
+        setStore.clear();
+        setGEPGuard.clear();
+        setLockGuard.clear();
+        setLoadLockGuard.clear();
+    }
+};
+
+// A call of a lock function. Functions returning void write their guard
+// (or LockResult) through the sret argument 0 and take the lock as
+// argument 1; all others return the guard and take the lock as argument 0.
+struct LockSite {
+    llvm::Instruction *LockInst;
+    llvm::Function *Callee;
+    LockAPIKind Kind;
+    llvm::Value *LockValue;    // null if the call has too few arguments
+    llvm::Value *ResultValue;
+};
+
+// Memo tables of the drop tracers, shared by all lock sites of a module.
+// Lock sites whose guards flow into the same storage look it up once. Each
+// lock site may visit at most Budget use-list entries (0 means no limit);
+// results of a trace that ran out of budget are not memoized.
+struct DropTraceCache {
+    unsigned Budget;
+    uint64_t Remaining;
+    bool Truncated;
+    unsigned NumTruncated;
+
+    // Drops reached from a guard value, and from a location it is stored to.
+    llvm::DenseMap<llvm::Value *, DropSet> mapGuardDrops;
+    llvm::DenseMap<llvm::Value *, DropSet> mapStoredDrops;
+    // By function index: instructions from which no manual drop is reachable.
+    std::vector<llvm::BitVector> vecNoManualDrop;
+    // Scratch of traceResult.
+    CastTraceSets CastSets;
+};
+
+// Interprocedural summaries of the manual drop tracing, by function index.
+// vecArgDrops[i] holds the manual drops that a guard passed as argument i
+// reaches in the function or its callees; setReturnDrops those that a guard
+// returned by the function reaches at its call sites. Each is computed once,
+// on first use; a query that recurses into a summary still in progress sees
+// it as empty.
+enum class SummaryState : uint8_t {
+    None,
+    InProgress,
+    Done
+};
+
+struct FuncDropSummary {
+    std::vector<DropSet> vecArgDrops;
+    std::vector<SummaryState> vecArgState;
+    DropSet setReturnDrops;
+    SummaryState ReturnState = SummaryState::None;
+};
+
+struct ManualDropSummaries {
+    std::vector<FuncDropSummary> vecFuncs;
+    // By function index: the calls of the function, built on first use.
+    std::vector<std::vector<llvm::Instruction *>> vecCallSites;
+    bool CallSitesDone = false;
+};
+
+// Indirect calls of a module that were resolved with an IndirectCallTable:
+// calls given at least one target, the edges added for them, and calls
+// left out for having more targets than the fan-out limit.
+struct IndirectCallStats {
+    unsigned NumResolved = 0;
+    unsigned NumEdges = 0;
+    unsigned NumCapped = 0;
+};
+
+// Everything the lock passes need from one scan over a module: the dense
+// index, the callee classification, the direct call graph and the lock
+// sites in module order. The drops of a lock site are traced on first
+// request and cached, so passes sharing the result trace every guard once.
+class LockSiteInfo {
+public:
+    static const unsigned DefaultDropTraceBudget = 100000;
+
+    // Scans the functions of M with NumThreads threads. With an
+    // IndirectFanOut other than 0, the call graph also has an edge from each
+    // indirect call to each of its candidate callees (see
+    // IndirectCallTable) if there are at most IndirectFanOut of them.
+    LockSiteInfo(llvm::Module &M, const LockAPIMatcher &Matcher, unsigned NumThreads,
+                 unsigned DropTraceBudget = DefaultDropTraceBudget, unsigned IndirectFanOut = 0);
+
+    const ModuleIndex &getIndex() const {
+        return MI;
+    }
+
+    const LockAPIClassifier &getClassifier() const {
+        return LAC;
+    }
+
+    const DenseCallGraph &getCallGraph() const {
+        return CG;
+    }
+
+    unsigned getIndirectFanOut() const {
+        return IndirectFanOut;
+    }
+
+    const IndirectCallStats &getIndirectCallStats() const {
+        return IndirectCalls;
+    }
+
+    const std::vector<LockSite> &getLockSites() const {
+        return vecSites;
+    }
+
+    // Drops (of any kind) that release the guard of lock site Idx, as the
+    // double lock detector needs them: for std locks through the LockResult
+    // and Result::unwrap and friends.
+    const DropSet &getGuardDrops(unsigned Idx);
+
+    // core::mem::drop calls reached from the guard of lock site Idx through
+    // users and stored-to locations. Returns false if there are none.
+    bool getManualDrops(unsigned Idx, const DropSet *&Drops);
+
+    // Like getManualDrops, but if the guard has no manual drop in its own
+    // function, follows it into callees that drop an argument and, if it is
+    // returned, to the call sites of the function.
+    bool getInterProcManualDrops(unsigned Idx, const DropSet *&Drops);
+
+    const llvm::MD5::MD5Result &getMatcherHash() const {
+        return MatcherHash;
+    }
+
+    unsigned getDropTraceBudget() const {
+        return Cache.Budget;
+    }
+
+    // Forgets all traced drops if Budget differs from the current budget.
+    void setDropTraceBudget(unsigned Budget);
+
+    // Number of lock site traces that ran out of budget so far.
+    unsigned getNumTruncatedTraces() const {
+        return Cache.NumTruncated;
+    }
+
+private:
+    llvm::Module &M;
+    ModuleIndex MI;
+    LockAPIClassifier LAC;
+    unsigned IndirectFanOut;
+    DenseCallGraph CG;
+    IndirectCallStats IndirectCalls;
+    std::vector<LockSite> vecSites;
+    llvm::MD5::MD5Result MatcherHash;
+
+    // By lock site index; valid once the bit in the matching BitVector is set.
+    std::vector<DropSet> vecGuardDrops;
+    llvm::BitVector GuardDropsDone;
+    std::vector<DropSet> vecManualDrops;
+    llvm::BitVector ManualDropsDone;
+    llvm::BitVector HasManualDrops;
+    std::vector<DropSet> vecInterProcDrops;
+    llvm::BitVector InterProcDropsDone;
+    ManualDropSummaries Summaries;
+    DropTraceCache Cache;
+};
+
+// The LockSiteInfo of one module, scanned on the first request. A later
+// request with a different lock API table or indirect call fan-out scans
+// the module again; one with a different budget traces the drops again.
+class LockSiteResult {
+public:
+    explicit LockSiteResult(llvm::Module &M) : pModule(&M) {}
+
+    LockSiteInfo &getLockSites(const LockAPIMatcher &Matcher, unsigned NumThreads = 1,
+                               unsigned DropTraceBudget = LockSiteInfo::DefaultDropTraceBudget,
+                               unsigned IndirectFanOut = 0);
+
+private:
+    llvm::Module *pModule;
+
+    std::unique_ptr<LockSiteInfo> Info;
+};
+
+// Legacy module analysis that owns the LockSiteResult of the module. Both the
+// double lock detector and the manual drop printer require it; when both
+// run in one opt invocation they share the scan as long as they use the
+// same lock API table.
+class LockSiteAnalysis : public llvm::ModulePass {
+public:
+    static char ID;
+
+    LockSiteAnalysis();
+
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const override;
+
+    bool runOnModule(llvm::Module &M) override;
+
+    void releaseMemory() override;
+
+    // The lock sites of the current module, see LockSiteResult.
+    LockSiteInfo &getLockSites(const LockAPIMatcher &Matcher, unsigned NumThreads = 1,
+                               unsigned DropTraceBudget = LockSiteInfo::DefaultDropTraceBudget,
+                               unsigned IndirectFanOut = 0);
+
+private:
+    std::unique_ptr<LockSiteResult> Result;
+};
+
+// The same for the new pass manager. The result is kept by the module
+// analysis manager until a pass does not preserve it. Each plugin links
+// CommonLib statically and so has its own Key: the result is cached per
+// plugin. The detector and the printer only share one result if the
+// dynamic linker happens to bind both to the same Key.
+class LockSiteModuleAnalysis : public llvm::AnalysisInfoMixin<LockSiteModuleAnalysis> {
+    friend llvm::AnalysisInfoMixin<LockSiteModuleAnalysis>;
+
+    static llvm::AnalysisKey Key;
+
+public:
+    typedef LockSiteResult Result;
+
+    Result run(llvm::Module &M, llvm::ModuleAnalysisManager &) {
+        return LockSiteResult(M);
+    }
+};
+
+#endif //PRINTPASS_LOCKSITEANALYSIS_H
@@ -0,0 +1,12 @@
+#ifndef PRINTPASS_TYPENAMES_H
+#define PRINTPASS_TYPENAMES_H
+
+#include "llvm/ADT/StringRef.h"
+
+// The name of a struct type without the ".N" suffixes that a context adds
+// when a type name it already has comes in again, e.g. from another crate
+// or module. All trailing suffixes are stripped, since a copy of a copy
+// ("T.1.2") names the same type as well.
+llvm::StringRef stripTypeSuffix(llvm::StringRef Name);
+
+#endif //PRINTPASS_TYPENAMES_H
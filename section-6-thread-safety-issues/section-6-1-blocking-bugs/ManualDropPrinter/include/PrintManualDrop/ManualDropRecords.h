@@ -0,0 +1,80 @@
+#ifndef RUSTBUGDETECTOR_MANUALDROPRECORDS_H
+#define RUSTBUGDETECTOR_MANUALDROPRECORDS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The manual drops of the lock sites of a module as a compact binary
+// stream (-print-records), instead of the "Manual Drop Info:" text log.
+//
+// A stream is a sequence of modules, so that the streams of several opt
+// runs can be appended to one file:
+//
+//   module := "MDR1" record* End
+//   record := String <uleb len> <bytes>       the next string ID
+//           | Lock <loc> <uleb n> <loc>*n      a lock and its manual drops
+//   loc    := <uleb 0>                         no debug location
+//           | <uleb dir+1> <uleb file> <uleb line>
+//
+// Directory and file names are interned per module, so every location is
+// three small integers.
+namespace detector {
+    static const char RecordMagic[] = {'M', 'D', 'R', '1'};
+
+    enum class RecordKind : uint8_t {
+        End = 0,
+        String = 1,
+        Lock = 2,
+    };
+
+    // A debug location; Line 0 means none.
+    struct RecordLocation {
+        llvm::StringRef Dir;
+        llvm::StringRef File;
+        unsigned Line = 0;
+
+        bool isValid() const {
+            return Line != 0;
+        }
+    };
+
+    struct LockRecord {
+        RecordLocation Lock;
+        llvm::SmallVector<RecordLocation, 4> vecDrops;
+    };
+
+    // Writes the records of one module. The End record is written by finish().
+    class RecordWriter {
+    public:
+        explicit RecordWriter(llvm::raw_ostream &OS);
+
+        void addLock(const RecordLocation &Lock, llvm::ArrayRef<RecordLocation> Drops);
+
+        void finish();
+
+    private:
+        void writeLocation(const RecordLocation &Loc);
+
+        unsigned intern(llvm::StringRef S);
+
+        llvm::raw_ostream &OS;
+        llvm::StringMap<unsigned> mapStrings;
+    };
+
+    // Calls OnLock for every lock of the stream in Buffer, in order. The
+    // strings of a record point into Buffer. Returns false and sets ErrMsg
+    // if the stream is malformed.
+    bool readRecords(llvm::StringRef Buffer,
+                     llvm::function_ref<void(const LockRecord &)> OnLock,
+                     std::string &ErrMsg);
+}
+
+#endif //RUSTBUGDETECTOR_MANUALDROPRECORDS_H
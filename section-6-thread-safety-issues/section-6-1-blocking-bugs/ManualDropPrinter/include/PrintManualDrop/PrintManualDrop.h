@@ -1,6 +1,7 @@
 #ifndef RUSTBUGDETECTOR_PRINTMANUALDROP_H
 #define RUSTBUGDETECTOR_PRINTMANUALDROP_H
 
+#include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 
 namespace detector {
@@ -19,6 +20,12 @@ namespace detector {
 
         llvm::Module *pModule;
     };
+
+    // The printer for the new pass manager (opt -passes=print-manual-drop).
+    struct PrintManualDropPass : public llvm::PassInfoMixin<PrintManualDropPass> {
+
+        llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &MAM);
+    };
 }
 
 
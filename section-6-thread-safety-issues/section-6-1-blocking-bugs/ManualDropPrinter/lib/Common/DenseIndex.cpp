@@ -0,0 +1,52 @@
+#include "Common/DenseIndex.h"
+
+using namespace llvm;
+
+const unsigned ModuleIndex::InvalidIdx;
+
+ModuleIndex::ModuleIndex(const Module &M) {
+    std::size_t NumValues = M.size();
+    for (const Function &F : M) {
+        NumValues += F.size();
+        for (const BasicBlock &BB : F) {
+            NumValues += BB.size();
+        }
+    }
+    mapIdx.reserve(NumValues);
+    vecFuncs.reserve(M.size());
+    vecNumBlocks.reserve(M.size());
+    vecNumInsts.reserve(M.size());
+
+    for (const Function &F : M) {
+        mapIdx[&F] = vecFuncs.size();
+        vecFuncs.push_back(const_cast<Function *>(&F));
+        unsigned NumBlocks = 0;
+        unsigned NumInsts = 0;
+        for (const BasicBlock &BB : F) {
+            mapIdx[&BB] = NumBlocks++;
+            for (const Instruction &I : BB) {
+                mapIdx[&I] = NumInsts++;
+            }
+        }
+        vecNumBlocks.push_back(NumBlocks);
+        vecNumInsts.push_back(NumInsts);
+    }
+}
+
+void DenseCallGraph::append(const DenseCallGraph &Part) {
+    unsigned Base = vecEdges.size();
+    vecEdges.insert(vecEdges.end(), Part.vecEdges.begin(), Part.vecEdges.end());
+    for (std::size_t i = 1; i < Part.vecOffsets.size(); ++i) {
+        vecOffsets.push_back(Base + Part.vecOffsets[i]);
+    }
+}
+
+std::pair<const CallEdge *, const CallEdge *> DenseCallGraph::getCallSite(unsigned Caller, unsigned InstIdx) const {
+    const CallEdge *B = begin(Caller);
+    const CallEdge *E = end(Caller);
+    auto byInstIdx = [](const CallEdge &L, const CallEdge &R) {
+        return L.InstIdx < R.InstIdx;
+    };
+    CallEdge Key = {nullptr, InstIdx, 0};
+    return std::equal_range(B, E, Key, byInstIdx);
+}
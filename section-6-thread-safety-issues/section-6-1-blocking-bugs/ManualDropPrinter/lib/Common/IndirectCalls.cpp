@@ -0,0 +1,167 @@
+#include "Common/IndirectCalls.h"
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+const unsigned IndirectCallTable::NoSlot;
+
+static bool isErasedEqual(Type *A, Type *B) {
+    if (A == B) {
+        return true;
+    }
+    return A->isPointerTy() && B->isPointerTy()
+           && A->getPointerAddressSpace() == B->getPointerAddressSpace();
+}
+
+static bool isCompatible(FunctionType *A, FunctionType *B) {
+    if (A == B) {
+        return true;
+    }
+    if (A->isVarArg() != B->isVarArg() || A->getNumParams() != B->getNumParams()) {
+        return false;
+    }
+    if (!isErasedEqual(A->getReturnType(), B->getReturnType())) {
+        return false;
+    }
+    for (unsigned i = 0; i < A->getNumParams(); ++i) {
+        if (!isErasedEqual(A->getParamType(i), B->getParamType(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+IndirectCallTable::IndirectCallTable(const Module &M, const ModuleIndex &MI, unsigned MaxFanOut) :
+    DL(M.getDataLayout()),
+    MaxFanOut(MaxFanOut) {
+    if (MaxFanOut == 0) {
+        return;
+    }
+
+    // Rust vtables are constant structs of the drop glue, size, alignment
+    // and the methods; slots are counted in pointers, as the loads of the
+    // calls address them.
+    uint64_t PtrSize = DL.getPointerSize();
+    for (const GlobalVariable &GV : M.globals()) {
+        if (!GV.isConstant() || !GV.hasDefinitiveInitializer()) {
+            continue;
+        }
+        const Constant *Init = GV.getInitializer();
+        const StructLayout *SL = nullptr;
+        uint64_t ElemSize = 0;
+        if (StructType *STy = dyn_cast<StructType>(Init->getType())) {
+            SL = DL.getStructLayout(STy);
+        } else if (ArrayType *ATy = dyn_cast<ArrayType>(Init->getType())) {
+            ElemSize = DL.getTypeAllocSize(ATy->getElementType());
+        } else {
+            continue;
+        }
+        for (unsigned i = 0; i < Init->getNumOperands(); ++i) {
+            const Function *F = dyn_cast<Function>(Init->getOperand(i)->stripPointerCasts());
+            if (!F || F->isDeclaration()) {
+                continue;
+            }
+            uint64_t Offset = SL ? SL->getElementOffset(i) : ElemSize * i;
+            if (Offset % PtrSize == 0) {
+                addTarget(Offset / PtrSize, F->getFunctionType(), MI.getFuncIdx(F));
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < MI.getNumFuncs(); ++i) {
+        Function *F = MI.getFunc(i);
+        if (!F->isDeclaration() && F->hasAddressTaken()) {
+            addTarget(NoSlot, F->getFunctionType(), i);
+        }
+    }
+
+    // A function is in as many vtables as it has implementing types.
+    for (auto &Entry : mapBuckets) {
+        for (Bucket &B : Entry.second) {
+            std::sort(B.vecTargets.begin(), B.vecTargets.end());
+            B.vecTargets.erase(std::unique(B.vecTargets.begin(), B.vecTargets.end()), B.vecTargets.end());
+        }
+    }
+}
+
+void IndirectCallTable::addTarget(unsigned Slot, FunctionType *Ty, unsigned FuncIdx) {
+    std::vector<Bucket> &vecBuckets = mapBuckets[BucketKey(Slot, Ty->getNumParams())];
+    for (Bucket &B : vecBuckets) {
+        if (isCompatible(B.Ty, Ty)) {
+            B.vecTargets.push_back(FuncIdx);
+            return;
+        }
+    }
+    Bucket B = {Ty, std::vector<unsigned>(1, FuncIdx)};
+    vecBuckets.push_back(std::move(B));
+}
+
+const IndirectCallTable::Bucket *IndirectCallTable::findBucket(unsigned Slot, FunctionType *Ty) const {
+    auto It = mapBuckets.find(BucketKey(Slot, Ty->getNumParams()));
+    if (It == mapBuckets.end()) {
+        return nullptr;
+    }
+    for (const Bucket &B : It->second) {
+        if (isCompatible(B.Ty, Ty)) {
+            return &B;
+        }
+    }
+    return nullptr;
+}
+
+// The slot of the vtable that Callee is loaded from, or NoSlot if it is
+// not loaded at a constant offset from a pointer that could be a vtable.
+unsigned IndirectCallTable::getSlot(Value *Callee) const {
+    LoadInst *Load = dyn_cast<LoadInst>(Callee->stripPointerCasts());
+    if (!Load) {
+        return NoSlot;
+    }
+    Value *Ptr = Load->getPointerOperand();
+    APInt Offset(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
+    Value *Base = Ptr->stripAndAccumulateInBoundsConstantOffsets(DL, Offset);
+    // The vtable pointer is part of a fat pointer, never a local itself.
+    if (isa<AllocaInst>(Base) || isa<GlobalVariable>(Base)) {
+        return NoSlot;
+    }
+    uint64_t PtrSize = DL.getPointerSize();
+    if (Offset.isNegative() || Offset.getZExtValue() % PtrSize != 0) {
+        return NoSlot;
+    }
+    return Offset.getZExtValue() / PtrSize;
+}
+
+ArrayRef<unsigned> IndirectCallTable::getTargets(CallSite CS, bool &Capped) const {
+    Capped = false;
+    if (MaxFanOut == 0) {
+        return None;
+    }
+    Value *Callee = CS.getCalledValue();
+    // Inline asm, and direct calls through a cast, are not function pointers.
+    if (isa<InlineAsm>(Callee) || isa<Function>(Callee->stripPointerCasts())) {
+        return None;
+    }
+    FunctionType *Ty = CS.getFunctionType();
+    const Bucket *B = nullptr;
+    unsigned Slot = getSlot(Callee);
+    if (Slot != NoSlot) {
+        B = findBucket(Slot, Ty);
+    }
+    if (!B) {
+        B = findBucket(NoSlot, Ty);
+    }
+    if (!B) {
+        return None;
+    }
+    if (B->vecTargets.size() > MaxFanOut) {
+        Capped = true;
+        return None;
+    }
+    return B->vecTargets;
+}
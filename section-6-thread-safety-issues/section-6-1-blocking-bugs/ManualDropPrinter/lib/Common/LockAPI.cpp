@@ -0,0 +1,284 @@
+#include "Common/LockAPI.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstring>
+#include <queue>
+
+using namespace llvm;
+
+namespace {
+
+    struct BuiltinPattern {
+        LockAPIKind Kind;
+        const char *Text;
+    };
+
+    // All built-in patterns are prefixes of legacy-mangled names.
+    const BuiltinPattern BuiltinPatterns[] = {
+        {LockAPIKind::LockAPI, "_ZN8lock_api6rwlock19RwLock$LT$R$C$T$GT$4read17h"},
+        {LockAPIKind::LockAPI, "_ZN8lock_api6rwlock19RwLock$LT$R$C$T$GT$5write17h"},
+        {LockAPIKind::LockAPI, "_ZN8lock_api5mutex18Mutex$LT$R$C$T$GT$4lock17h"},
+        {LockAPIKind::StdMutexLock, "_ZN3std4sync5mutex14Mutex$LT$T$GT$4lock17h"},
+        {LockAPIKind::StdRwLockRead, "_ZN3std4sync6rwlock15RwLock$LT$T$GT$4read17h"},
+        {LockAPIKind::StdRwLockWrite, "_ZN3std4sync6rwlock15RwLock$LT$T$GT$5write17h"},
+        {LockAPIKind::AutoDrop, "_ZN4core3ptr18real_drop_in_place17h"},
+        {LockAPIKind::ManualDrop, "_ZN4core3mem4drop17h"},
+        {LockAPIKind::ResultToInner, "_ZN4core6result19Result$LT$T$C$E$GT$6unwrap17h"},
+        {LockAPIKind::ResultToInner, "_ZN4core6result19Result$LT$T$C$E$GT$9unwrap_or17h"},
+        {LockAPIKind::ResultToInner, "_ZN4core6result19Result$LT$T$C$E$GT$14unwrap_or_else17h"},
+        {LockAPIKind::ResultToInner, "_ZN4core6result19Result$LT$T$C$E$GT$17unwrap_or_default17h"},
+        {LockAPIKind::ResultToInner, "_ZN4core6result19Result$LT$T$C$E$GT$6expect17h"},
+    };
+
+    // Features of the generic lock-name heuristic.
+    enum : unsigned {
+        F_MUTEX = 1 << 0,       // mutex, Mutex
+        F_RAW_MUTEX = 1 << 1,   // raw_mutex, RawMutex
+        F_LOCK = 1 << 2,        // GT$4lock
+        F_RWLOCK = 1 << 3,      // rwlock, RwLock
+        F_HANDY = 1 << 4,       // HandyRwLock rl/wl, anchored
+        F_RAW_RWLOCK = 1 << 5,  // raw_rwlock, RawRwLock
+        F_READ_WRITE = 1 << 6,  // $GT$4read, $GT$5write
+    };
+
+    bool isGenericLockName(unsigned Features) {
+        if (Features & F_MUTEX) {
+            return !(Features & F_RAW_MUTEX) && (Features & F_LOCK);
+        } else if (Features & F_RWLOCK) {
+            if (Features & F_HANDY) {
+                return true;
+            }
+            return !(Features & F_RAW_RWLOCK) && (Features & F_READ_WRITE);
+        }
+        return false;
+    }
+
+    const struct {
+        LockAPIKind Kind;
+        const char *Name;
+    } KindNames[] = {
+        {LockAPIKind::None, "none"},
+        {LockAPIKind::LockAPI, "lock-api"},
+        {LockAPIKind::StdMutexLock, "std-mutex-lock"},
+        {LockAPIKind::StdRwLockRead, "std-rwlock-read"},
+        {LockAPIKind::StdRwLockWrite, "std-rwlock-write"},
+        {LockAPIKind::GenericLock, "generic-lock"},
+        {LockAPIKind::AutoDrop, "auto-drop"},
+        {LockAPIKind::ManualDrop, "manual-drop"},
+        {LockAPIKind::ResultToInner, "result-to-inner"},
+    };
+}
+
+bool isLockKind(LockAPIKind Kind) {
+    switch (Kind) {
+        case LockAPIKind::LockAPI:
+        case LockAPIKind::StdMutexLock:
+        case LockAPIKind::StdRwLockRead:
+        case LockAPIKind::StdRwLockWrite:
+        case LockAPIKind::GenericLock:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isDropKind(LockAPIKind Kind) {
+    return Kind == LockAPIKind::AutoDrop || Kind == LockAPIKind::ManualDrop;
+}
+
+const char *getLockAPIKindName(LockAPIKind Kind) {
+    for (auto &KN : KindNames) {
+        if (KN.Kind == Kind) {
+            return KN.Name;
+        }
+    }
+    return "none";
+}
+
+bool parseLockAPIKind(StringRef Name, LockAPIKind &Kind) {
+    for (auto &KN : KindNames) {
+        if (Name == KN.Name) {
+            Kind = KN.Kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+LockAPIMatcher::LockAPIMatcher() : NumClasses(0) {
+    for (auto &BP : BuiltinPatterns) {
+        vecPatterns.push_back({BP.Text, true, BP.Kind, 0});
+    }
+    addFeature(F_MUTEX, false, "mutex");
+    addFeature(F_MUTEX, false, "Mutex");
+    addFeature(F_RAW_MUTEX, false, "raw_mutex");
+    addFeature(F_RAW_MUTEX, false, "RawMutex");
+    addFeature(F_LOCK, false, "GT$4lock");
+    addFeature(F_RWLOCK, false, "rwlock");
+    addFeature(F_RWLOCK, false, "RwLock");
+    addFeature(F_HANDY, true, "HandyRwLock$LT$T$GT$$GT$2rl");
+    addFeature(F_HANDY, true, "HandyRwLock$LT$T$GT$$GT$2wl");
+    addFeature(F_RAW_RWLOCK, false, "raw_rwlock");
+    addFeature(F_RAW_RWLOCK, false, "RawRwLock");
+    addFeature(F_READ_WRITE, false, "$GT$4read");
+    addFeature(F_READ_WRITE, false, "$GT$5write");
+    compile();
+}
+
+void LockAPIMatcher::addFeature(unsigned Feature, bool Anchored, StringRef Text) {
+    vecPatterns.push_back({Text.str(), Anchored, LockAPIKind::None, Feature});
+}
+
+void LockAPIMatcher::addPattern(LockAPIKind Kind, bool Anchored, StringRef Pattern) {
+    vecPatterns.push_back({Pattern.str(), Anchored, Kind, 0});
+    compile();
+}
+
+bool LockAPIMatcher::loadTable(StringRef Path, std::string &ErrMsg) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr = MemoryBuffer::getFile(Path);
+    if (!BufOrErr) {
+        ErrMsg = Path.str() + ": " + BufOrErr.getError().message();
+        return false;
+    }
+    SmallVector<StringRef, 64> Lines;
+    (*BufOrErr)->getBuffer().split(Lines, '\n');
+    for (std::size_t i = 0; i < Lines.size(); ++i) {
+        StringRef Line = Lines[i].split('#').first.trim();
+        if (Line.empty()) {
+            continue;
+        }
+        SmallVector<StringRef, 3> Fields;
+        Line.split(Fields, ' ', -1, false);
+        LockAPIKind Kind;
+        if (Fields.size() != 3 || !parseLockAPIKind(Fields[0], Kind)
+            || (Fields[1] != "prefix" && Fields[1] != "contains")) {
+            ErrMsg = Path.str() + ":" + std::to_string(i + 1) + ": expected \"<kind> prefix|contains <pattern>\"";
+            return false;
+        }
+        vecPatterns.push_back({Fields[2].str(), Fields[1] == "prefix", Kind, 0});
+    }
+    compile();
+    return true;
+}
+
+void LockAPIMatcher::compile() {
+    // Only bytes that occur in some pattern get their own class; every
+    // other byte falls back to class 0, which always leads to the root.
+    std::memset(ByteClass, 0, sizeof(ByteClass));
+    NumClasses = 1;
+    for (const Pattern &P : vecPatterns) {
+        for (char C : P.Text) {
+            unsigned char B = static_cast<unsigned char>(C);
+            if (ByteClass[B] == 0) {
+                ByteClass[B] = NumClasses++;
+            }
+        }
+    }
+
+    const unsigned None = ~0u;
+    vecGoto.assign(NumClasses, None);
+    vecOutputs.assign(1, std::vector<unsigned>());
+    for (unsigned Id = 0; Id < vecPatterns.size(); ++Id) {
+        unsigned State = 0;
+        for (char C : vecPatterns[Id].Text) {
+            unsigned &Next = vecGoto[State * NumClasses + ByteClass[static_cast<unsigned char>(C)]];
+            if (Next == None) {
+                Next = vecOutputs.size();
+                vecOutputs.push_back(std::vector<unsigned>());
+                vecGoto.resize(vecGoto.size() + NumClasses, None);
+            }
+            State = vecGoto[State * NumClasses + ByteClass[static_cast<unsigned char>(C)]];
+        }
+        vecOutputs[State].push_back(Id);
+    }
+
+    // Breadth-first: turn the trie into a DFA by resolving failure links.
+    std::vector<unsigned> vecFail(vecOutputs.size(), 0);
+    std::queue<unsigned> WorkList;
+    for (unsigned C = 0; C < NumClasses; ++C) {
+        unsigned &Next = vecGoto[C];
+        if (Next == None) {
+            Next = 0;
+        } else {
+            vecFail[Next] = 0;
+            WorkList.push(Next);
+        }
+    }
+    while (!WorkList.empty()) {
+        unsigned State = WorkList.front();
+        WorkList.pop();
+        unsigned Fail = vecFail[State];
+        for (unsigned C = 0; C < NumClasses; ++C) {
+            unsigned &Next = vecGoto[State * NumClasses + C];
+            if (Next == None) {
+                Next = vecGoto[Fail * NumClasses + C];
+            } else {
+                vecFail[Next] = vecGoto[Fail * NumClasses + C];
+                const std::vector<unsigned> &Inherited = vecOutputs[vecFail[Next]];
+                vecOutputs[Next].insert(vecOutputs[Next].end(), Inherited.begin(), Inherited.end());
+                WorkList.push(Next);
+            }
+        }
+    }
+}
+
+LockAPIKind LockAPIMatcher::match(StringRef Name) const {
+    unsigned State = 0;
+    unsigned Features = 0;
+    LockAPIKind Best = LockAPIKind::None;
+    std::size_t BestLen = 0;
+    for (std::size_t i = 0; i < Name.size(); ++i) {
+        State = vecGoto[State * NumClasses + ByteClass[static_cast<unsigned char>(Name[i])]];
+        for (unsigned Id : vecOutputs[State]) {
+            const Pattern &P = vecPatterns[Id];
+            if (P.Anchored && i + 1 != P.Text.size()) {
+                continue;
+            }
+            if (P.Kind == LockAPIKind::None) {
+                Features |= P.Feature;
+            } else if (P.Text.size() > BestLen) {
+                Best = P.Kind;
+                BestLen = P.Text.size();
+            }
+        }
+    }
+    if (Best != LockAPIKind::None) {
+        return Best;
+    }
+    if (isGenericLockName(Features)) {
+        return LockAPIKind::GenericLock;
+    }
+    return LockAPIKind::None;
+}
+
+void LockAPIMatcher::hash(MD5 &Hash) const {
+    for (const Pattern &P : vecPatterns) {
+        uint8_t Header[3] = {static_cast<uint8_t>(P.Kind), static_cast<uint8_t>(P.Anchored), static_cast<uint8_t>(P.Feature)};
+        Hash.update(makeArrayRef(Header));
+        Hash.update(P.Text);
+        Hash.update(StringRef("\0", 1));
+    }
+}
+
+LockAPIClassifier::LockAPIClassifier(const LockAPIMatcher &Matcher) : Matcher(Matcher) {}
+
+void LockAPIClassifier::classifyModule(const Module &M) {
+    mapFuncKind.clear();
+    mapFuncKind.reserve(M.size());
+    for (const Function &F : M) {
+        mapFuncKind[&F] = Matcher.match(F.getName());
+    }
+}
+
+LockAPIKind LockAPIClassifier::getKind(const Function *F) const {
+    if (!F) {
+        return LockAPIKind::None;
+    }
+    auto it = mapFuncKind.find(F);
+    if (it != mapFuncKind.end()) {
+        return it->second;
+    }
+    return Matcher.match(F->getName());
+}
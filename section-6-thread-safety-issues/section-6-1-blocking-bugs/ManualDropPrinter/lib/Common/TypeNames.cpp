@@ -0,0 +1,19 @@
+#include "Common/TypeNames.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+StringRef stripTypeSuffix(StringRef Name) {
+    while (true) {
+        std::size_t Dot = Name.rfind('.');
+        if (Dot == StringRef::npos || Dot + 1 == Name.size()) {
+            return Name;
+        }
+        StringRef Suffix = Name.substr(Dot + 1);
+        if (!std::all_of(Suffix.begin(), Suffix.end(), [](char C) { return C >= '0' && C <= '9'; })) {
+            return Name;
+        }
+        Name = Name.take_front(Dot);
+    }
+}
@@ -0,0 +1,168 @@
+#include "PrintManualDrop/ManualDropRecords.h"
+
+#include "llvm/Support/LEB128.h"
+
+using namespace llvm;
+
+namespace detector {
+
+    RecordWriter::RecordWriter(raw_ostream &OS) : OS(OS) {
+        OS.write(RecordMagic, sizeof(RecordMagic));
+    }
+
+    unsigned RecordWriter::intern(StringRef S) {
+        auto It = mapStrings.insert(std::make_pair(S, (unsigned)mapStrings.size()));
+        if (It.second) {
+            OS << char(RecordKind::String);
+            encodeULEB128(S.size(), OS);
+            OS << S;
+        }
+        return It.first->second;
+    }
+
+    void RecordWriter::writeLocation(const RecordLocation &Loc) {
+        if (!Loc.isValid()) {
+            encodeULEB128(0, OS);
+            return;
+        }
+        encodeULEB128(intern(Loc.Dir) + 1, OS);
+        encodeULEB128(intern(Loc.File), OS);
+        encodeULEB128(Loc.Line, OS);
+    }
+
+    void RecordWriter::addLock(const RecordLocation &Lock, ArrayRef<RecordLocation> Drops) {
+        // The strings of a record precede it.
+        for (const RecordLocation &Loc : Drops) {
+            if (Loc.isValid()) {
+                intern(Loc.Dir);
+                intern(Loc.File);
+            }
+        }
+        if (Lock.isValid()) {
+            intern(Lock.Dir);
+            intern(Lock.File);
+        }
+        OS << char(RecordKind::Lock);
+        writeLocation(Lock);
+        encodeULEB128(Drops.size(), OS);
+        for (const RecordLocation &Loc : Drops) {
+            writeLocation(Loc);
+        }
+    }
+
+    void RecordWriter::finish() {
+        OS << char(RecordKind::End);
+    }
+
+    namespace {
+        // Reads the modules of one stream.
+        class RecordReader {
+        public:
+            explicit RecordReader(StringRef Buffer) :
+                Pos(Buffer.bytes_begin()),
+                BufEnd(Buffer.bytes_end()) {
+            }
+
+            bool readStream(function_ref<void(const LockRecord &)> OnLock, std::string &ErrMsg);
+
+        private:
+            bool readULEB(uint64_t &Value);
+
+            bool readLocation(RecordLocation &Loc);
+
+            const uint8_t *Pos;
+            const uint8_t *BufEnd;
+            std::vector<StringRef> vecStrings;
+        };
+    }
+
+    bool RecordReader::readULEB(uint64_t &Value) {
+        unsigned N = 0;
+        const char *Error = nullptr;
+        Value = decodeULEB128(Pos, &N, BufEnd, &Error);
+        if (Error) {
+            return false;
+        }
+        Pos += N;
+        return true;
+    }
+
+    bool RecordReader::readLocation(RecordLocation &Loc) {
+        uint64_t Dir, File, Line;
+        if (!readULEB(Dir)) {
+            return false;
+        }
+        if (Dir == 0) {
+            Loc = RecordLocation();
+            return true;
+        }
+        if (!readULEB(File) || !readULEB(Line)) {
+            return false;
+        }
+        if (Dir > vecStrings.size() || File >= vecStrings.size() || Line == 0) {
+            return false;
+        }
+        Loc.Dir = vecStrings[Dir - 1];
+        Loc.File = vecStrings[File];
+        Loc.Line = Line;
+        return true;
+    }
+
+    bool RecordReader::readStream(function_ref<void(const LockRecord &)> OnLock, std::string &ErrMsg) {
+        LockRecord Record;
+        while (Pos != BufEnd) {
+            if (std::size_t(BufEnd - Pos) < sizeof(RecordMagic) || !std::equal(RecordMagic, RecordMagic + sizeof(RecordMagic), Pos)) {
+                ErrMsg = "not a manual drop record stream";
+                return false;
+            }
+            Pos += sizeof(RecordMagic);
+            vecStrings.clear();
+            bool Done = false;
+            while (!Done) {
+                if (Pos == BufEnd) {
+                    ErrMsg = "truncated module";
+                    return false;
+                }
+                RecordKind Kind = RecordKind(*Pos++);
+                uint64_t Size;
+                switch (Kind) {
+                case RecordKind::End:
+                    Done = true;
+                    break;
+                case RecordKind::String:
+                    if (!readULEB(Size) || Size > std::size_t(BufEnd - Pos)) {
+                        ErrMsg = "truncated string";
+                        return false;
+                    }
+                    vecStrings.push_back(StringRef(reinterpret_cast<const char *>(Pos), Size));
+                    Pos += Size;
+                    break;
+                case RecordKind::Lock:
+                    Record.vecDrops.clear();
+                    if (!readLocation(Record.Lock) || !readULEB(Size)) {
+                        ErrMsg = "malformed lock record";
+                        return false;
+                    }
+                    for (uint64_t i = 0; i < Size; ++i) {
+                        RecordLocation Drop;
+                        if (!readLocation(Drop)) {
+                            ErrMsg = "malformed lock record";
+                            return false;
+                        }
+                        Record.vecDrops.push_back(Drop);
+                    }
+                    OnLock(Record);
+                    break;
+                default:
+                    ErrMsg = "unknown record kind " + std::to_string(unsigned(Kind));
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool readRecords(StringRef Buffer, function_ref<void(const LockRecord &)> OnLock, std::string &ErrMsg) {
+        return RecordReader(Buffer).readStream(OnLock, ErrMsg);
+    }
+}
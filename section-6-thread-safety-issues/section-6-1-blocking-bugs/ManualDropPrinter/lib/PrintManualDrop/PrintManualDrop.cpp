@@ -1,17 +1,22 @@
 #include "PrintManualDrop/PrintManualDrop.h"
+#include "PrintManualDrop/ManualDropRecords.h"
 
-#include <set>
-#include <stack>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "llvm/Pass.h"
-#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
-#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 
-#include "Common/CallerFunc.h"
+#include "Common/LockAPI.h"
+#include "Common/LockSiteAnalysis.h"
 
 #define DEBUG_TYPE "PrintManualDrop"
 
@@ -19,12 +24,47 @@ using namespace llvm;
 
 namespace detector {
 
+    static cl::opt<std::string> LockAPITable(
+            "print-lock-api-table",
+            cl::desc("File of extra \"<kind> prefix|contains <pattern>\" lock/drop API patterns"),
+            cl::value_desc("filename"));
+
+    static cl::opt<unsigned> DropTraceBudget(
+            "print-drop-trace-budget",
+            cl::desc("Use-list entries the drop tracing of one lock site may visit (0 for no limit)"),
+            cl::init(LockSiteInfo::DefaultDropTraceBudget));
+
+    static cl::opt<bool> InterProc(
+            "print-interproc",
+            cl::desc("Follow guards into callees that drop them and out of functions that return them"),
+            cl::init(false));
+
+    static cl::opt<std::string> RecordsFile(
+            "print-records",
+            cl::desc("Append the manual drops as binary records to this file instead of printing them"),
+            cl::value_desc("filename"));
+
+    static const LockAPIMatcher &getLockAPIMatcher() {
+        static const LockAPIMatcher Matcher = []() {
+            LockAPIMatcher M;
+            std::string ErrMsg;
+            if (!LockAPITable.empty() && !M.loadTable(LockAPITable, ErrMsg)) {
+                errs() << "Cannot load lock API table: " << ErrMsg << "\n";
+            }
+            return M;
+        }();
+        return Matcher;
+    }
+
     char PrintManualDrop::ID = 0;
 
-    PrintManualDrop::PrintManualDrop() : ModulePass(ID) {}
+    PrintManualDrop::PrintManualDrop() : ModulePass(ID) {
+        initializeLockSiteAnalysisPass(*PassRegistry::getPassRegistry());
+    }
 
     void PrintManualDrop::getAnalysisUsage(AnalysisUsage &AU) const {
         AU.setPreservesAll();
+        AU.addRequired<LockSiteAnalysis>();
     }
 
     static bool printDebugInfo(Instruction *I) {
@@ -42,222 +82,126 @@ namespace detector {
         }
     }
 
-    static bool skipInst(Instruction *I) {
-        if (!I) {
-            return true;
-        }
-        if (isa<PHINode>(I)) {
-            return true;
-        }
-        if (isa<DbgInfoIntrinsic>(I)) {
-            return true;
+    static RecordLocation getRecordLocation(Instruction *I) {
+        RecordLocation Loc;
+        if (const DILocation *DI = I->getDebugLoc().get()) {
+            Loc.Dir = DI->getDirectory();
+            Loc.File = DI->getFilename();
+            Loc.Line = DI->getLine();
         }
-        return false;
+        return Loc;
     }
 
-    static bool isLockFunc(Function *F) {
-        if (!F) {
-            return false;
-        }
-        StringRef Name = F->getName();
-        // Check Mutex
-        if (Name.find("mutex") != StringRef::npos || Name.find("Mutex") != StringRef::npos) {
-            if (Name.find("raw_mutex") != StringRef::npos|| Name.find("RawMutex") != StringRef::npos) {
-                return false;
-            } else if (Name.find("GT$4lock") != StringRef::npos) {
-                return true;
-            }
-        } else if (Name.find("rwlock") != StringRef::npos || Name.find("RwLock") != StringRef::npos) {
-            if (Name.startswith("HandyRwLock$LT$T$GT$$GT$2rl")
-                || Name.startswith("HandyRwLock$LT$T$GT$$GT$2wl")) {
-                return true;
-            } else if (Name.find("raw_rwlock") != StringRef::npos || Name.find("RawRwLock") != StringRef::npos) {
-                return false;
-            } else if (Name.find("$GT$4read") != StringRef::npos || Name.find("$GT$5write") != StringRef::npos) {
-                return true;
-            }
-        }
-        return false;
-    }
-
-    struct stLockInfo {
-        Instruction *LockInst;
-        Value *ReturnValue;
-        Value *LockValue;
-    };
-
-    static bool parseLockInst(Instruction *LockInst, stLockInfo &LockInfo) {
-        if (!LockInst) {
-            return false;
-        }
-        CallSite CS(LockInst);
-        // Mutex
-        if (CS.getCalledFunction()->getReturnType()->isVoidTy()) {
-            if (CS.getNumArgOperands() > 1) {
-                LockInfo.ReturnValue = CS.getArgOperand(0);
-                LockInfo.LockValue = CS.getArgOperand(1);
-                return true;
-            } else {
+    // Prints the manual drops of one lock site, or why it cannot be parsed.
+    // With Records, the manual drops are written there instead.
+    static void printManualDrops(LockSiteInfo &Info, unsigned Idx, RecordWriter *Records) {
+        const LockSite &Site = Info.getLockSites()[Idx];
+        Instruction *I = Site.LockInst;
+        if (!Site.LockValue) {
+            if (Site.Callee->getReturnType()->isVoidTy()) {
                 errs() << "Void-return Lock\n";
-                LockInst->print(errs());
-                errs() << "\n";
-                return false;
-            }
-        } else {  // Non-mutex
-            LockInfo.ReturnValue = LockInst;
-            if (CS.getNumArgOperands() > 0) {
-                LockInfo.LockValue = CS.getArgOperand(0);
-                return true;
             } else {
                 errs() << "Non-parameter Lock\n";
-                LockInst->print(errs());
-                errs() << "\n";
-                return false;
             }
+            I->print(errs());
+            errs() << "\n";
+            errs() << "Cannot Parse Lock Inst\n";
+            printDebugInfo(I);
+            return;
         }
-    }
-
-    static bool isDropInst(Instruction *NI) {
-        if (isCallOrInvokeInst(NI)) {
-            CallSite CS;
-            if (Function *F = getCalledFunc(NI, CS)) {
-                if (F->getName().startswith("_ZN4core3mem4drop")) {
-                    return true;
-                }
+        if (!isa<Instruction>(Site.ResultValue)) {
+            errs() << "Return Value is not Inst\n";
+            Site.ResultValue->print(errs());
+            errs() << '\n';
+            return;
+        }
+        const DropSet *setDropInst = nullptr;
+        bool Found = InterProc ? Info.getInterProcManualDrops(Idx, setDropInst)
+                               : Info.getManualDrops(Idx, setDropInst);
+        if (Found && Records) {
+            SmallVector<RecordLocation, 4> vecDrops;
+            for (Instruction *DropInst : *setDropInst) {
+                vecDrops.push_back(getRecordLocation(DropInst));
+            }
+            Records->addLock(getRecordLocation(I), vecDrops);
+        } else if (Found) {
+            errs() << "Manual Drop Info:\n";
+            printDebugInfo(I);
+            for (Instruction *DropInst: *setDropInst) {
+                errs() << '\t';
+                printDebugInfo(DropInst);
             }
         }
-        return false;
     }
 
-    static bool trackDownToDropInsts(Instruction *RI, std::set<Instruction *> &setDropInst) {
-        if (!RI) {
-            return false;
+    static void printModule(LockSiteInfo &Info) {
+        // The records of a module are appended at once, so that a file
+        // shared by several opt runs only holds whole modules.
+        std::string RecordBuf;
+        raw_string_ostream RecordOS(RecordBuf);
+        std::unique_ptr<RecordWriter> Records;
+        if (!RecordsFile.empty()) {
+            Records.reset(new RecordWriter(RecordOS));
         }
-        setDropInst.clear();
 
-        std::list<Instruction *> WorkList;
-        std::set<Instruction *> Visited;
-        WorkList.push_back(RI);
-        bool Stop = false;
-        while (!WorkList.empty() && !Stop) {
-            Instruction *Curr = WorkList.front();
-            WorkList.pop_front();
-            for (User *U: Curr->users()) {
-                if (Instruction *UI = dyn_cast<Instruction>(U)) {
-                    if (Visited.find(UI) == Visited.end()) {
-                        if (isDropInst(UI)) {
-//                            UI->print(errs());
-//                            errs() << '\n';
-                            setDropInst.insert(UI);
-                            Value *V = UI->getOperand(0);
-                            assert(V);
-                            for (User *UV: V->users()) {
-                                if (Instruction *UVI = dyn_cast<Instruction>(UV)) {
-                                    if (Visited.find(UVI) == Visited.end()) {
-                                        if (isDropInst(UVI)) {
-                                            setDropInst.insert(UVI);
-                                        }
-                                    }
-                                }
-                            }
-                            return true;
-                        } else if (StoreInst *SI = dyn_cast<StoreInst>(UI)) {
-                            if (Instruction *Dest = dyn_cast<Instruction>(SI->getPointerOperand())) {
-                                WorkList.push_back(Dest);
-                            } else {
-                                errs() << "StoreInst Dest is not a Inst\n";
-                                printDebugInfo(Curr);
-                            }
-                        } else {
-                            WorkList.push_back(UI);
-                        }
-                        Visited.insert(UI);
-                    }
-                }
+        const std::vector<LockSite> &vecSites = Info.getLockSites();
+        for (unsigned i = 0; i < vecSites.size(); ++i) {
+            // Only calls of lock functions defined in this module.
+            if (vecSites[i].Callee->isDeclaration()) {
+                continue;
             }
+            printManualDrops(Info, i, Records.get());
         }
-        return false;
-    }
 
-    static bool parseFunc(Function *F,
-                          std::map<Instruction *, Function *> &mapCallInstCallee,
-                          std::map<Instruction *, stLockInfo> &mapLockInfo,
-                          std::map<Instruction *, std::pair<Function *, std::set<Instruction *>>> &mapLockDropInfo) {
-        if (!F || F->isDeclaration()) {
-            return false;
+        if (!Records) {
+            return;
         }
-
-        for (BasicBlock &BB : *F) {
-            for (Instruction &II : BB) {
-                Instruction *I = &II;
-                if (!skipInst(I)) {
-                    if (isa<CallInst>(I) || isa<InvokeInst>(I)) {
-                        CallSite CS(I);
-                        Function *Callee = CS.getCalledFunction();
-                        if (Callee && !Callee->isDeclaration()) {
-                            if (isLockFunc(Callee)) {
-                                stLockInfo LockInfo { nullptr, nullptr, nullptr };
-                                if (!parseLockInst(I, LockInfo)) {
-                                    errs() << "Cannot Parse Lock Inst\n";
-                                    printDebugInfo(I);
-                                    continue;
-                                }
-                                Instruction *RI = dyn_cast<Instruction>(LockInfo.ReturnValue);
-                                if (!RI) {
-                                    errs() << "Return Value is not Inst\n";
-                                    LockInfo.ReturnValue->print(errs());
-                                    errs() << '\n';
-                                    continue;
-                                }
-                                mapLockInfo[I] = LockInfo;
-                                std::set<Instruction *> setDropInst;
-                                if (trackDownToDropInsts(RI, setDropInst)) {
-                                    mapLockDropInfo[I] = std::make_pair(Callee, setDropInst);
-                                    // Debug
-                                    errs() << "Manual Drop Info:\n";
-//                                    I->print(errs());
-                                    printDebugInfo(I);
-//                                    errs() << '\n';
-                                    for (Instruction *DropInst: setDropInst) {
-                                        errs() << '\t';
-                                        printDebugInfo(DropInst);
-//                                        DropInst->print(errs());
-//                                        errs() << '\n';
-                                    }
-                                } else {
-//                                    errs() << "Cannot find Drop for Inst:\n";
-//                                    errs() << I->getParent()->getParent()->getName() << '\n';
-//                                    I->print(errs());
-//                                    printDebugInfo(I);
-//                                    errs() << '\n';
-                                    mapLockDropInfo[I] = std::make_pair(Callee, setDropInst);
-                                }
-
-                            } else {
-                                mapCallInstCallee[I] = Callee;
-                            }
-                        }
-                    }
-                }
+        Records->finish();
+        std::error_code EC;
+        raw_fd_ostream OS(RecordsFile, EC, sys::fs::OF_Append);
+        if (!EC) {
+            OS << RecordOS.str();
+            OS.close();
+            if (OS.has_error()) {
+                EC = std::make_error_code(std::errc::io_error);
+                OS.clear_error();
             }
         }
-
-        return true;
+        if (EC) {
+            errs() << "Cannot write " << RecordsFile << ": " << EC.message() << "\n";
+        }
     }
 
     bool PrintManualDrop::runOnModule(Module &M) {
         this->pModule = &M;
 
-        for (Function &F: M) {
-            if (F.begin() != F.end()) {
-                std::map<Instruction *, Function *> mapCallInstCallee;
-                std::map<Instruction *, stLockInfo> mapLockInfo;
-                std::map<Instruction *, std::pair<Function *, std::set<Instruction *>>> mapLockDropInfo;
-                parseFunc(&F, mapCallInstCallee, mapLockInfo, mapLockDropInfo);
-            }
-        }
+        // The scan is shared with other passes that require LockSiteAnalysis
+        // (e.g. the double lock detector) in the same opt run.
+        printModule(getAnalysis<LockSiteAnalysis>().getLockSites(getLockAPIMatcher(), 1, DropTraceBudget));
         return false;
     }
+
+    PreservedAnalyses PrintManualDropPass::run(Module &M, ModuleAnalysisManager &MAM) {
+        printModule(MAM.getResult<LockSiteModuleAnalysis>(M).getLockSites(getLockAPIMatcher(), 1, DropTraceBudget));
+        return PreservedAnalyses::all();
+    }
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "PrintManualDrop", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &MAM) {
+                    MAM.registerPass([] { return LockSiteModuleAnalysis(); });
+                });
+                PB.registerPipelineParsingCallback(
+                        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+                            if (Name == "print-manual-drop") {
+                                MPM.addPass(detector::PrintManualDropPass());
+                                return true;
+                            }
+                            return false;
+                        });
+            }};
 }
 
 static RegisterPass<detector::PrintManualDrop> X(
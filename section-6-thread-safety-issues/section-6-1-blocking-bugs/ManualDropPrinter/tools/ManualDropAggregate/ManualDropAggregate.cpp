@@ -0,0 +1,127 @@
+// Summary of the manual drop records of many modules (-print-records).
+//
+// Prints the lock sites that have a manual drop, as parse_manual_drop_log.py
+// does for the text log of -print: for each lock outside of the Rust
+// sources (/rust), its location and that of its first manual drop, if that
+// is outside of them too. The record files are read on several threads;
+// their summaries are written in input order, so the output does not
+// depend on scheduling.
+
+#include "PrintManualDrop/ManualDropRecords.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+using namespace detector;
+
+static cl::list<std::string> InputPaths(
+        cl::Positional,
+        cl::desc("<manual drop record files>"),
+        cl::OneOrMore);
+
+static cl::opt<unsigned> NumJobs(
+        "j",
+        cl::desc("Number of worker threads (default: hardware concurrency)"),
+        cl::init(0));
+
+static cl::opt<std::string> OutputFilename(
+        "o",
+        cl::desc("Summary file (default: stdout)"),
+        cl::value_desc("filename"),
+        cl::init("-"));
+
+struct FileSummary {
+    std::string Text;
+    std::string Error;
+};
+
+static bool isRustSource(const RecordLocation &Loc) {
+    return Loc.Dir.startswith("/rust");
+}
+
+static void printLocation(raw_ostream &OS, const RecordLocation &Loc) {
+    OS << " " << Loc.Dir << ' ' << Loc.File << ' ' << Loc.Line << "\n";
+}
+
+static void summarizeFile(const std::string &Path, FileSummary &Summary) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+            MemoryBuffer::getFile(Path, /*FileSize=*/-1, /*RequiresNullTerminator=*/false);
+    if (!BufOrErr) {
+        Summary.Error = Path + ": " + BufOrErr.getError().message() + "\n";
+        return;
+    }
+    raw_string_ostream OS(Summary.Text);
+    std::string ErrMsg;
+    bool Ok = readRecords((*BufOrErr)->getBuffer(), [&OS](const LockRecord &Record) {
+        if (!Record.Lock.isValid() || isRustSource(Record.Lock)) {
+            return;
+        }
+        auto Drop = std::find_if(Record.vecDrops.begin(), Record.vecDrops.end(),
+                                 [](const RecordLocation &Loc) { return Loc.isValid(); });
+        if (Drop == Record.vecDrops.end() || isRustSource(*Drop)) {
+            return;
+        }
+        OS << "Manual Drop Info:\n";
+        printLocation(OS, Record.Lock);
+        OS << '\t';
+        printLocation(OS, *Drop);
+    }, ErrMsg);
+    OS.flush();
+    if (!Ok) {
+        Summary.Error = Path + ": " + ErrMsg + "\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Manual drop record aggregator\n");
+
+    unsigned Jobs = NumJobs;
+    if (Jobs == 0) {
+        Jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    Jobs = std::min<std::size_t>(Jobs, InputPaths.size());
+
+    std::vector<FileSummary> Summaries(InputPaths.size());
+    std::atomic<std::size_t> NextInput(0);
+    std::vector<std::thread> Workers;
+    for (unsigned i = 0; i < Jobs; ++i) {
+        Workers.emplace_back([&]() {
+            for (std::size_t idx = NextInput++; idx < InputPaths.size(); idx = NextInput++) {
+                summarizeFile(InputPaths[idx], Summaries[idx]);
+            }
+        });
+    }
+    for (std::thread &T : Workers) {
+        T.join();
+    }
+
+    std::error_code EC;
+    raw_fd_ostream Out(OutputFilename, EC, sys::fs::OF_Text);
+    if (EC) {
+        errs() << "Cannot open " << OutputFilename << ": " << EC.message() << "\n";
+        return 1;
+    }
+    int RetCode = 0;
+    for (const FileSummary &Summary : Summaries) {
+        // What precedes an error in a file is still printed.
+        Out << Summary.Text;
+        if (!Summary.Error.empty()) {
+            errs() << Summary.Error;
+            RetCode = 1;
+        }
+    }
+    return RetCode;
+}
@@ -2,11 +2,17 @@
 
 BC_DIR="$1"
 MANUAL_DROP_LIB=ManualDropPrinter/build/lib/PrintManualDrop/libPrintManualDrop.so
+MANUAL_DROP_AGGREGATE=ManualDropPrinter/build/tools/ManualDropAggregate/manual-drop-aggregate
 LOG_FILE=./manual_drop.log
+RECORD_DIR=./manual_drop_records
 
-for bc in `ls -1v ${BC_DIR}/*.m2r.bc`
-do
-    opt -load ${MANUAL_DROP_LIB} -print $bc
-done 1>/dev/null 2>${LOG_FILE}
+# Each module writes its manual drops as binary records to its own file,
+# JOBS modules at a time; the aggregator then prints the summary in
+# `ls -v` order. Diagnostics of the pass still go to LOG_FILE.
+rm -rf ${RECORD_DIR}
+mkdir -p ${RECORD_DIR}
+ls -1v ${BC_DIR}/*.m2r.bc | xargs -P "${JOBS:-$(nproc)}" -I{} \
+    sh -c 'opt -load "$1" -print -print-records="$2/$(basename "$3" .m2r.bc).mdr" "$3" -o /dev/null' \
+    _ ${MANUAL_DROP_LIB} ${RECORD_DIR} {} 2>${LOG_FILE}
 
-./parse_manual_drop_log.py ${LOG_FILE}
+ls -1v ${RECORD_DIR}/*.mdr | xargs ${MANUAL_DROP_AGGREGATE} -j "${JOBS:-$(nproc)}"
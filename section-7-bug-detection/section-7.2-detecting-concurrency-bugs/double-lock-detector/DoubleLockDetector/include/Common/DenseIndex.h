@@ -0,0 +1,149 @@
+#ifndef PRINTPASS_DENSEINDEX_H
+#define PRINTPASS_DENSEINDEX_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Module.h"
+
+#include <algorithm>
+#include <vector>
+
+// Dense numbering of the functions of a module and, per function, of its
+// basic blocks and instructions (in layout order). Visited sets and side
+// tables can then be BitVectors and flat vectors instead of node-based
+// std::set / std::map keyed by pointers.
+class ModuleIndex {
+public:
+    static const unsigned InvalidIdx = ~0u;
+
+    explicit ModuleIndex(const llvm::Module &M);
+
+    unsigned getNumFuncs() const {
+        return vecFuncs.size();
+    }
+
+    llvm::Function *getFunc(unsigned Idx) const {
+        return vecFuncs[Idx];
+    }
+
+    unsigned getFuncIdx(const llvm::Function *F) const {
+        return lookup(F);
+    }
+
+    unsigned getNumBlocks(const llvm::Function *F) const {
+        return vecNumBlocks[lookup(F)];
+    }
+
+    unsigned getNumInsts(const llvm::Function *F) const {
+        return vecNumInsts[lookup(F)];
+    }
+
+    // Index of BB inside its parent function.
+    unsigned getBlockIdx(const llvm::BasicBlock *BB) const {
+        return lookup(BB);
+    }
+
+    // Index of I inside its parent function.
+    unsigned getInstIdx(const llvm::Instruction *I) const {
+        return lookup(I);
+    }
+
+private:
+    unsigned lookup(const llvm::Value *V) const {
+        auto it = mapIdx.find(V);
+        return it == mapIdx.end() ? InvalidIdx : it->second;
+    }
+
+    std::vector<llvm::Function *> vecFuncs;
+    std::vector<unsigned> vecNumBlocks;
+    std::vector<unsigned> vecNumInsts;
+    llvm::DenseMap<const llvm::Value *, unsigned> mapIdx;
+};
+
+// Set of dense indices that is cleared in O(1) by bumping a stamp, for
+// visited sets that are reset far more often than they are filled.
+class StampSet {
+public:
+    explicit StampSet(unsigned Size = 0) : vecStamp(Size, 0), Stamp(1) {}
+
+    void resize(unsigned Size) {
+        vecStamp.resize(Size, 0);
+    }
+
+    void clear() {
+        if (++Stamp == 0) {
+            std::fill(vecStamp.begin(), vecStamp.end(), 0);
+            Stamp = 1;
+        }
+    }
+
+    bool count(unsigned Idx) const {
+        return vecStamp[Idx] == Stamp;
+    }
+
+    // Returns true if Idx was not in the set yet.
+    bool insert(unsigned Idx) {
+        if (vecStamp[Idx] == Stamp) {
+            return false;
+        }
+        vecStamp[Idx] = Stamp;
+        return true;
+    }
+
+private:
+    std::vector<unsigned> vecStamp;
+    unsigned Stamp;
+};
+
+struct CallEdge {
+    llvm::Instruction *CallInst;
+    unsigned InstIdx;   // index of CallInst in the caller
+    unsigned Callee;    // function index of the callee
+};
+
+// Call graph in compressed sparse row form: the edges of caller i are
+// vecEdges[vecOffsets[i], vecOffsets[i + 1]), sorted by InstIdx.
+class DenseCallGraph {
+public:
+    DenseCallGraph() : vecOffsets(1, 0) {}
+
+    // Callers are added in function index order. Edges added between two
+    // calls of finishCaller() belong to the same caller.
+    void addEdge(llvm::Instruction *CallInst, unsigned InstIdx, unsigned Callee) {
+        vecEdges.push_back({CallInst, InstIdx, Callee});
+    }
+
+    void finishCaller() {
+        vecOffsets.push_back(vecEdges.size());
+    }
+
+    // Appends the callers of Part after the callers already added.
+    void append(const DenseCallGraph &Part);
+
+    unsigned getNumCallers() const {
+        return vecOffsets.size() - 1;
+    }
+
+    unsigned getNumEdges() const {
+        return vecEdges.size();
+    }
+
+    const CallEdge *begin(unsigned Caller) const {
+        return vecEdges.data() + vecOffsets[Caller];
+    }
+
+    const CallEdge *end(unsigned Caller) const {
+        return vecEdges.data() + vecOffsets[Caller + 1];
+    }
+
+    // Edges of the call site with index InstIdx in Caller.
+    std::pair<const CallEdge *, const CallEdge *> getCallSite(unsigned Caller, unsigned InstIdx) const;
+
+private:
+    std::vector<unsigned> vecOffsets;
+    std::vector<CallEdge> vecEdges;
+};
+
+#endif //PRINTPASS_DENSEINDEX_H
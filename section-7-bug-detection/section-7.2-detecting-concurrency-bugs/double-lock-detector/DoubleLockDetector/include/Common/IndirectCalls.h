@@ -0,0 +1,64 @@
+#ifndef PRINTPASS_INDIRECTCALLS_H
+#define PRINTPASS_INDIRECTCALLS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Module.h"
+
+#include <utility>
+#include <vector>
+
+#include "Common/DenseIndex.h"
+
+// Candidate callees of the indirect calls of a module, built once from its
+// vtables and the signatures of its address-taken functions.
+//
+// A call through a trait object loads its callee from a slot of the vtable
+// that comes with the data pointer. It may reach the functions in that slot
+// of all constant function pointer tables of the module whose signature is
+// compatible, i.e., equal to the call's up to pointer types (vtables hold
+// the methods of the concrete self type, calls pass an opaque pointer). Any
+// other call of a function pointer, as well as a slot load that matches no
+// table, may reach every address-taken function with a compatible signature.
+//
+// A call with more than MaxFanOut candidates resolves to none, so that a
+// common callback signature does not connect every walk to half the module.
+class IndirectCallTable {
+public:
+    static const unsigned NoSlot = ~0u;
+
+    IndirectCallTable(const llvm::Module &M, const ModuleIndex &MI, unsigned MaxFanOut);
+
+    unsigned getMaxFanOut() const {
+        return MaxFanOut;
+    }
+
+    // Function indices of the candidate callees of the indirect call CS, in
+    // module order. Empty if there are none or, with Capped set, too many.
+    llvm::ArrayRef<unsigned> getTargets(llvm::CallSite CS, bool &Capped) const;
+
+private:
+    // Targets of one slot (NoSlot for all address-taken functions) whose
+    // signatures are compatible with Ty.
+    struct Bucket {
+        llvm::FunctionType *Ty;
+        std::vector<unsigned> vecTargets;
+    };
+
+    typedef std::pair<unsigned, unsigned> BucketKey;  // slot, number of params
+
+    void addTarget(unsigned Slot, llvm::FunctionType *Ty, unsigned FuncIdx);
+
+    const Bucket *findBucket(unsigned Slot, llvm::FunctionType *Ty) const;
+
+    unsigned getSlot(llvm::Value *Callee) const;
+
+    const llvm::DataLayout &DL;
+    unsigned MaxFanOut;
+    llvm::DenseMap<BucketKey, std::vector<Bucket>> mapBuckets;
+};
+
+#endif //PRINTPASS_INDIRECTCALLS_H
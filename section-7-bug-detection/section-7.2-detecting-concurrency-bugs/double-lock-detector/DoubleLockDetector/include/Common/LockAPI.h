@@ -0,0 +1,101 @@
+#ifndef PRINTPASS_LOCKAPI_H
+#define PRINTPASS_LOCKAPI_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+
+#include <string>
+#include <vector>
+
+// What a (mangled) callee name means to the lock passes.
+enum class LockAPIKind : unsigned char {
+    None,
+    LockAPI,         // lock_api Mutex::lock / RwLock::read / RwLock::write, guard returned
+    StdMutexLock,    // std::sync::Mutex::lock, LockResult written through sret
+    StdRwLockRead,   // std::sync::RwLock::read
+    StdRwLockWrite,  // std::sync::RwLock::write
+    GenericLock,     // anything else that looks like a lock (name heuristic or table)
+    AutoDrop,        // core::ptr::real_drop_in_place
+    ManualDrop,      // core::mem::drop
+    ResultToInner,   // Result::unwrap and friends
+};
+
+bool isLockKind(LockAPIKind Kind);
+
+bool isDropKind(LockAPIKind Kind);
+
+const char *getLockAPIKindName(LockAPIKind Kind);
+
+bool parseLockAPIKind(llvm::StringRef Name, LockAPIKind &Kind);
+
+// All name patterns compiled into one Aho-Corasick automaton, so a name is
+// classified in a single pass over its characters.
+//
+// A table line is "<kind> prefix|contains <pattern>"; '#' starts a comment.
+// The longest matching table pattern decides the kind. Names that match
+// no table pattern fall back to the generic lock-name heuristic.
+class LockAPIMatcher {
+public:
+    // Starts with the built-in std / lock_api / core table.
+    LockAPIMatcher();
+
+    void addPattern(LockAPIKind Kind, bool Anchored, llvm::StringRef Pattern);
+
+    // Appends the patterns of a table file to the current table.
+    bool loadTable(llvm::StringRef Path, std::string &ErrMsg);
+
+    LockAPIKind match(llvm::StringRef Name) const;
+
+    // Feeds the pattern table into Hash, for keying cached results.
+    void hash(llvm::MD5 &Hash) const;
+
+private:
+    struct Pattern {
+        std::string Text;
+        bool Anchored;
+        LockAPIKind Kind;   // None for heuristic features
+        unsigned Feature;   // bit in the heuristic feature mask
+    };
+
+    void addFeature(unsigned Feature, bool Anchored, llvm::StringRef Text);
+
+    void compile();
+
+    std::vector<Pattern> vecPatterns;
+
+    // Automaton: byte -> alphabet class, then a dense transition table.
+    unsigned char ByteClass[256];
+    unsigned NumClasses;
+    std::vector<unsigned> vecGoto;
+    std::vector<std::vector<unsigned>> vecOutputs;
+};
+
+// Per-module cache of the callee kinds. classifyModule() fills the table
+// for every function up front, so later lookups never write and can be
+// shared by worker threads.
+class LockAPIClassifier {
+public:
+    explicit LockAPIClassifier(const LockAPIMatcher &Matcher);
+
+    void classifyModule(const llvm::Module &M);
+
+    LockAPIKind getKind(const llvm::Function *F) const;
+
+    bool isLock(const llvm::Function *F) const {
+        return isLockKind(getKind(F));
+    }
+
+    bool isDrop(const llvm::Function *F) const {
+        return isDropKind(getKind(F));
+    }
+
+private:
+    const LockAPIMatcher &Matcher;
+
+    llvm::DenseMap<const llvm::Function *, LockAPIKind> mapFuncKind;
+};
+
+#endif //PRINTPASS_LOCKAPI_H
@@ -0,0 +1,148 @@
+#ifndef RUSTBUGDETECTOR_DOUBLELOCKREPORT_H
+#define RUSTBUGDETECTOR_DOUBLELOCKREPORT_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+#include <vector>
+
+namespace detector {
+
+    enum class ReportFormat {
+        Text,   // the historical "Double Lock Happens!" log
+        JSONL,  // one JSON object per finding and line
+        SARIF,  // SARIF 2.1.0 log
+    };
+
+    struct ReportLocation {
+        std::string Function;
+        std::string Directory;
+        std::string File;
+        unsigned Line;
+        bool HasDebugLoc;
+
+        static ReportLocation get(const llvm::Instruction *I);
+    };
+
+    struct DoubleLockFinding {
+        ReportLocation FirstLock;
+        std::vector<ReportLocation> vecSecondLocks;
+        // Call sites from the second lock's function back towards the
+        // first lock, innermost first. Empty for intra-procedural findings.
+        std::vector<ReportLocation> vecCallChain;
+    };
+
+    // One edge of a lock order cycle: Acquire (a lock site, or a call that
+    // may acquire the next lock) runs while the guard of Held is alive.
+    struct LockOrderEdge {
+        ReportLocation Held;
+        ReportLocation Acquire;
+    };
+
+    // A cycle in the lock acquisition order of lock fields; its last edge
+    // leads back to the lock held by the first.
+    struct LockOrderFinding {
+        std::vector<LockOrderEdge> vecEdges;
+    };
+
+    // The limit that cut the tracking of a lock site short, see WalkLimits.
+    enum class TruncationReason {
+        LockVisits,     // blocks and callees one lock site may visit
+        CallDepth,      // depth of the callee walk
+        LockTime,       // wall time of one lock site
+        ModuleVisits,   // blocks and callees of all lock sites of the module
+        ModuleTime,     // wall time of the module
+    };
+
+    // A lock site whose tracking stopped at a limit, so findings it would
+    // have led to may be missing. Once a module limit is reached, the
+    // remaining NumSkipped lock sites are not tracked at all and Lock is the
+    // first of them.
+    struct TruncationNote {
+        ReportLocation Lock;
+        TruncationReason Reason;
+        unsigned NumSkipped;
+    };
+
+    // Where a finding of a differential scan (-detect-diff-base) stands
+    // against the base module.
+    enum class DiffState {
+        None,       // not a differential scan
+        Added,      // only in the new module
+        Removed,    // only in the base module
+    };
+
+    // Formats findings of one module. Everything is written to one stream,
+    // which callers buffer per module so that reports of parallel runs never
+    // interleave.
+    //
+    // In SARIF fragment mode only the result objects are written, one per
+    // line, so that a driver can merge the results of many modules into one
+    // log with writeSarifHeader() / writeSarifFooter().
+    class ReportSink {
+    public:
+        ReportSink(llvm::raw_ostream &OS, ReportFormat Format, llvm::StringRef ModuleName,
+                   bool SarifFragment = false);
+
+        void add(const DoubleLockFinding &Finding, DiffState State = DiffState::None);
+
+        void add(const LockOrderFinding &Finding);
+
+        // Notes are not findings and are not counted by getNumFindings().
+        void add(const TruncationNote &Note);
+
+        // While set, double lock findings are appended to vecFindings instead
+        // of being written or counted, e.g. to be diffed with those of
+        // another module.
+        void setCollector(std::vector<DoubleLockFinding> *vecFindings) {
+            this->pCollected = vecFindings;
+        }
+
+        // Closes the SARIF log, if any. Must be called once after the last add().
+        void finish();
+
+        unsigned getNumFindings() const {
+            return NumFindings;
+        }
+
+        static void writeSarifHeader(llvm::raw_ostream &OS);
+
+        static void writeSarifFooter(llvm::raw_ostream &OS);
+
+    private:
+        void addText(const DoubleLockFinding &Finding, DiffState State);
+
+        void addJSON(const DoubleLockFinding &Finding, DiffState State);
+
+        void addSarif(const DoubleLockFinding &Finding, DiffState State);
+
+        void addText(const LockOrderFinding &Finding);
+
+        void addJSON(const LockOrderFinding &Finding);
+
+        void addSarif(const LockOrderFinding &Finding);
+
+        void addText(const TruncationNote &Note);
+
+        void addJSON(const TruncationNote &Note);
+
+        void addSarif(const TruncationNote &Note);
+
+        // Writes Result, separated from earlier results of a standalone log.
+        void writeSarifResult(llvm::json::Value Result);
+
+        llvm::raw_ostream &OS;
+        ReportFormat Format;
+        std::string ModuleName;
+        bool SarifFragment;
+        unsigned NumFindings;
+        unsigned NumResults;
+        std::vector<DoubleLockFinding> *pCollected;
+    };
+}
+
+#endif //RUSTBUGDETECTOR_DOUBLELOCKREPORT_H
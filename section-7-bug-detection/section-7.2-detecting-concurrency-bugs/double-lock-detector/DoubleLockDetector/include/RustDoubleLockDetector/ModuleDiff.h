@@ -0,0 +1,40 @@
+#ifndef RUSTBUGDETECTOR_MODULEDIFF_H
+#define RUSTBUGDETECTOR_MODULEDIFF_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+#include "RustDoubleLockDetector/DoubleLockReport.h"
+
+// Matching of two builds of the same crate for a differential scan
+// (-detect-diff-base): functions by name and body, findings by location.
+namespace detector {
+
+    // A hash of the body of F. Values are numbered in order and named types
+    // and globals are hashed by name, so equal bodies in different modules
+    // and contexts hash equally. Debug locations and debug intrinsics are
+    // ignored: code that only moved does not count as changed.
+    llvm::hash_code hashFunction(const llvm::Function &F);
+
+    // Adds the names of the functions that are defined in only one of Old
+    // and New, or in both with different hashes, to setChanged.
+    void getChangedFunctions(const llvm::Module &Old, const llvm::Module &New, llvm::StringSet<> &setChanged);
+
+    // Findings of New without a match in Old (Added) and of Old without a
+    // match in New (Removed), each in its original order. Findings match if
+    // their first and second locks are in the same functions and files;
+    // equal lines are preferred, so a finding that only moved is neither
+    // added nor removed. Call chains are not compared.
+    void diffFindings(llvm::ArrayRef<DoubleLockFinding> Old,
+                      llvm::ArrayRef<DoubleLockFinding> New,
+                      std::vector<const DoubleLockFinding *> &Added,
+                      std::vector<const DoubleLockFinding *> &Removed);
+}
+
+#endif //RUSTBUGDETECTOR_MODULEDIFF_H
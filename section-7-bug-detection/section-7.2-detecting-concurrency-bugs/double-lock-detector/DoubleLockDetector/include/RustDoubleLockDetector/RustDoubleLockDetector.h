@@ -1,22 +1,87 @@
 #ifndef RUSTBUGDETECTOR_RUSTDOUBLELOCKDETECTOR_H
 #define RUSTBUGDETECTOR_RUSTDOUBLELOCKDETECTOR_H
 
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <functional>
+
+#include "RustDoubleLockDetector/DoubleLockReport.h"
+
+class LockAPIMatcher;
 
 namespace detector {
     struct RustDoubleLockDetector : public llvm::ModulePass {
 
         static char ID;
 
+        // Bumped whenever a change to the pass can change its reports.
+        static const char *const Version;
+
+        // Feeds Version and the options that affect reports into Hash, so
+        // cached reports are only reused by a matching detector.
+        static void hashConfig(llvm::MD5 &Hash);
+
         RustDoubleLockDetector();
 
+        // Reports go to errs() unless redirected, e.g. by the driver. With
+        // SarifFragment, SARIF output is only the result objects, one per
+        // line, for the caller to merge into one log.
+        void setReportStream(llvm::raw_ostream &OS, bool SarifFragment = false);
+
+        // The format selected with -detect-report-format.
+        static ReportFormat getReportFormat();
+
+        // The lock API table, with the patterns of -detect-lock-api-table.
+        static const LockAPIMatcher &getLockAPIMatcher();
+
         void getAnalysisUsage(llvm::AnalysisUsage &AU) const override;
 
         bool runOnModule(llvm::Module &M) override;
 
+        // Whether a wall time limit (-detect-lock-timeout-ms or
+        // -detect-module-timeout-ms) cut the last module short. Its report
+        // then depends on the speed of the run and should not be cached.
+        bool hitTimeLimit() const {
+            return TimeLimited;
+        }
+
     private:
 
         llvm::Module *pModule;
+
+        llvm::raw_ostream *pReportOS;
+
+        bool SarifFragment;
+
+        bool TimeLimited;
+    };
+
+    // The detector for the new pass manager (opt -passes=detect-double-lock).
+    // It takes the lock sites from LockSiteModuleAnalysis and the AA of each
+    // function from the function analysis manager.
+    struct RustDoubleLockDetectorPass : public llvm::PassInfoMixin<RustDoubleLockDetectorPass> {
+
+        // Registers the analyses of the pipeline in empty analysis managers
+        // and cross-registers their proxies. The base module of
+        // -detect-diff-base is scanned with managers set up by it.
+        typedef std::function<void(llvm::LoopAnalysisManager &, llvm::FunctionAnalysisManager &,
+                                   llvm::CGSCCAnalysisManager &, llvm::ModuleAnalysisManager &)> RegisterAnalysesFn;
+
+        explicit RustDoubleLockDetectorPass(RegisterAnalysesFn RegisterAnalyses, llvm::raw_ostream &OS = llvm::errs())
+                : RegisterAnalyses(std::move(RegisterAnalyses)), OS(OS) {}
+
+        llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &MAM);
+
+    private:
+
+        RegisterAnalysesFn RegisterAnalyses;
+
+        llvm::raw_ostream &OS;
     };
 }
 
@@ -0,0 +1,920 @@
+#include "Common/LockSiteAnalysis.h"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <utility>
+
+#include "Common/CallerFunc.h"
+#include "Common/IndirectCalls.h"
+
+using namespace llvm;
+
+static bool printDebugInfo(Instruction *I) {
+    const llvm::DebugLoc &lockInfo = I->getDebugLoc();
+    auto di = lockInfo.get();
+    if (di) {
+        errs() << " " << lockInfo->getDirectory() << ' '
+               << lockInfo->getFilename() << ' '
+               << lockInfo.getLine() << "\n";
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static bool skipInst(Instruction *I) {
+    if (!I) {
+        return true;
+    }
+    if (isa<PHINode>(I)) {
+        return true;
+    }
+    if (isa<DbgInfoIntrinsic>(I)) {
+        return true;
+    }
+    return false;
+}
+
+// Lock sites and call graph of a contiguous range of the module's functions.
+struct ScanShard {
+    DenseCallGraph CallGraph;
+    std::vector<LockSite> vecSites;
+    IndirectCallStats IndirectCalls;
+};
+
+static bool collectGlobalCallSite(
+        Function *F,  // Input
+        const ModuleIndex &MI,  // Input
+        const IndirectCallTable &ICT,  // Input
+        DenseCallGraph &CG,  // Output
+        IndirectCallStats &Stats  // Output
+) {
+    if (!F || F->isDeclaration()) {
+        return false;
+    }
+    for (BasicBlock &B : *F) {
+        for (Instruction &II : B) {
+            Instruction *I = &II;
+            if (skipInst(I)) {
+                continue;
+            }
+            if (isCallOrInvokeInst(I)) {
+                CallSite CS;
+                if (Function *Callee = getCalledFunc(I, CS)) {
+                    CG.addEdge(I, MI.getInstIdx(I), MI.getFuncIdx(Callee));
+                } else {
+                    bool Capped = false;
+                    ArrayRef<unsigned> Targets = ICT.getTargets(CS, Capped);
+                    if (Capped) {
+                        ++Stats.NumCapped;
+                    } else if (!Targets.empty()) {
+                        ++Stats.NumResolved;
+                        Stats.NumEdges += Targets.size();
+                    }
+                    unsigned InstIdx = MI.getInstIdx(I);
+                    for (unsigned Callee : Targets) {
+                        CG.addEdge(I, InstIdx, Callee);
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static LockSite parseLockSite(Instruction *LockInst, Function *Callee, LockAPIKind Kind) {
+    LockSite Site = {LockInst, Callee, Kind, nullptr, nullptr};
+    CallSite CS(LockInst);
+    if (Callee->getReturnType()->isVoidTy()) {
+        if (CS.getNumArgOperands() > 1) {
+            Site.ResultValue = CS.getArgOperand(0);
+            Site.LockValue = CS.getArgOperand(1);
+        }
+    } else {
+        Site.ResultValue = LockInst;
+        if (CS.getNumArgOperands() > 0) {
+            Site.LockValue = CS.getArgOperand(0);
+        }
+    }
+    return Site;
+}
+
+static void scanFunctions(const ModuleIndex &MI,
+                          unsigned Begin, unsigned End,
+                          const LockAPIClassifier &LAC,
+                          const IndirectCallTable &ICT,
+                          ScanShard &Shard) {
+    DenseCallGraph &CG = Shard.CallGraph;
+    for (unsigned i = Begin; i < End; ++i) {
+        collectGlobalCallSite(MI.getFunc(i), MI, ICT, CG, Shard.IndirectCalls);
+        CG.finishCaller();
+    }
+    for (unsigned Caller = 0; Caller < CG.getNumCallers(); ++Caller) {
+        for (const CallEdge *E = CG.begin(Caller); E != CG.end(Caller); ++E) {
+            Function *Callee = MI.getFunc(E->Callee);
+            LockAPIKind Kind = LAC.getKind(Callee);
+            // The arguments of an indirect call need not be laid out as
+            // the lock function expects, so only direct calls are sites.
+            if (isLockKind(Kind) && CallSite(E->CallInst).getCalledFunction() == Callee) {
+                Shard.vecSites.push_back(parseLockSite(E->CallInst, Callee, Kind));
+            }
+        }
+    }
+}
+
+// Charges one use-list entry to the budget of the current lock site.
+static bool spendBudget(DropTraceCache &C) {
+    if (C.Remaining == 0) {
+        C.Truncated = true;
+        return false;
+    }
+    --C.Remaining;
+    return true;
+}
+
+static void traceDropInstForInstruction(Instruction *Inst, DropSet &setDropInst,
+                                        const LockAPIClassifier &LAC, DropTraceCache &C) {
+    for (User *UL : Inst->users()) {
+        if (!spendBudget(C)) {
+            return;
+        }
+        Instruction *I = dyn_cast<Instruction>(UL);
+        if (!I) {
+            continue;
+        }
+        if (skipInst(I)) {
+            continue;
+        }
+        if (isCallOrInvokeInst(I)) {
+            CallSite CS(I);
+            Function *F = CS.getCalledFunction();
+            if (!F) {
+                continue;
+            }
+            if (LAC.isDrop(F)) {
+                setDropInst.insert(I);
+            }
+        }
+    }
+}
+
+// Drops of a guard stored to Target: users of Target and of its loads.
+static void traceStoredDrops(Value *Target, DropSet &setDropInst,
+                             const LockAPIClassifier &LAC, DropTraceCache &C) {
+    auto It = C.mapStoredDrops.find(Target);
+    if (It != C.mapStoredDrops.end()) {
+        setDropInst.insert(It->second.begin(), It->second.end());
+        return;
+    }
+    DropSet setStoredDrop;
+    for (User *UL : Target->users()) {
+        if (!spendBudget(C)) {
+            break;
+        }
+        Instruction *I = dyn_cast<Instruction>(UL);
+        if (!I) {
+            continue;
+        }
+        if (skipInst(I)) {
+            continue;
+        }
+        if (isCallOrInvokeInst(I)) {
+            CallSite CS(I);
+            Function *F = CS.getCalledFunction();
+            if (!F) {
+                continue;
+            }
+            if (LAC.isDrop(F)) {
+                setStoredDrop.insert(I);
+            }
+        } else if (LoadInst *LI = dyn_cast<LoadInst>(UL)) {
+            traceDropInstForInstruction(LI, setStoredDrop, LAC, C);
+        }
+    }
+    setDropInst.insert(setStoredDrop.begin(), setStoredDrop.end());
+    if (!C.Truncated) {
+        C.mapStoredDrops[Target] = std::move(setStoredDrop);
+    }
+}
+
+// Drops of the guard LockGuardValue: its users, users of its loads and
+// users of the locations it is stored to.
+static void traceDropInst(Value *LockGuardValue, DropSet &setDropInst,
+                          const LockAPIClassifier &LAC, DropTraceCache &C) {
+    auto It = C.mapGuardDrops.find(LockGuardValue);
+    if (It != C.mapGuardDrops.end()) {
+        setDropInst.insert(It->second.begin(), It->second.end());
+        return;
+    }
+    DropSet setGuardDrop;
+    for (User *U : LockGuardValue->users()) {
+        if (!spendBudget(C)) {
+            break;
+        }
+        Instruction *I = dyn_cast<Instruction>(U);
+        if (!I) {
+            continue;
+        }
+        if (skipInst(I)) {
+            continue;
+        }
+        
+        if (isCallOrInvokeInst(I)) {
+            CallSite CS(I);
+            Function *F = CS.getCalledFunction();
+            if (!F) {
+                continue;
+            }
+            if (LAC.isDrop(F)) {
+                setGuardDrop.insert(I);
+            }
+        } else if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+            traceDropInstForInstruction(LI, setGuardDrop, LAC, C);
+        } else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+            traceStoredDrops(SI->getPointerOperand(), setGuardDrop, LAC, C);
+        }
+    }
+    setDropInst.insert(setGuardDrop.begin(), setGuardDrop.end());
+    if (!C.Truncated) {
+        C.mapGuardDrops[LockGuardValue] = std::move(setGuardDrop);
+    }
+}
+
+static bool isGEP01(Instruction *I) {
+    GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I);
+    if (!GEP) {
+        return false;
+    }
+    if (GEP->getNumOperands() < 3) {
+        return false;
+    }
+    APInt idx0 = dyn_cast<ConstantInt>(GEP->getOperand(1))->getValue();
+    if (idx0 != 0) {
+        return false;
+    }
+    APInt idx1 = dyn_cast<ConstantInt>(GEP->getOperand(2))->getValue();
+    if (idx1 != 1) {
+        return false; 
+    }
+    return true; 
+}
+
+static bool isGEP00(Instruction *I) {
+    GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I);
+    if (!GEP) {
+        return false;
+    }
+    if (GEP->getNumOperands() < 3) {
+        return false;
+    }
+    APInt idx0 = dyn_cast<ConstantInt>(GEP->getOperand(1))->getValue();
+    if (idx0 != 0) {
+        return false;
+    }
+    APInt idx1 = dyn_cast<ConstantInt>(GEP->getOperand(2))->getValue();
+    if (idx1 != 0) {
+        return false; 
+    }
+    return true; 
+}
+
+static bool isDropInst(Instruction *I, const LockAPIClassifier &LAC) {
+    if (!isCallOrInvokeInst(I)) {
+        return false;
+    }
+    CallSite CS(I);
+    Function *F = CS.getCalledFunction();
+    if (!F) {
+        return false; 
+    }
+    if (LAC.isDrop(F)) {
+        return true; 
+    }
+    return false; 
+}
+
+static bool getICmp0Br0First(Instruction *ICmp, DropSet &setFirst) {
+    for (User *U : ICmp->users()) {
+        if (BranchInst *BI = dyn_cast<BranchInst>(U)) {
+            Value *V = BI->getOperand(1);
+            if (BasicBlock *B = dyn_cast<BasicBlock>(V)) {
+                setFirst.insert(B->getFirstNonPHIOrDbgOrLifetime());
+            }
+        }    
+    }
+    return !setFirst.empty(); 
+}
+
+template <typename Pred, typename SetT>
+static void visitUsersOfValue(Value *V, Pred F, SetT& setOut, DropTraceCache &C) {
+    for (User *U : V->users()) {
+        if (!spendBudget(C)) {
+            return;
+        }
+        if (Instruction *I = dyn_cast<Instruction>(U)) {
+            if (F(I)) {
+                setOut.insert(I);
+            }
+        }
+    }
+}
+
+static void traceResult(const LockSite &MLI, DropSet &setDropInst, const DataLayout &DL,
+                        const LockAPIClassifier &LAC, DropTraceCache &C) {
+    Value *ResultValue = MLI.ResultValue;
+    for (User *U : ResultValue->users()) {
+        if (!spendBudget(C)) {
+            return;
+        }
+        Instruction *I = dyn_cast<Instruction>(U);
+        if (I == MLI.LockInst) {
+            continue;
+        }
+        if (!I) {
+            continue;
+        }
+        if (skipInst(I)) {
+            continue;
+        }
+        
+        if (isCallOrInvokeInst(I)) {
+            CallSite CS(I);
+            Function *F = CS.getCalledFunction();
+            if (!F) {
+                continue;
+            }
+            if (LAC.isDrop(F)) {
+                setDropInst.insert(I);
+            } else if (LAC.getKind(F) == LockAPIKind::ResultToInner) {
+                Value *LockGuardValue;
+                if (F->getReturnType()->isVoidTy()) {
+                    LockGuardValue = GetUnderlyingObject(I->getOperand(0), DL);
+                } else {
+                    LockGuardValue = I;
+                }
+                traceDropInst(LockGuardValue, setDropInst, LAC, C);
+            }
+        } else if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+            traceDropInstForInstruction(LI, setDropInst, LAC, C);
+        } else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+            traceStoredDrops(SI->getPointerOperand(), setDropInst, LAC, C);
+        } else if (BitCastInst *BCI = dyn_cast<BitCastInst>(I)) {
+            //errs() << "BitCastInst" << "\n";
+            //BCI->print(errs());
+            //errs() << "\n";
+            auto isDrop = [&LAC](Instruction *I) { return isDropInst(I, LAC); };
+            CastTraceSets &S = C.CastSets;
+            S.clear();
+            CastTraceSets::InstSet &setCastLoad = S.setCastLoad;
+            visitUsersOfValue(BCI, [](Instruction *I) { return isa<LoadInst>(I); }, setCastLoad, C);
+            CastTraceSets::InstSet &setICmp0 = S.setICmp0;
+            for (Instruction *CastLoad : setCastLoad) {
+                visitUsersOfValue(CastLoad, [](Instruction *I) { return isa<ICmpInst>(I); }, setICmp0, C);
+            }
+            for (Instruction *ICmp0 : setICmp0) {
+                //errs() << "ICmp0:\n";
+                //ICmp0->print(errs());
+                //errs() << "\n";
+                getICmp0Br0First(ICmp0, setDropInst);
+            }
+            CastTraceSets::InstSet &setGEP01 = S.setGEP01;
+            visitUsersOfValue(BCI, isGEP01, setGEP01, C);
+            //for (Instruction *GEP01 : setGEP01) {
+            //    errs() << "GEP01\n";
+            //    GEP01->print(errs());
+            //    errs() << "\n";
+            //}
+            for (Instruction *LockGuard: setGEP01) {
+                visitUsersOfValue(LockGuard, isDrop, setDropInst, C);     
+            }
+            CastTraceSets::InstSet &setGEP00 = S.setGEP00;
+            for (Instruction *GEP01 : setGEP01) {
+                visitUsersOfValue(GEP01, isGEP00, setGEP00, C);
+            }
+            //for (Instruction *GEP00 : setGEP00) {
+            //    errs() << "GEP00\n";
+            //    GEP00->print(errs());
+            //    errs() << "\n";
+            //}
+            CastTraceSets::InstSet &setLoad = S.setLoad;
+            for (Instruction *GEP00: setGEP00) {
+                visitUsersOfValue(GEP00, [](Instruction *I) { return isa<LoadInst>(I); }, setLoad, C);
+            }
+            //for (Instruction *Load : setLoad) {
+            //    errs() << "Load\n";
+            //    Load->print(errs());
+            //    errs() << "\n";
+            //}
+            CastTraceSets::InstSet &setStore = S.setStore;
+            for (Instruction *Load: setLoad) {
+                visitUsersOfValue(Load, [](Instruction *I) { return isa<StoreInst>(I); }, setStore, C);
+            }
+            //for (Instruction *Store : setStore) {
+            //    errs() << "Store\n";
+            //    Store->print(errs());
+            //    errs() << "\n";
+            //}
+            //errs() << "Store Target\n";
+            CastTraceSets::InstSet &setGEPGuard = S.setGEPGuard;
+            for (Instruction *Store: setStore) {
+                Value *TargetAddr = Store->getOperand(1);
+                Value *Target = GetUnderlyingObject(TargetAddr, DL);
+                //Target->print(errs());
+                //errs() << "\n";
+                visitUsersOfValue(Target, [](Instruction *I) { return isa<GetElementPtrInst>(I); }, setGEPGuard, C);
+            }
+            //for (Instruction *GEPGuard : setGEPGuard) {
+            //    errs() << "GEPGuard\n";
+            //    GEPGuard->print(errs());
+            //    errs() << "\n";
+            //}
+            CastTraceSets::InstSet &setLockGuard = S.setLockGuard;
+            for (Instruction *GEPGuard: setGEPGuard) {
+                if (Instruction *LockGuard = dyn_cast<Instruction>(GEPGuard->getOperand(0))) {
+                    setLockGuard.insert(LockGuard);
+                }
+            }
+            for (Instruction *LockGuard: setLockGuard) {
+                //errs() << "LockGuard" << "\n";
+                //errs() << LockGuard->getParent()->getName() << "\n";
+                //LockGuard->print(errs());
+                //errs() << "\n";
+                visitUsersOfValue(LockGuard, isDrop, setDropInst, C);     
+            }
+            CastTraceSets::InstSet &setLoadLockGuard = S.setLoadLockGuard;
+            for (Instruction *LockGuard: setLockGuard) {
+                visitUsersOfValue(LockGuard, [](Instruction *I) { return isa<LoadInst>(I); }, setLoadLockGuard, C);
+            }
+            for (Instruction *LoadLockGuard: setLoadLockGuard) {
+                visitUsersOfValue(LoadLockGuard, isDrop, setDropInst, C);     
+            }
+        }
+    }
+}
+
+static bool isManualDropInst(Instruction *NI, const LockAPIClassifier &LAC) {
+    if (isCallOrInvokeInst(NI)) {
+        CallSite CS;
+        if (Function *F = getCalledFunc(NI, CS)) {
+            if (LAC.getKind(F) == LockAPIKind::ManualDrop) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool trackDownToDropInsts(Instruction *RI, DropSet &setDropInst,
+                                 const ModuleIndex &MI,
+                                 const LockAPIClassifier &LAC,
+                                 DropTraceCache &C) {
+    if (!RI) {
+        return false;
+    }
+    setDropInst.clear();
+
+    // Users of an instruction are in the same function, except for users
+    // of the dropped operand below, which may be a global.
+    Function *F = RI->getFunction();
+    BitVector Visited(MI.getNumInsts(F));
+    auto isVisited = [&](Instruction *I) {
+        return I->getFunction() == F && Visited.test(MI.getInstIdx(I));
+    };
+    // Everything reachable from a dead instruction is dead as well, so
+    // skipping them does not change the order in which drops are found.
+    BitVector &NoManualDrop = C.vecNoManualDrop[MI.getFuncIdx(F)];
+    if (NoManualDrop.empty()) {
+        NoManualDrop.resize(MI.getNumInsts(F));
+    }
+    auto isDead = [&](Instruction *I) {
+        return NoManualDrop.test(MI.getInstIdx(I));
+    };
+    if (isDead(RI)) {
+        return false;
+    }
+    bool Reported = false;
+
+    // FIFO over a vector: Head is the next instruction to expand.
+    std::vector<Instruction *> WorkList;
+    WorkList.push_back(RI);
+    for (std::size_t Head = 0; Head < WorkList.size(); ++Head) {
+        Instruction *Curr = WorkList[Head];
+        for (User *U: Curr->users()) {
+            if (!spendBudget(C)) {
+                return false;
+            }
+            if (Instruction *UI = dyn_cast<Instruction>(U)) {
+                if (!isVisited(UI)) {
+                    if (isManualDropInst(UI, LAC)) {
+                        setDropInst.insert(UI);
+                        Value *V = UI->getOperand(0);
+                        assert(V);
+                        for (User *UV: V->users()) {
+                            if (Instruction *UVI = dyn_cast<Instruction>(UV)) {
+                                if (!isVisited(UVI)) {
+                                    if (isManualDropInst(UVI, LAC)) {
+                                        setDropInst.insert(UVI);
+                                    }
+                                }
+                            }
+                        }
+                        return true;
+                    } else if (StoreInst *SI = dyn_cast<StoreInst>(UI)) {
+                        if (Instruction *Dest = dyn_cast<Instruction>(SI->getPointerOperand())) {
+                            if (!isDead(Dest)) {
+                                WorkList.push_back(Dest);
+                            }
+                        } else {
+                            errs() << "StoreInst Dest is not a Inst\n";
+                            printDebugInfo(Curr);
+                            Reported = true;
+                        }
+                    } else if (!isDead(UI)) {
+                        WorkList.push_back(UI);
+                    }
+                    Visited.set(MI.getInstIdx(UI));
+                }
+            }
+        }
+    }
+    // A later trace through a dead instruction would skip the message.
+    if (!Reported) {
+        for (Instruction *I : WorkList) {
+            NoManualDrop.set(MI.getInstIdx(I));
+        }
+    }
+    return false;
+}
+
+// State shared by the interprocedural manual drop tracing of a module.
+struct InterProcTrace {
+    const ModuleIndex &MI;
+    const LockAPIClassifier &LAC;
+    const DenseCallGraph &CG;
+    ManualDropSummaries &S;
+    DropTraceCache &C;
+};
+
+static const DropSet &getArgDrops(unsigned FuncIdx, unsigned ArgNo, InterProcTrace &T);
+
+// Adds the manual drops of the callees that Curr is passed to by call UI.
+static bool traceCalleeDrops(Instruction *UI, Value *Curr, DropSet &setDropInst, InterProcTrace &T) {
+    CallSite CS;
+    Function *Callee = getCalledFunc(UI, CS);
+    if (!Callee || Callee->isDeclaration()) {
+        return false;
+    }
+    unsigned CalleeIdx = T.MI.getFuncIdx(Callee);
+    unsigned NumArgs = std::min<unsigned>(CS.getNumArgOperands(), Callee->arg_size());
+    bool Found = false;
+    for (unsigned i = 0; i < NumArgs; ++i) {
+        if (CS.getArgOperand(i) != Curr) {
+            continue;
+        }
+        const DropSet &Drops = getArgDrops(CalleeIdx, i, T);
+        if (!Drops.empty()) {
+            setDropInst.insert(Drops.begin(), Drops.end());
+            Found = true;
+        }
+    }
+    return Found;
+}
+
+// trackDownToDropInsts from Root (an instruction or argument of F), except
+// that a call hands the guard to the argument summaries of its callee and
+// that Escapes is set if the guard reaches a ret.
+static bool traceInterProcDrops(Value *Root, Function *F, DropSet &setDropInst,
+                                bool &Escapes, InterProcTrace &T) {
+    const ModuleIndex &MI = T.MI;
+    BitVector Visited(MI.getNumInsts(F));
+    auto isVisited = [&](Instruction *I) {
+        return I->getFunction() == F && Visited.test(MI.getInstIdx(I));
+    };
+
+    std::vector<Value *> WorkList;
+    WorkList.push_back(Root);
+    for (std::size_t Head = 0; Head < WorkList.size(); ++Head) {
+        Value *Curr = WorkList[Head];
+        for (User *U: Curr->users()) {
+            if (!spendBudget(T.C)) {
+                return false;
+            }
+            Instruction *UI = dyn_cast<Instruction>(U);
+            if (!UI || isVisited(UI)) {
+                continue;
+            }
+            if (isManualDropInst(UI, T.LAC)) {
+                setDropInst.insert(UI);
+                Value *V = UI->getOperand(0);
+                assert(V);
+                for (User *UV: V->users()) {
+                    if (Instruction *UVI = dyn_cast<Instruction>(UV)) {
+                        if (!isVisited(UVI)) {
+                            if (isManualDropInst(UVI, T.LAC)) {
+                                setDropInst.insert(UVI);
+                            }
+                        }
+                    }
+                }
+                return true;
+            } else if (StoreInst *SI = dyn_cast<StoreInst>(UI)) {
+                if (Instruction *Dest = dyn_cast<Instruction>(SI->getPointerOperand())) {
+                    WorkList.push_back(Dest);
+                }
+            } else {
+                if (isa<ReturnInst>(UI)) {
+                    Escapes = true;
+                } else if (isCallOrInvokeInst(UI) && traceCalleeDrops(UI, Curr, setDropInst, T)) {
+                    return true;
+                }
+                WorkList.push_back(UI);
+            }
+            Visited.set(MI.getInstIdx(UI));
+        }
+    }
+    return false;
+}
+
+// Summaries are shared by all lock sites, so each is traced with a budget
+// of its own. The budget of the lock site that asked is restored after.
+template <typename TraceFn>
+static void traceSummary(DropTraceCache &C, TraceFn Trace) {
+    uint64_t Remaining = C.Remaining;
+    bool Truncated = C.Truncated;
+    C.Remaining = C.Budget ? C.Budget : std::numeric_limits<uint64_t>::max();
+    C.Truncated = false;
+    Trace();
+    if (C.Truncated) {
+        ++C.NumTruncated;
+    }
+    C.Remaining = Remaining;
+    C.Truncated = Truncated;
+}
+
+static const DropSet &getArgDrops(unsigned FuncIdx, unsigned ArgNo, InterProcTrace &T) {
+    FuncDropSummary &FS = T.S.vecFuncs[FuncIdx];
+    Function *F = T.MI.getFunc(FuncIdx);
+    if (FS.vecArgState.empty()) {
+        FS.vecArgDrops.resize(F->arg_size());
+        FS.vecArgState.resize(F->arg_size(), SummaryState::None);
+    }
+    if (FS.vecArgState[ArgNo] == SummaryState::None) {
+        FS.vecArgState[ArgNo] = SummaryState::InProgress;
+        DropSet setDrops;
+        traceSummary(T.C, [&]() {
+            // A returned argument is followed at the call site (the call
+            // is a user of the argument there), not through setReturnDrops.
+            bool Escapes = false;
+            traceInterProcDrops(F->arg_begin() + ArgNo, F, setDrops, Escapes, T);
+        });
+        FS.vecArgDrops[ArgNo] = std::move(setDrops);
+        FS.vecArgState[ArgNo] = SummaryState::Done;
+    }
+    return FS.vecArgDrops[ArgNo];
+}
+
+static const DropSet &getReturnDrops(unsigned FuncIdx, InterProcTrace &T) {
+    ManualDropSummaries &S = T.S;
+    if (!S.CallSitesDone) {
+        S.CallSitesDone = true;
+        for (unsigned Caller = 0; Caller < T.CG.getNumCallers(); ++Caller) {
+            for (const CallEdge *E = T.CG.begin(Caller); E != T.CG.end(Caller); ++E) {
+                S.vecCallSites[E->Callee].push_back(E->CallInst);
+            }
+        }
+    }
+    FuncDropSummary &FS = S.vecFuncs[FuncIdx];
+    if (FS.ReturnState == SummaryState::None) {
+        FS.ReturnState = SummaryState::InProgress;
+        DropSet setDrops;
+        for (Instruction *CallInst : S.vecCallSites[FuncIdx]) {
+            Function *Caller = CallInst->getFunction();
+            bool Escapes = false;
+            traceSummary(T.C, [&]() {
+                traceInterProcDrops(CallInst, Caller, setDrops, Escapes, T);
+            });
+            if (Escapes) {
+                const DropSet &CallerDrops = getReturnDrops(T.MI.getFuncIdx(Caller), T);
+                setDrops.insert(CallerDrops.begin(), CallerDrops.end());
+            }
+        }
+        FS.setReturnDrops = std::move(setDrops);
+        FS.ReturnState = SummaryState::Done;
+    }
+    return FS.setReturnDrops;
+}
+
+const unsigned LockSiteInfo::DefaultDropTraceBudget;
+
+LockSiteInfo::LockSiteInfo(Module &M, const LockAPIMatcher &Matcher, unsigned NumThreads,
+                           unsigned DropTraceBudget, unsigned IndirectFanOut) :
+    M(M),
+    MI(M),
+    LAC(Matcher),
+    IndirectFanOut(IndirectFanOut) {
+    MD5 Hash;
+    Matcher.hash(Hash);
+    Hash.final(MatcherHash);
+
+    LAC.classifyModule(M);
+    IndirectCallTable ICT(M, MI, IndirectFanOut);
+
+    // The scan only reads the IR, so functions are sharded across threads
+    // and the per-shard results appended in shard (i.e., module) order.
+    unsigned NumFuncs = MI.getNumFuncs();
+    unsigned NumShards = std::max(1u, std::min<unsigned>(NumThreads, NumFuncs));
+    std::vector<ScanShard> Shards(NumShards);
+    if (NumShards == 1) {
+        scanFunctions(MI, 0, NumFuncs, LAC, ICT, Shards[0]);
+    } else {
+        std::vector<std::thread> Workers;
+        for (unsigned i = 0; i < NumShards; ++i) {
+            unsigned Begin = (uint64_t)NumFuncs * i / NumShards;
+            unsigned End = (uint64_t)NumFuncs * (i + 1) / NumShards;
+            Workers.emplace_back(scanFunctions, std::cref(MI), Begin, End, std::cref(LAC), std::cref(ICT),
+                                 std::ref(Shards[i]));
+        }
+        for (std::thread &T : Workers) {
+            T.join();
+        }
+    }
+    for (ScanShard &Shard : Shards) {
+        CG.append(Shard.CallGraph);
+        Shard.CallGraph = DenseCallGraph();
+        IndirectCalls.NumResolved += Shard.IndirectCalls.NumResolved;
+        IndirectCalls.NumEdges += Shard.IndirectCalls.NumEdges;
+        IndirectCalls.NumCapped += Shard.IndirectCalls.NumCapped;
+        if (vecSites.empty()) {
+            vecSites.swap(Shard.vecSites);
+        } else {
+            vecSites.insert(vecSites.end(), Shard.vecSites.begin(), Shard.vecSites.end());
+        }
+    }
+
+    vecGuardDrops.resize(vecSites.size());
+    GuardDropsDone.resize(vecSites.size());
+    vecManualDrops.resize(vecSites.size());
+    ManualDropsDone.resize(vecSites.size());
+    HasManualDrops.resize(vecSites.size());
+    vecInterProcDrops.resize(vecSites.size());
+    InterProcDropsDone.resize(vecSites.size());
+
+    Cache.Budget = DropTraceBudget;
+    Cache.Remaining = 0;
+    Cache.Truncated = false;
+    Cache.NumTruncated = 0;
+    Cache.vecNoManualDrop.resize(NumFuncs);
+}
+
+// Resets the budget before the trace of one lock site.
+static void startTrace(DropTraceCache &C) {
+    C.Remaining = C.Budget ? C.Budget : std::numeric_limits<uint64_t>::max();
+    C.Truncated = false;
+}
+
+static void finishTrace(DropTraceCache &C) {
+    if (C.Truncated) {
+        ++C.NumTruncated;
+    }
+}
+
+const DropSet &LockSiteInfo::getGuardDrops(unsigned Idx) {
+    DropSet &Drops = vecGuardDrops[Idx];
+    if (!GuardDropsDone.test(Idx)) {
+        GuardDropsDone.set(Idx);
+        const LockSite &Site = vecSites[Idx];
+        if (!Site.ResultValue) {
+            return Drops;
+        }
+        startTrace(Cache);
+        if (Site.ResultValue == Site.LockInst) {
+            traceDropInst(Site.ResultValue, Drops, LAC, Cache);
+        } else {
+            traceResult(Site, Drops, M.getDataLayout(), LAC, Cache);
+        }
+        finishTrace(Cache);
+    }
+    return Drops;
+}
+
+bool LockSiteInfo::getManualDrops(unsigned Idx, const DropSet *&Drops) {
+    Drops = &vecManualDrops[Idx];
+    if (!ManualDropsDone.test(Idx)) {
+        ManualDropsDone.set(Idx);
+        Instruction *RI = dyn_cast_or_null<Instruction>(vecSites[Idx].ResultValue);
+        startTrace(Cache);
+        if (trackDownToDropInsts(RI, vecManualDrops[Idx], MI, LAC, Cache)) {
+            HasManualDrops.set(Idx);
+        }
+        finishTrace(Cache);
+    }
+    return HasManualDrops.test(Idx);
+}
+
+bool LockSiteInfo::getInterProcManualDrops(unsigned Idx, const DropSet *&Drops) {
+    if (getManualDrops(Idx, Drops)) {
+        return true;
+    }
+    Instruction *RI = dyn_cast_or_null<Instruction>(vecSites[Idx].ResultValue);
+    if (!RI) {
+        return false;
+    }
+    Drops = &vecInterProcDrops[Idx];
+    if (!InterProcDropsDone.test(Idx)) {
+        InterProcDropsDone.set(Idx);
+        if (Summaries.vecFuncs.empty()) {
+            Summaries.vecFuncs.resize(MI.getNumFuncs());
+            Summaries.vecCallSites.resize(MI.getNumFuncs());
+        }
+        InterProcTrace T = {MI, LAC, CG, Summaries, Cache};
+        DropSet &setDrops = vecInterProcDrops[Idx];
+        bool Escapes = false;
+        startTrace(Cache);
+        if (!traceInterProcDrops(RI, RI->getFunction(), setDrops, Escapes, T) && Escapes) {
+            const DropSet &CallerDrops = getReturnDrops(MI.getFuncIdx(RI->getFunction()), T);
+            setDrops.insert(CallerDrops.begin(), CallerDrops.end());
+        }
+        finishTrace(Cache);
+    }
+    return !Drops->empty();
+}
+
+void LockSiteInfo::setDropTraceBudget(unsigned Budget) {
+    if (Budget == Cache.Budget) {
+        return;
+    }
+    Cache.Budget = Budget;
+    Cache.mapGuardDrops.clear();
+    Cache.mapStoredDrops.clear();
+    for (BitVector &NoManualDrop : Cache.vecNoManualDrop) {
+        NoManualDrop.clear();
+    }
+    for (DropSet &Drops : vecGuardDrops) {
+        Drops.clear();
+    }
+    GuardDropsDone.reset();
+    for (DropSet &Drops : vecManualDrops) {
+        Drops.clear();
+    }
+    ManualDropsDone.reset();
+    HasManualDrops.reset();
+    for (DropSet &Drops : vecInterProcDrops) {
+        Drops.clear();
+    }
+    InterProcDropsDone.reset();
+    Summaries = ManualDropSummaries();
+}
+
+LockSiteInfo &LockSiteResult::getLockSites(const LockAPIMatcher &Matcher, unsigned NumThreads,
+                                           unsigned DropTraceBudget, unsigned IndirectFanOut) {
+    if (Info && Info->getIndirectFanOut() == IndirectFanOut) {
+        MD5 Hash;
+        Matcher.hash(Hash);
+        MD5::MD5Result Result;
+        Hash.final(Result);
+        if (Result == Info->getMatcherHash()) {
+            Info->setDropTraceBudget(DropTraceBudget);
+            return *Info;
+        }
+    }
+    Info.reset(new LockSiteInfo(*pModule, Matcher, NumThreads, DropTraceBudget, IndirectFanOut));
+    return *Info;
+}
+
+char LockSiteAnalysis::ID = 0;
+
+LockSiteAnalysis::LockSiteAnalysis() : ModulePass(ID) {
+    initializeLockSiteAnalysisPass(*PassRegistry::getPassRegistry());
+}
+
+void LockSiteAnalysis::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.setPreservesAll();
+}
+
+bool LockSiteAnalysis::runOnModule(Module &M) {
+    // The scan is done on the first request, with the requester's table.
+    Result.reset(new LockSiteResult(M));
+    return false;
+}
+
+void LockSiteAnalysis::releaseMemory() {
+    Result.reset();
+}
+
+LockSiteInfo &LockSiteAnalysis::getLockSites(const LockAPIMatcher &Matcher, unsigned NumThreads,
+                                             unsigned DropTraceBudget, unsigned IndirectFanOut) {
+    return Result->getLockSites(Matcher, NumThreads, DropTraceBudget, IndirectFanOut);
+}
+
+INITIALIZE_PASS(LockSiteAnalysis, "lock-sites", "Lock sites and the drops of their guards", false, true)
+
+AnalysisKey LockSiteModuleAnalysis::Key;
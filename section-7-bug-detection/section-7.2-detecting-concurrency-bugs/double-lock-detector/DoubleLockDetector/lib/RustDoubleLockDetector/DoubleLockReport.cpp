@@ -0,0 +1,338 @@
+#include "RustDoubleLockDetector/DoubleLockReport.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+
+using namespace llvm;
+
+namespace detector {
+
+    ReportLocation ReportLocation::get(const Instruction *I) {
+        ReportLocation L;
+        L.Function = I->getFunction()->getName().str();
+        L.Line = 0;
+        L.HasDebugLoc = false;
+        const DebugLoc &Loc = I->getDebugLoc();
+        if (Loc.get()) {
+            L.Directory = Loc->getDirectory().str();
+            L.File = Loc->getFilename().str();
+            L.Line = Loc.getLine();
+            L.HasDebugLoc = true;
+        }
+        return L;
+    }
+
+    // json::Value requires valid UTF-8; paths from debug info need not be.
+    static std::string toUTF8(StringRef S) {
+        if (json::isUTF8(S)) {
+            return S.str();
+        }
+        return json::fixUTF8(S);
+    }
+
+    static json::Value toJSON(const ReportLocation &L) {
+        json::Object Obj{{"function", toUTF8(L.Function)}};
+        if (L.HasDebugLoc) {
+            Obj["directory"] = toUTF8(L.Directory);
+            Obj["file"] = toUTF8(L.File);
+            Obj["line"] = L.Line;
+        }
+        return std::move(Obj);
+    }
+
+    static json::Value toSarifLocation(const ReportLocation &L) {
+        json::Object Loc;
+        if (L.HasDebugLoc) {
+            SmallString<128> Path;
+            if (!sys::path::is_absolute(L.File)) {
+                Path = L.Directory;
+            }
+            sys::path::append(Path, L.File);
+            Loc["physicalLocation"] = json::Object{
+                {"artifactLocation", json::Object{{"uri", toUTF8(Path)}}},
+                {"region", json::Object{{"startLine", L.Line}}},
+            };
+        }
+        Loc["logicalLocations"] = json::Array{
+            json::Object{{"fullyQualifiedName", toUTF8(L.Function)}, {"kind", "function"}},
+        };
+        return std::move(Loc);
+    }
+
+    ReportSink::ReportSink(raw_ostream &OS, ReportFormat Format, StringRef ModuleName, bool SarifFragment) :
+        OS(OS),
+        Format(Format),
+        ModuleName(toUTF8(ModuleName)),
+        SarifFragment(SarifFragment),
+        NumFindings(0),
+        NumResults(0),
+        pCollected(nullptr) {
+        if (Format == ReportFormat::SARIF && !SarifFragment) {
+            writeSarifHeader(OS);
+        }
+    }
+
+    void ReportSink::add(const DoubleLockFinding &Finding, DiffState State) {
+        if (pCollected) {
+            pCollected->push_back(Finding);
+            return;
+        }
+        switch (Format) {
+            case ReportFormat::Text:
+                addText(Finding, State);
+                break;
+            case ReportFormat::JSONL:
+                addJSON(Finding, State);
+                break;
+            case ReportFormat::SARIF:
+                addSarif(Finding, State);
+                break;
+        }
+        ++NumFindings;
+    }
+
+    void ReportSink::add(const LockOrderFinding &Finding) {
+        switch (Format) {
+            case ReportFormat::Text:
+                addText(Finding);
+                break;
+            case ReportFormat::JSONL:
+                addJSON(Finding);
+                break;
+            case ReportFormat::SARIF:
+                addSarif(Finding);
+                break;
+        }
+        ++NumFindings;
+    }
+
+    void ReportSink::add(const TruncationNote &Note) {
+        switch (Format) {
+            case ReportFormat::Text:
+                addText(Note);
+                break;
+            case ReportFormat::JSONL:
+                addJSON(Note);
+                break;
+            case ReportFormat::SARIF:
+                addSarif(Note);
+                break;
+        }
+    }
+
+    void ReportSink::finish() {
+        if (Format == ReportFormat::SARIF && !SarifFragment) {
+            writeSarifFooter(OS);
+        }
+        OS.flush();
+    }
+
+    void ReportSink::writeSarifHeader(raw_ostream &OS) {
+        OS << "{\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\",\"version\":\"2.1.0\","
+           << "\"runs\":[{\"tool\":{\"driver\":{\"name\":\"rust-double-lock-detector\","
+           << "\"rules\":[{\"id\":\"double-lock\",\"shortDescription\":"
+           << "{\"text\":\"A lock is acquired again while its guard is still alive\"}},"
+           << "{\"id\":\"lock-order\",\"shortDescription\":"
+           << "{\"text\":\"Locks are acquired in inconsistent orders\"}},"
+           << "{\"id\":\"analysis-truncated\",\"shortDescription\":"
+           << "{\"text\":\"The analysis of a lock stopped at a resource limit\"}}]}},"
+           << "\"results\":[\n";
+    }
+
+    void ReportSink::writeSarifFooter(raw_ostream &OS) {
+        OS << "]}]}\n";
+    }
+
+    static void printLocation(const ReportLocation &L, raw_ostream &OS) {
+        if (L.HasDebugLoc) {
+            OS << " " << L.Directory << ' ' << L.File << ' ' << L.Line << "\n";
+        }
+    }
+
+    void ReportSink::addText(const DoubleLockFinding &Finding, DiffState State) {
+        // Added findings read like those of a full scan, so tools counting
+        // "Double Lock Happens!" count only what a change introduced.
+        OS << (State == DiffState::Removed ? "Double Lock Fixed! First Lock:\n" : "Double Lock Happens! First Lock:\n");
+        printLocation(Finding.FirstLock, OS);
+        OS << "Second Lock(s):\n";
+        for (const ReportLocation &L : Finding.vecSecondLocks) {
+            printLocation(L, OS);
+        }
+        OS << '\n';
+        for (const ReportLocation &L : Finding.vecCallChain) {
+            printLocation(L, OS);
+        }
+    }
+
+    void ReportSink::addJSON(const DoubleLockFinding &Finding, DiffState State) {
+        json::Array SecondLocks;
+        for (const ReportLocation &L : Finding.vecSecondLocks) {
+            SecondLocks.push_back(toJSON(L));
+        }
+        json::Array CallChain;
+        for (const ReportLocation &L : Finding.vecCallChain) {
+            CallChain.push_back(toJSON(L));
+        }
+        json::Object Obj{
+            {"kind", "double-lock"},
+            {"module", ModuleName},
+            {"first_lock", toJSON(Finding.FirstLock)},
+            {"second_locks", std::move(SecondLocks)},
+            {"call_chain", std::move(CallChain)},
+        };
+        if (State != DiffState::None) {
+            Obj["diff"] = State == DiffState::Added ? "added" : "removed";
+        }
+        OS << json::Value(std::move(Obj)) << '\n';
+    }
+
+    void ReportSink::addSarif(const DoubleLockFinding &Finding, DiffState State) {
+        json::Array Related;
+        for (std::size_t i = 0; i < Finding.vecSecondLocks.size(); ++i) {
+            json::Value Loc = toSarifLocation(Finding.vecSecondLocks[i]);
+            json::Object *Obj = Loc.getAsObject();
+            (*Obj)["id"] = static_cast<int64_t>(i);
+            (*Obj)["message"] = json::Object{{"text", "second lock"}};
+            Related.push_back(std::move(Loc));
+        }
+        json::Object Result{
+            {"ruleId", "double-lock"},
+            {"level", "warning"},
+            {"message", json::Object{{"text", "Lock acquired in " + toUTF8(Finding.FirstLock.Function)
+                                              + " may be acquired again before it is dropped"}}},
+            {"locations", json::Array{toSarifLocation(Finding.FirstLock)}},
+            {"relatedLocations", std::move(Related)},
+            {"properties", json::Object{{"module", ModuleName}}},
+        };
+        if (!Finding.vecCallChain.empty()) {
+            json::Array Steps;
+            for (const ReportLocation &L : Finding.vecCallChain) {
+                Steps.push_back(json::Object{{"location", toSarifLocation(L)}});
+            }
+            Result["codeFlows"] = json::Array{
+                json::Object{{"threadFlows", json::Array{json::Object{{"locations", std::move(Steps)}}}}},
+            };
+        }
+        if (State != DiffState::None) {
+            Result["baselineState"] = State == DiffState::Added ? "new" : "absent";
+        }
+        writeSarifResult(std::move(Result));
+    }
+
+    void ReportSink::writeSarifResult(json::Value Result) {
+        // A standalone log separates results itself; fragments are joined
+        // by the driver.
+        if (!SarifFragment && NumResults > 0) {
+            OS << ',';
+        }
+        OS << Result << '\n';
+        ++NumResults;
+    }
+
+    void ReportSink::addText(const LockOrderFinding &Finding) {
+        OS << "Lock Order Inversion Happens! Cycle:\n";
+        for (const LockOrderEdge &E : Finding.vecEdges) {
+            OS << "Held Lock:\n";
+            printLocation(E.Held, OS);
+            OS << "Then Acquired:\n";
+            printLocation(E.Acquire, OS);
+        }
+        OS << '\n';
+    }
+
+    void ReportSink::addJSON(const LockOrderFinding &Finding) {
+        json::Array Cycle;
+        for (const LockOrderEdge &E : Finding.vecEdges) {
+            Cycle.push_back(json::Object{{"held", toJSON(E.Held)}, {"acquire", toJSON(E.Acquire)}});
+        }
+        OS << json::Value(json::Object{
+            {"kind", "lock-order"},
+            {"module", ModuleName},
+            {"cycle", std::move(Cycle)},
+        }) << '\n';
+    }
+
+    void ReportSink::addSarif(const LockOrderFinding &Finding) {
+        json::Array Related;
+        json::Array Steps;
+        for (std::size_t i = 0; i < Finding.vecEdges.size(); ++i) {
+            const LockOrderEdge &E = Finding.vecEdges[i];
+            json::Value Loc = toSarifLocation(E.Acquire);
+            json::Object *Obj = Loc.getAsObject();
+            (*Obj)["id"] = static_cast<int64_t>(i);
+            (*Obj)["message"] = json::Object{{"text", "acquired while the previous lock is held"}};
+            Related.push_back(std::move(Loc));
+            Steps.push_back(json::Object{{"location", toSarifLocation(E.Held)}});
+            Steps.push_back(json::Object{{"location", toSarifLocation(E.Acquire)}});
+        }
+        const ReportLocation &First = Finding.vecEdges.front().Held;
+        json::Object Result{
+            {"ruleId", "lock-order"},
+            {"level", "warning"},
+            {"message", json::Object{{"text", "Lock acquired in " + toUTF8(First.Function) + " is part of a cycle of "
+                                              + std::to_string(Finding.vecEdges.size()) + " locks acquired in inconsistent orders"}}},
+            {"locations", json::Array{toSarifLocation(First)}},
+            {"relatedLocations", std::move(Related)},
+            {"codeFlows", json::Array{
+                json::Object{{"threadFlows", json::Array{json::Object{{"locations", std::move(Steps)}}}}},
+            }},
+            {"properties", json::Object{{"module", ModuleName}}},
+        };
+        writeSarifResult(std::move(Result));
+    }
+
+    static const char *getReasonName(TruncationReason Reason) {
+        switch (Reason) {
+            case TruncationReason::LockVisits:
+                return "lock-visits";
+            case TruncationReason::CallDepth:
+                return "call-depth";
+            case TruncationReason::LockTime:
+                return "lock-time";
+            case TruncationReason::ModuleVisits:
+                return "module-visits";
+            case TruncationReason::ModuleTime:
+                return "module-time";
+        }
+        return "unknown";
+    }
+
+    void ReportSink::addText(const TruncationNote &Note) {
+        OS << "Analysis Truncated! Reason: " << getReasonName(Note.Reason) << "\n";
+        OS << "Lock:\n";
+        printLocation(Note.Lock, OS);
+        if (Note.NumSkipped) {
+            OS << "Skipped Lock Sites: " << Note.NumSkipped << "\n";
+        }
+        OS << '\n';
+    }
+
+    void ReportSink::addJSON(const TruncationNote &Note) {
+        OS << json::Value(json::Object{
+            {"kind", "truncated"},
+            {"module", ModuleName},
+            {"reason", getReasonName(Note.Reason)},
+            {"lock", toJSON(Note.Lock)},
+            {"skipped_sites", static_cast<int64_t>(Note.NumSkipped)},
+        }) << '\n';
+    }
+
+    void ReportSink::addSarif(const TruncationNote &Note) {
+        std::string Text = Note.NumSkipped
+                           ? std::to_string(Note.NumSkipped) + " lock sites, starting with one in "
+                             + toUTF8(Note.Lock.Function) + ", were not analysed"
+                           : "The analysis of a lock acquired in " + toUTF8(Note.Lock.Function) + " was cut short";
+        json::Object Result{
+            {"ruleId", "analysis-truncated"},
+            {"level", "note"},
+            {"message", json::Object{{"text", Text + " (" + getReasonName(Note.Reason) + " limit)"}}},
+            {"locations", json::Array{toSarifLocation(Note.Lock)}},
+            {"properties", json::Object{{"module", ModuleName}}},
+        };
+        writeSarifResult(std::move(Result));
+    }
+}
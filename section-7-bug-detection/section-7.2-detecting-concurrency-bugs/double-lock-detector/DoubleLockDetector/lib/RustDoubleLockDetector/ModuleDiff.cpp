@@ -0,0 +1,288 @@
+#include "RustDoubleLockDetector/ModuleDiff.h"
+
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Common/TypeNames.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+using namespace llvm;
+
+namespace detector {
+
+    namespace {
+        // Hashes one function; see hashFunction().
+        class FunctionHasher {
+        public:
+            hash_code hash(const Function &F);
+
+        private:
+            hash_code hashType(Type *T);
+
+            hash_code hashValue(const Value *V);
+
+            hash_code hashInst(const Instruction &I);
+
+            // Numbers of the arguments, blocks and instructions of the function.
+            DenseMap<const Value *, unsigned> mapLocalIdx;
+            DenseMap<Type *, hash_code> mapTypes;
+            // Set while the initializer of a local global is hashed, so that
+            // globals referring to each other are hashed by name instead.
+            bool InInitializer = false;
+        };
+    }
+
+    hash_code FunctionHasher::hashType(Type *T) {
+        auto It = mapTypes.find(T);
+        if (It != mapTypes.end()) {
+            return It->second;
+        }
+        hash_code H = hash_value(unsigned(T->getTypeID()));
+        StructType *ST = dyn_cast<StructType>(T);
+        if (ST && ST->hasName()) {
+            // Named structs may be recursive; their name stands for them.
+            H = hash_combine(H, stripTypeSuffix(ST->getName()));
+        } else if (T->isVectorTy()) {
+            // The element count has no accessor common to all LLVM versions.
+            std::string Printed;
+            raw_string_ostream OS(Printed);
+            T->print(OS);
+            H = hash_combine(H, OS.str());
+        } else {
+            if (T->isIntegerTy()) {
+                H = hash_combine(H, T->getIntegerBitWidth());
+            } else if (T->isArrayTy()) {
+                H = hash_combine(H, T->getArrayNumElements());
+            } else if (T->isPointerTy()) {
+                H = hash_combine(H, T->getPointerAddressSpace());
+            } else if (T->isFunctionTy()) {
+                H = hash_combine(H, T->isFunctionVarArg());
+            } else if (ST) {
+                H = hash_combine(H, ST->isPacked());
+            }
+            for (Type *Sub : T->subtypes()) {
+                H = hash_combine(H, hashType(Sub));
+            }
+        }
+        mapTypes[T] = H;
+        return H;
+    }
+
+    hash_code FunctionHasher::hashValue(const Value *V) {
+        auto It = mapLocalIdx.find(V);
+        if (It != mapLocalIdx.end()) {
+            return hash_combine('L', It->second);
+        }
+        hash_code H = hash_combine(V->getValueID(), hashType(V->getType()));
+        if (const GlobalVariable *GV = dyn_cast<GlobalVariable>(V)) {
+            // Local constants, e.g. string literals, are often unnamed or
+            // numbered in order, so they are hashed by their contents.
+            if (GV->hasLocalLinkage() && GV->hasInitializer() && !InInitializer) {
+                InInitializer = true;
+                H = hash_combine(H, GV->isConstant(), hashValue(GV->getInitializer()));
+                InInitializer = false;
+                return H;
+            }
+            return hash_combine(H, GV->getName());
+        }
+        if (const GlobalValue *G = dyn_cast<GlobalValue>(V)) {
+            return hash_combine(H, G->getName());
+        }
+        if (const ConstantInt *CI = dyn_cast<ConstantInt>(V)) {
+            return hash_combine(H, CI->getValue());
+        }
+        if (const ConstantFP *CFP = dyn_cast<ConstantFP>(V)) {
+            return hash_combine(H, CFP->getValueAPF());
+        }
+        if (const ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(V)) {
+            return hash_combine(H, CDS->getRawDataValues());
+        }
+        if (const ConstantExpr *CE = dyn_cast<ConstantExpr>(V)) {
+            H = hash_combine(H, CE->getOpcode());
+            if (CE->isCompare()) {
+                H = hash_combine(H, CE->getPredicate());
+            }
+        }
+        if (const InlineAsm *IA = dyn_cast<InlineAsm>(V)) {
+            return hash_combine(H, IA->getAsmString(), IA->getConstraintString());
+        }
+        // Aggregates and constant expressions; metadata operands (e.g. of
+        // debug intrinsics) are not Users and stop here.
+        if (const Constant *C = dyn_cast<Constant>(V)) {
+            for (const Value *Op : C->operands()) {
+                H = hash_combine(H, hashValue(Op));
+            }
+        }
+        return H;
+    }
+
+    hash_code FunctionHasher::hashInst(const Instruction &I) {
+        hash_code H = hash_combine(I.getOpcode(), hashType(I.getType()));
+        if (const CmpInst *Cmp = dyn_cast<CmpInst>(&I)) {
+            H = hash_combine(H, Cmp->getPredicate());
+        } else if (const AllocaInst *AI = dyn_cast<AllocaInst>(&I)) {
+            H = hash_combine(H, hashType(AI->getAllocatedType()));
+        } else if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(&I)) {
+            H = hash_combine(H, hashType(GEP->getSourceElementType()), GEP->isInBounds());
+        } else if (const ExtractValueInst *EVI = dyn_cast<ExtractValueInst>(&I)) {
+            H = hash_combine(H, hash_combine_range(EVI->idx_begin(), EVI->idx_end()));
+        } else if (const InsertValueInst *IVI = dyn_cast<InsertValueInst>(&I)) {
+            H = hash_combine(H, hash_combine_range(IVI->idx_begin(), IVI->idx_end()));
+        } else if (const PHINode *PN = dyn_cast<PHINode>(&I)) {
+            for (const BasicBlock *BB : PN->blocks()) {
+                H = hash_combine(H, hashValue(BB));
+            }
+        }
+        for (const Value *Op : I.operands()) {
+            H = hash_combine(H, hashValue(Op));
+        }
+        return H;
+    }
+
+    hash_code FunctionHasher::hash(const Function &F) {
+        // Numbered up front, since phis and branches refer to later values.
+        for (const Argument &Arg : F.args()) {
+            mapLocalIdx[&Arg] = mapLocalIdx.size();
+        }
+        for (const BasicBlock &BB : F) {
+            mapLocalIdx[&BB] = mapLocalIdx.size();
+            for (const Instruction &I : BB) {
+                if (!isa<DbgInfoIntrinsic>(&I)) {
+                    mapLocalIdx[&I] = mapLocalIdx.size();
+                }
+            }
+        }
+        hash_code H = hash_combine(hashType(F.getFunctionType()), F.size());
+        for (const BasicBlock &BB : F) {
+            H = hash_combine(H, 'B');
+            for (const Instruction &I : BB) {
+                if (!isa<DbgInfoIntrinsic>(&I)) {
+                    H = hash_combine(H, hashInst(I));
+                }
+            }
+        }
+        return H;
+    }
+
+    hash_code hashFunction(const Function &F) {
+        return FunctionHasher().hash(F);
+    }
+
+    void getChangedFunctions(const Module &Old, const Module &New, StringSet<> &setChanged) {
+        for (const Function &F : New) {
+            if (F.isDeclaration()) {
+                continue;
+            }
+            const Function *OldF = Old.getFunction(F.getName());
+            if (!OldF || OldF->isDeclaration() || hashFunction(*OldF) != hashFunction(F)) {
+                setChanged.insert(F.getName());
+            }
+        }
+        for (const Function &F : Old) {
+            if (F.isDeclaration()) {
+                continue;
+            }
+            const Function *NewF = New.getFunction(F.getName());
+            if (!NewF || NewF->isDeclaration()) {
+                setChanged.insert(F.getName());
+            }
+        }
+    }
+
+    // Directories are left out, so checkouts in different places match.
+    static std::string getLocationKey(const ReportLocation &L, bool WithLine) {
+        std::string Key = L.Function;
+        Key += '\0';
+        Key += L.File;
+        if (WithLine) {
+            Key += '\0';
+            Key += std::to_string(L.Line);
+        }
+        return Key;
+    }
+
+    static std::string getFindingKey(const DoubleLockFinding &Finding, bool WithLines) {
+        std::vector<std::string> vecSecondKeys;
+        for (const ReportLocation &L : Finding.vecSecondLocks) {
+            vecSecondKeys.push_back(getLocationKey(L, WithLines));
+        }
+        std::sort(vecSecondKeys.begin(), vecSecondKeys.end());
+        std::string Key = getLocationKey(Finding.FirstLock, WithLines);
+        for (const std::string &SecondKey : vecSecondKeys) {
+            Key += '\1';
+            Key += SecondKey;
+        }
+        return Key;
+    }
+
+    void diffFindings(ArrayRef<DoubleLockFinding> Old,
+                      ArrayRef<DoubleLockFinding> New,
+                      std::vector<const DoubleLockFinding *> &Added,
+                      std::vector<const DoubleLockFinding *> &Removed) {
+        // Indices into Old and New by the key without lines.
+        std::map<std::string, std::pair<std::vector<unsigned>, std::vector<unsigned>>> mapGroups;
+        for (unsigned i = 0; i < Old.size(); ++i) {
+            mapGroups[getFindingKey(Old[i], false)].first.push_back(i);
+        }
+        for (unsigned i = 0; i < New.size(); ++i) {
+            mapGroups[getFindingKey(New[i], false)].second.push_back(i);
+        }
+
+        std::vector<bool> vecOldMatched(Old.size(), false);
+        std::vector<bool> vecNewMatched(New.size(), false);
+        for (auto &Group : mapGroups) {
+            std::vector<unsigned> &vecOld = Group.second.first;
+            std::vector<unsigned> &vecNew = Group.second.second;
+            std::multimap<std::string, unsigned> mapOldByLines;
+            for (unsigned OldIdx : vecOld) {
+                mapOldByLines.insert(std::make_pair(getFindingKey(Old[OldIdx], true), OldIdx));
+            }
+            for (unsigned NewIdx : vecNew) {
+                auto It = mapOldByLines.find(getFindingKey(New[NewIdx], true));
+                if (It != mapOldByLines.end()) {
+                    vecOldMatched[It->second] = true;
+                    vecNewMatched[NewIdx] = true;
+                    mapOldByLines.erase(It);
+                }
+            }
+            // What is left on both sides only moved, in order.
+            auto OldIt = vecOld.begin();
+            auto NewIt = vecNew.begin();
+            while (true) {
+                while (OldIt != vecOld.end() && vecOldMatched[*OldIt]) {
+                    ++OldIt;
+                }
+                while (NewIt != vecNew.end() && vecNewMatched[*NewIt]) {
+                    ++NewIt;
+                }
+                if (OldIt == vecOld.end() || NewIt == vecNew.end()) {
+                    break;
+                }
+                vecOldMatched[*OldIt] = true;
+                vecNewMatched[*NewIt] = true;
+            }
+        }
+
+        for (unsigned i = 0; i < New.size(); ++i) {
+            if (!vecNewMatched[i]) {
+                Added.push_back(&New[i]);
+            }
+        }
+        for (unsigned i = 0; i < Old.size(); ++i) {
+            if (!vecOldMatched[i]) {
+                Removed.push_back(&Old[i]);
+            }
+        }
+    }
+}
@@ -1,20 +1,43 @@
 #include "RustDoubleLockDetector/RustDoubleLockDetector.h"
 
 #include "llvm/Pass.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Analysis/AliasAnalysis.h"
-#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
-#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Operator.h"
-
-#include <set>
-#include <stack>
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 
 #include "Common/CallerFunc.h"
+#include "Common/DenseIndex.h"
+#include "Common/LockAPI.h"
+#include "Common/LockSiteAnalysis.h"
+#include "Common/TypeNames.h"
+#include "RustDoubleLockDetector/ModuleDiff.h"
 
 #define DEBUG_TYPE "RustDoubleLockDetector"
 #define STDRWLOCK 1
@@ -22,130 +45,350 @@
 #define STDMUTEX 1
 using namespace llvm;
 
-namespace detector {
-
-    char RustDoubleLockDetector::ID = 0;
-
-    RustDoubleLockDetector::RustDoubleLockDetector() : ModulePass(ID) {
-        PassRegistry &Registry = *PassRegistry::getPassRegistry();
-        initializeAAResultsWrapperPassPass(Registry);
-    }
+STATISTIC(NumLockSites, "Number of lock call sites");
+STATISTIC(NumAliasedGroups, "Number of aliased lock groups");
+STATISTIC(NumAliasQueries, "Number of alias queries");
+STATISTIC(NumDoubleLocks, "Number of double-lock findings");
 
-    void RustDoubleLockDetector::getAnalysisUsage(AnalysisUsage &AU) const {
-        AU.setPreservesAll();
-        AU.addRequired<AAResultsWrapperPass>();
-    }
-
-    static bool skipInst(Instruction *I) {
-        if (!I) {
-            return true;
-        }
-        if (isa<PHINode>(I)) {
-            return true;
-        }
-        if (isa<DbgInfoIntrinsic>(I)) {
-            return true;
-        }
-        return false;
-    }
+namespace detector {
 
-    static bool printDebugInfo(Instruction *I) {
-        const llvm::DebugLoc &lockInfo = I->getDebugLoc();
-        // errs() << I->getParent()->getName() << ":";
-        // I->print(errs());
-        // errs() << "\n";
-        auto di = lockInfo.get();
-        if (di) {
-            errs() << " " << lockInfo->getDirectory() << ' '
-                   << lockInfo->getFilename() << ' '
-                   << lockInfo.getLine() << "\n";
-            return true;
-        } else {
-            return false;
-        }
+    static cl::opt<bool> UseCalleeSummaries(
+            "detect-callee-summaries",
+            cl::desc("Prune callee traversal with per-function lock summaries"),
+            cl::init(true));
+
+    static cl::opt<unsigned> DetectThreads(
+            "detect-threads",
+            cl::desc("Worker threads for call-site collection and classification"),
+            cl::init(1));
+
+    static cl::opt<unsigned> DropTraceBudget(
+            "detect-drop-trace-budget",
+            cl::desc("Use-list entries the drop tracing of one lock site may visit (0 for no limit)"),
+            cl::init(LockSiteInfo::DefaultDropTraceBudget));
+
+    static cl::opt<unsigned> IndirectFanOut(
+            "detect-indirect-fanout",
+            cl::desc("Resolve indirect calls with at most this many candidate callees (0 to ignore indirect calls)"),
+            cl::init(0));
+
+    static cl::opt<bool> DetectLockOrder(
+            "detect-lock-order",
+            cl::desc("Also report cycles in the acquisition order of lock fields (ABBA deadlocks)"),
+            cl::init(false));
+
+    static cl::opt<std::string> StatsFile(
+            "detect-stats",
+            cl::desc("Append per-module phase times and counters as JSON lines to this file ('-' for stderr)"),
+            cl::value_desc("filename"));
+
+    static cl::opt<std::string> LockAPITable(
+            "detect-lock-api-table",
+            cl::desc("File of extra \"<kind> prefix|contains <pattern>\" lock/drop API patterns"),
+            cl::value_desc("filename"));
+
+    static cl::opt<std::string> SkipListFile(
+            "detect-skip-list",
+            cl::desc("File of \"prefix|contains <pattern>\" functions whose lock sites are not tracked"),
+            cl::value_desc("filename"));
+
+    static cl::opt<unsigned> LockVisitBudget(
+            "detect-lock-visit-budget",
+            cl::desc("Blocks and callee functions the tracking of one lock site may visit (0 for no limit)"),
+            cl::init(0));
+
+    static cl::opt<unsigned> ModuleVisitBudget(
+            "detect-module-visit-budget",
+            cl::desc("Blocks and callee functions the tracking of all lock sites of a module may visit (0 for no limit)"),
+            cl::init(0));
+
+    static cl::opt<unsigned> MaxCallDepth(
+            "detect-call-depth",
+            cl::desc("Calls the callee walk of one lock site may follow in a row (0 for no limit)"),
+            cl::init(0));
+
+    static cl::opt<unsigned> LockTimeoutMs(
+            "detect-lock-timeout-ms",
+            cl::desc("Wall time in milliseconds the tracking of one lock site may take (0 for no limit)"),
+            cl::init(0));
+
+    static cl::opt<unsigned> ModuleTimeoutMs(
+            "detect-module-timeout-ms",
+            cl::desc("Wall time in milliseconds the tracking of all lock sites of a module may take (0 for no limit)"),
+            cl::init(0));
+
+    static cl::opt<std::string> DiffBase(
+            "detect-diff-base",
+            cl::desc("Only report double locks added or fixed since this earlier build of the module"),
+            cl::value_desc("bitcode"));
+
+    static cl::opt<ReportFormat> ReportFormatOpt(
+            "detect-report-format",
+            cl::desc("Format of the double-lock reports"),
+            cl::values(
+                    clEnumValN(ReportFormat::Text, "text", "\"Double Lock Happens!\" log (default)"),
+                    clEnumValN(ReportFormat::JSONL, "jsonl", "one JSON object per finding and line"),
+                    clEnumValN(ReportFormat::SARIF, "sarif", "SARIF 2.1.0 log")),
+            cl::init(ReportFormat::Text));
+
+    // Compiled once per process and shared by all modules and threads.
+    static const LockAPIMatcher &getLockAPIMatcher() {
+        static const LockAPIMatcher Matcher = []() {
+            LockAPIMatcher M;
+            std::string ErrMsg;
+            if (!LockAPITable.empty() && !M.loadTable(LockAPITable, ErrMsg)) {
+                errs() << "Cannot load lock API table: " << ErrMsg << "\n";
+            }
+            return M;
+        }();
+        return Matcher;
     }
 
-    static bool collectGlobalCallSite(
-            Function *F,  // Input
-            std::map<Instruction *, Function *> &mapCallSite  // Output
-    ) {
-        if (!F || F->isDeclaration()) {
-            return false;
-        }
-        for (BasicBlock &B : *F) {
-            for (Instruction &II : B) {
-                Instruction *I = &II;
-                if (skipInst(I)) {
+    // Functions whose lock sites are not tracked, e.g. ones whose walks are
+    // known to blow up. One "prefix|contains <pattern>" per line; '#' starts
+    // a comment.
+    class SkipList {
+    public:
+        bool load(StringRef Path, std::string &ErrMsg) {
+            ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr = MemoryBuffer::getFile(Path);
+            if (!BufOrErr) {
+                ErrMsg = Path.str() + ": " + BufOrErr.getError().message();
+                return false;
+            }
+            SmallVector<StringRef, 16> Lines;
+            (*BufOrErr)->getBuffer().split(Lines, '\n');
+            for (std::size_t i = 0; i < Lines.size(); ++i) {
+                StringRef Line = Lines[i].split('#').first.trim();
+                if (Line.empty()) {
                     continue;
                 }
-                if (isCallOrInvokeInst(I)) {
-                    CallSite CS;
-                    if (Function *Callee = getCalledFunc(I, CS)) {
-                        mapCallSite[I] = Callee;
-                    }
+                SmallVector<StringRef, 2> Fields;
+                Line.split(Fields, ' ', -1, false);
+                if (Fields.size() != 2 || (Fields[0] != "prefix" && Fields[0] != "contains")) {
+                    ErrMsg = Path.str() + ":" + std::to_string(i + 1) + ": expected \"prefix|contains <pattern>\"";
+                    return false;
                 }
+                vecPatterns.push_back({Fields[1].str(), Fields[0] == "prefix"});
             }
+            return true;
         }
-        return true;
-    }
 
-        static bool isLockFunc(Function *F) {
-        if (!F) {
+        bool match(StringRef Name) const {
+            for (const Pattern &P : vecPatterns) {
+                if (P.Anchored ? Name.startswith(P.Text) : Name.contains(P.Text)) {
+                    return true;
+                }
+            }
             return false;
         }
-        StringRef Name = F->getName();
-        // Check Mutex
-        if (Name.find("mutex") != StringRef::npos || Name.find("Mutex") != StringRef::npos) {
-            if (Name.find("raw_mutex") != StringRef::npos|| Name.find("RawMutex") != StringRef::npos) {
-                return false;
-            } else if (Name.find("GT$4lock") != StringRef::npos) {
-                return true;
+
+        void hash(MD5 &Hash) const {
+            for (const Pattern &P : vecPatterns) {
+                Hash.update(P.Text);
+                uint8_t Anchored = P.Anchored;
+                Hash.update(makeArrayRef(Anchored));
             }
-        } else if (Name.find("rwlock") != StringRef::npos || Name.find("RwLock") != StringRef::npos) {
-            if (Name.startswith("HandyRwLock$LT$T$GT$$GT$2rl")
-                || Name.startswith("HandyRwLock$LT$T$GT$$GT$2wl")) {
-                return true;
-            } else if (Name.find("raw_rwlock") != StringRef::npos || Name.find("RawRwLock") != StringRef::npos) {
-                return false;
-            } else if (Name.find("$GT$4read") != StringRef::npos || Name.find("$GT$5write") != StringRef::npos) {
-                return true;
+        }
+
+    private:
+        struct Pattern {
+            std::string Text;
+            bool Anchored;
+        };
+
+        std::vector<Pattern> vecPatterns;
+    };
+
+    static const SkipList &getSkipList() {
+        static const SkipList List = []() {
+            SkipList L;
+            std::string ErrMsg;
+            if (!SkipListFile.empty() && !L.load(SkipListFile, ErrMsg)) {
+                errs() << "Cannot load skip list: " << ErrMsg << "\n";
             }
+            return L;
+        }();
+        return List;
+    }
+
+    char RustDoubleLockDetector::ID = 0;
+
+    const char *const RustDoubleLockDetector::Version = "rust-double-lock-detector-4";
+
+    void RustDoubleLockDetector::hashConfig(MD5 &Hash) {
+        Hash.update(Version);
+        uint8_t Format = static_cast<uint8_t>(ReportFormatOpt.getValue());
+        Hash.update(makeArrayRef(Format));
+        getLockAPIMatcher().hash(Hash);
+        uint32_t Budget = DropTraceBudget;
+        Hash.update(makeArrayRef(reinterpret_cast<const uint8_t *>(&Budget), sizeof(Budget)));
+        uint32_t FanOut = IndirectFanOut;
+        Hash.update(makeArrayRef(reinterpret_cast<const uint8_t *>(&FanOut), sizeof(FanOut)));
+        uint8_t LockOrder = DetectLockOrder;
+        Hash.update(makeArrayRef(LockOrder));
+        getSkipList().hash(Hash);
+        uint32_t Limits[] = {LockVisitBudget, ModuleVisitBudget, MaxCallDepth, LockTimeoutMs, ModuleTimeoutMs};
+        Hash.update(makeArrayRef(reinterpret_cast<const uint8_t *>(Limits), sizeof(Limits)));
+        if (!DiffBase.empty()) {
+            // By contents, as the base is usually rebuilt in place.
+            ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr = MemoryBuffer::getFile(DiffBase);
+            Hash.update(BufOrErr ? (*BufOrErr)->getBuffer() : StringRef(DiffBase));
         }
-        return false;
     }
 
-    static bool isLockAPIRwLockRead(StringRef FuncName) {
-        return FuncName.startswith("_ZN8lock_api6rwlock19RwLock$LT$R$C$T$GT$4read17h") ||
-        FuncName.startswith("_ZN8lock_api6rwlock19RwLock$LT$R$C$T$GT$5write17h") ||
-        FuncName.startswith("_ZN8lock_api5mutex18Mutex$LT$R$C$T$GT$4lock17h");
+    RustDoubleLockDetector::RustDoubleLockDetector() : ModulePass(ID), pReportOS(&errs()), SarifFragment(false), TimeLimited(false) {
+        PassRegistry &Registry = *PassRegistry::getPassRegistry();
+        initializeAAResultsWrapperPassPass(Registry);
+        initializeLockSiteAnalysisPass(Registry);
     }
 
-    static bool isStdLock(StringRef FuncName) {
-        return FuncName.startswith("_ZN3std4sync5mutex14Mutex$LT$T$GT$4lock17h");
+    void RustDoubleLockDetector::setReportStream(raw_ostream &OS, bool SarifFragment) {
+        this->pReportOS = &OS;
+        this->SarifFragment = SarifFragment;
     }
 
-    static bool isStdRead(StringRef FuncName) {
-        return FuncName.startswith("_ZN3std4sync6rwlock15RwLock$LT$T$GT$4read17h");
+    ReportFormat RustDoubleLockDetector::getReportFormat() {
+        return ReportFormatOpt;
     }
 
-    static bool isStdWrite(StringRef FuncName) {
-        return FuncName.startswith("_ZN3std4sync6rwlock15RwLock$LT$T$GT$5write17h");
+    const LockAPIMatcher &RustDoubleLockDetector::getLockAPIMatcher() {
+        return detector::getLockAPIMatcher();
     }
 
-    static bool isAutoDropAPI(StringRef FuncName) {
-        return FuncName.startswith("_ZN4core3ptr18real_drop_in_place17h");
+    void RustDoubleLockDetector::getAnalysisUsage(AnalysisUsage &AU) const {
+        AU.setPreservesAll();
+        AU.addRequired<AAResultsWrapperPass>();
+        AU.addRequired<LockSiteAnalysis>();
     }
 
-    static bool isManualDropAPI(StringRef FuncName) {
-        return FuncName.startswith("_ZN4core3mem4drop17h");
+    // Per-module wall times (in seconds) and counters, for -detect-stats.
+    struct DetectStats {
+        double TimeCollect = 0;
+        double TimeMutexSource = 0;
+        double TimeDropTrace = 0;
+        double TimeAlias = 0;
+        double TimeSummaries = 0;
+        double TimeTrack = 0;
+        double TimeLockOrder = 0;
+
+        int64_t NumFuncs = 0;
+        int64_t NumCallSites = 0;
+        int64_t NumIndirectResolved = 0;
+        int64_t NumIndirectEdges = 0;
+        int64_t NumIndirectCapped = 0;
+        int64_t NumLockAPI = 0;
+        int64_t NumStdMutex = 0;
+        int64_t NumStdRead = 0;
+        int64_t NumStdWrite = 0;
+        int64_t NumInterGroups = 0;
+        int64_t NumIntraGroups = 0;
+        // Aliased group sizes, bucketed by the next power of two.
+        std::map<unsigned, int64_t> mapGroupSizeHist;
+        int64_t NumBlocksVisited = 0;
+        int64_t NumFuncsVisited = 0;
+        int64_t NumAliasQueries = 0;
+        int64_t NumTruncatedTraces = 0;
+        int64_t NumLockOrderEdges = 0;
+        int64_t NumTruncatedLocks = 0;
+        int64_t NumSkippedLocks = 0;
+        int64_t NumSkipListedLocks = 0;
+        int64_t NumFindings = 0;
+
+        void addGroup(std::size_t Size) {
+            unsigned Bucket = 1;
+            while (Bucket < Size) {
+                Bucket <<= 1;
+            }
+            ++mapGroupSizeHist[Bucket];
+        }
+    };
+
+    // Adds the wall time of its scope to Total.
+    class PhaseTimer {
+    public:
+        explicit PhaseTimer(double &Total) : Total(Total), Start(std::chrono::steady_clock::now()) {}
+
+        ~PhaseTimer() {
+            Total += std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        }
+
+    private:
+        double &Total;
+        std::chrono::steady_clock::time_point Start;
+    };
+
+    template <typename Fn>
+    static auto timePhase(double &Total, Fn F) -> decltype(F()) {
+        PhaseTimer T(Total);
+        return F();
     }
 
-    static bool isResultToInnerAPI(StringRef FuncName) {
-        return FuncName.startswith("_ZN4core6result19Result$LT$T$C$E$GT$6unwrap17h")
-               || FuncName.startswith("_ZN4core6result19Result$LT$T$C$E$GT$9unwrap_or17h")
-               || FuncName.startswith("_ZN4core6result19Result$LT$T$C$E$GT$14unwrap_or_else17h")
-               || FuncName.startswith("_ZN4core6result19Result$LT$T$C$E$GT$17unwrap_or_default17h")
-               || FuncName.startswith("_ZN4core6result19Result$LT$T$C$E$GT$6expect17h");
+    static void writeStats(const Module &M, const DetectStats &S) {
+        json::Object Hist;
+        for (auto &Bucket : S.mapGroupSizeHist) {
+            unsigned Lo = Bucket.first / 2 + 1;
+            std::string Label = Lo == Bucket.first ? std::to_string(Lo)
+                                                   : std::to_string(Lo) + "-" + std::to_string(Bucket.first);
+            Hist[Label] = Bucket.second;
+        }
+        json::Value V = json::Object{
+            {"module", M.getModuleIdentifier()},
+            {"time", json::Object{
+                {"collect", S.TimeCollect},
+                {"mutex_source", S.TimeMutexSource},
+                {"drop_trace", S.TimeDropTrace},
+                {"alias", S.TimeAlias},
+                {"summaries", S.TimeSummaries},
+                {"track", S.TimeTrack},
+                {"lock_order", S.TimeLockOrder},
+            }},
+            {"functions", S.NumFuncs},
+            {"call_sites", S.NumCallSites},
+            {"indirect_calls", json::Object{
+                {"resolved", S.NumIndirectResolved},
+                {"edges", S.NumIndirectEdges},
+                {"capped", S.NumIndirectCapped},
+            }},
+            {"lock_sites", json::Object{
+                {"lock_api", S.NumLockAPI},
+                {"std_mutex", S.NumStdMutex},
+                {"std_rwlock_read", S.NumStdRead},
+                {"std_rwlock_write", S.NumStdWrite},
+            }},
+            {"aliased_groups", json::Object{
+                {"inter", S.NumInterGroups},
+                {"intra", S.NumIntraGroups},
+                {"size_histogram", std::move(Hist)},
+            }},
+            {"visited", json::Object{
+                {"blocks", S.NumBlocksVisited},
+                {"functions", S.NumFuncsVisited},
+            }},
+            {"alias_queries", S.NumAliasQueries},
+            {"truncated_drop_traces", S.NumTruncatedTraces},
+            {"lock_order_edges", S.NumLockOrderEdges},
+            {"walk_limits", json::Object{
+                {"truncated", S.NumTruncatedLocks},
+                {"skipped", S.NumSkippedLocks},
+                {"skip_listed", S.NumSkipListedLocks},
+            }},
+            {"findings", S.NumFindings},
+        };
+
+        // Driver workers share the file.
+        static std::mutex StatsMutex;
+        std::lock_guard<std::mutex> Guard(StatsMutex);
+        if (StatsFile == "-") {
+            errs() << V << '\n';
+            return;
+        }
+        std::error_code EC;
+        raw_fd_ostream OS(StatsFile, EC, sys::fs::OF_Append | sys::fs::OF_Text);
+        if (EC) {
+            errs() << "Cannot open " << StatsFile << ": " << EC.message() << "\n";
+            return;
+        }
+        OS << V << '\n';
     }
 
     struct LockInfo {
@@ -158,48 +401,185 @@ namespace detector {
             LockValue(nullptr),
             ResultValue(nullptr) {
         }
+
+        explicit LockInfo(const LockSite &Site) :
+            LockInst(Site.LockInst),
+            LockValue(Site.LockValue),
+            ResultValue(Site.ResultValue) {
+        }
     };
 
+    // A lock field: the struct type of the self pointer and the GEP index
+    // path into it. Field paths are short, so the path is kept inline.
     struct MutexSource {
         Value *direct;
         Type *structTy;
-        std::vector<APInt> index;
+        SmallVector<int64_t, 4> index;
 
         bool operator==(const MutexSource& rhs) const {
-            if (this->structTy != rhs.structTy) {
-                return false;
-            }
-            if (this->index.size() != rhs.index.size()) {
-                return false;
-            }
-            for (std::size_t i = 0; i < this->index.size(); ++i) {
-                if (this->index[i] != rhs.index[i]) {
-                    return false;
-                }
-            }
-            return true;
+            return this->structTy == rhs.structTy && this->index == rhs.index;
         }
 
         void print(llvm::raw_ostream &os) const {
             this->structTy->print(os);
             os << "\n";
             for (std::size_t i = 0; i < this->index.size(); ++i) {
-                os << i << ","; 
+                os << this->index[i] << ",";
             }
             os << "\n";
         }
     };
 
+    // Order-sensitive, so that the paths {0, 1} and {1, 0} of a struct do
+    // not collide.
     struct MutexSourceHasher {
         std::size_t operator()(const MutexSource& k) const {
-            std::size_t hash = llvm::hash_value(k.structTy);
-            for (APInt i : k.index) {
-                hash ^= llvm::hash_value(i);
+            return llvm::hash_combine(k.structTy, llvm::hash_combine_range(k.index.begin(), k.index.end()));
+        }
+    };
+
+    // The lock sites of one group, in module order (that of the lock sites
+    // of LockSiteInfo), so that findings do not depend on heap addresses.
+    typedef MapVector<Instruction *, LockInfo> LockInfoMap;
+
+    // Lock sites by MutexSource ID (see MutexSourceTable), in the order in
+    // which the lock fields are first seen.
+    typedef std::map<unsigned, LockInfoMap> MutexSourceLockMap;
+
+    // For every function, the set of aliased lock groups (MutexSources with
+    // more than one lock site) it may acquire, directly or through callees.
+    struct LockSummaries {
+        std::map<unsigned, unsigned> mapGroupIdx;   // by MutexSource ID
+        std::vector<BitVector> vecFuncAcquired;  // by function index, empty if none
+
+        bool mayAcquire(unsigned F, unsigned Group) const {
+            if (F >= vecFuncAcquired.size()) {
+                return false;
             }
-            return hash;
+            const BitVector &Acquired = vecFuncAcquired[F];
+            return !Acquired.empty() && Acquired.test(Group);
         }
     };
 
+    // Closes vecFuncLocal (by function index, bits in [0, NumBits), empty if
+    // none) over the callees of each function. Iterative Tarjan over the
+    // direct call graph: SCCs are finished callees first, so each summary
+    // only depends on already computed ones.
+    static void propagateAcquired(const DenseCallGraph &CG,
+                                  unsigned NumBits,
+                                  const std::vector<BitVector> &vecFuncLocal,
+                                  std::vector<BitVector> &vecFuncAcquired) {
+        unsigned NumFuncs = CG.getNumCallers();
+
+        struct Frame {
+            unsigned F;
+            const CallEdge *Next;
+            const CallEdge *End;
+        };
+
+        const unsigned Unvisited = ~0u;
+        std::vector<unsigned> vecIndex(NumFuncs, Unvisited);
+        std::vector<unsigned> vecLowLink(NumFuncs, 0);
+        BitVector OnStack(NumFuncs);
+        std::vector<unsigned> SCCStack;
+        std::vector<Frame> CallStack;
+        unsigned NextIndex = 0;
+
+        vecFuncAcquired.assign(NumFuncs, BitVector());
+        auto pushFrame = [&](unsigned F) {
+            vecIndex[F] = vecLowLink[F] = NextIndex++;
+            SCCStack.push_back(F);
+            OnStack.set(F);
+            CallStack.push_back({F, CG.begin(F), CG.end(F)});
+        };
+
+        for (unsigned Root = 0; Root < NumFuncs; ++Root) {
+            if (vecIndex[Root] != Unvisited) {
+                continue;
+            }
+            pushFrame(Root);
+            while (!CallStack.empty()) {
+                Frame &Top = CallStack.back();
+                if (Top.Next != Top.End) {
+                    unsigned Callee = (Top.Next++)->Callee;
+                    if (vecIndex[Callee] == Unvisited) {
+                        pushFrame(Callee);
+                    } else if (OnStack.test(Callee)) {
+                        vecLowLink[Top.F] = std::min(vecLowLink[Top.F], vecIndex[Callee]);
+                    }
+                    continue;
+                }
+                unsigned F = Top.F;
+                CallStack.pop_back();
+                if (!CallStack.empty()) {
+                    unsigned Parent = CallStack.back().F;
+                    vecLowLink[Parent] = std::min(vecLowLink[Parent], vecLowLink[F]);
+                }
+                if (vecLowLink[F] != vecIndex[F]) {
+                    continue;
+                }
+                // F is the root of an SCC: pop it and merge its summary.
+                std::vector<unsigned> SCC;
+                unsigned Member = 0;
+                do {
+                    Member = SCCStack.back();
+                    SCCStack.pop_back();
+                    OnStack.reset(Member);
+                    SCC.push_back(Member);
+                } while (Member != F);
+
+                BitVector Acquired(NumBits);
+                for (unsigned SCCFunc : SCC) {
+                    if (!vecFuncLocal[SCCFunc].empty()) {
+                        Acquired |= vecFuncLocal[SCCFunc];
+                    }
+                    for (const CallEdge *E = CG.begin(SCCFunc); E != CG.end(SCCFunc); ++E) {
+                        if (!vecFuncAcquired[E->Callee].empty()) {
+                            Acquired |= vecFuncAcquired[E->Callee];
+                        }
+                    }
+                }
+                if (Acquired.none()) {
+                    continue;
+                }
+                for (unsigned SCCFunc : SCC) {
+                    vecFuncAcquired[SCCFunc] = Acquired;
+                }
+            }
+        }
+    }
+
+    static void computeLockSummaries(
+            MutexSourceLockMap &mapInterProcLockInfo,
+            const ModuleIndex &MI,
+            const DenseCallGraph &CG,
+            LockSummaries &LS) {
+
+        unsigned NumGroups = 0;
+        for (auto &MSLIS : mapInterProcLockInfo) {
+            if (MSLIS.second.size() > 1) {
+                LS.mapGroupIdx[MSLIS.first] = NumGroups++;
+            }
+        }
+        if (NumGroups == 0) {
+            return;
+        }
+
+        unsigned NumFuncs = CG.getNumCallers();
+        std::vector<BitVector> vecFuncLocal(NumFuncs);
+        for (auto &Group : LS.mapGroupIdx) {
+            for (auto &LI : mapInterProcLockInfo[Group.first]) {
+                BitVector &Local = vecFuncLocal[MI.getFuncIdx(LI.first->getFunction())];
+                if (Local.empty()) {
+                    Local.resize(NumGroups);
+                }
+                Local.set(Group.second);
+            }
+        }
+
+        propagateAcquired(CG, NumGroups, vecFuncLocal, LS.vecFuncAcquired);
+    }
+
     static bool traceMutexSource(Value *mutex, MutexSource &MS) {
         assert(mutex);
 
@@ -217,7 +597,7 @@ namespace detector {
                 MS.structTy = structTy;
                 for (unsigned i = 1; i < GEP->getNumOperands(); ++i) {
                     // errs() << "index: ";
-                    APInt idx = dyn_cast<ConstantInt>(GEP->getOperand(i))->getValue();
+                    int64_t idx = dyn_cast<ConstantInt>(GEP->getOperand(i))->getSExtValue();
                     MS.index.push_back(idx);
                     // GEP->getOperand(i)->getType()->print(errs());
                     // errs() << "\n";
@@ -242,461 +622,538 @@ namespace detector {
         return false;
     }
 
-    static void traceDropInstForInstruction(Instruction *Inst, std::set<Instruction *> &setDropInst) {
-        for (User *UL : Inst->users()) {
-            Instruction *I = dyn_cast<Instruction>(UL);
-            if (!I) {
-                continue;
+    // The MutexSources of a module, interned into dense IDs in the order in
+    // which they are first seen. Lock groups, callee summaries and lock
+    // order nodes are keyed by the ID, and each lock value is traced once.
+    class MutexSourceTable {
+    public:
+        // Whether Mutex is a lock field; if so, ID is its MutexSource.
+        bool getSource(Value *Mutex, unsigned &ID) {
+            auto It = mapValueIDs.find(Mutex);
+            if (It == mapValueIDs.end()) {
+                unsigned NewID = NotField;
+                MutexSource MS;
+                if (traceMutexSource(Mutex, MS)) {
+                    auto Interned = mapIDs.insert(std::make_pair(MS, (unsigned)vecSources.size()));
+                    if (Interned.second) {
+                        vecSources.push_back(MS);
+                    }
+                    NewID = Interned.first->second;
+                }
+                It = mapValueIDs.insert(std::make_pair(Mutex, NewID)).first;
             }
-            if (skipInst(I)) {
-                continue;
+            ID = It->second;
+            return ID != NotField;
+        }
+
+        const MutexSource &get(unsigned ID) const {
+            return vecSources[ID];
+        }
+
+        unsigned size() const {
+            return vecSources.size();
+        }
+
+    private:
+        static const unsigned NotField = ~0u;
+
+        DenseMap<Value *, unsigned> mapValueIDs;
+        std::unordered_map<MutexSource, unsigned, MutexSourceHasher> mapIDs;
+        std::vector<MutexSource> vecSources;
+    };
+
+    typedef SmallPtrSet<Instruction *, 8> LockSiteSet;
+
+    // Lock sites grouped by function index, in lock order.
+    typedef DenseMap<unsigned, std::vector<Instruction *>> FuncLockMap;
+
+    // The lock sites of one MutexSource (or of one lock type in a function)
+    // that may alias each other. Each group is built once and shared,
+    // read-only, by all of its locks.
+    struct LockGroup {
+        LockSiteSet setLocks;
+        FuncLockMap mapFuncLocks;
+        // By function with a lock of the group: the blocks that hold one of
+        // its locks or a call that may acquire one. A block outside of it
+        // can only stop a walk at a drop.
+        DenseMap<unsigned, BitVector> mapFuncInterest;
+    };
+
+    static void buildLockGroup(const LockInfoMap &mapLocks,
+                               const ModuleIndex &MI,
+                               const DenseCallGraph &CG,
+                               const LockSummaries &LS,
+                               unsigned Group,
+                               LockGroup &LG) {
+        for (auto &LI : mapLocks) {
+            LG.setLocks.insert(LI.first);
+            LG.mapFuncLocks[MI.getFuncIdx(LI.first->getFunction())].push_back(LI.first);
+        }
+        for (auto &FL : LG.mapFuncLocks) {
+            Function *F = MI.getFunc(FL.first);
+            BitVector &Interest = LG.mapFuncInterest[FL.first];
+            Interest.resize(MI.getNumBlocks(F));
+            for (Instruction *Lock : FL.second) {
+                Interest.set(MI.getBlockIdx(Lock->getParent()));
             }
-            if (isCallOrInvokeInst(I)) {
-                CallSite CS(I);
-                Function *F = CS.getCalledFunction();
-                if (!F) {
-                    continue;
-                }
-                if (isAutoDropAPI(F->getName())
-                    || isManualDropAPI(F->getName())) {
-                    setDropInst.insert(I);
+            for (const CallEdge *E = CG.begin(FL.first); E != CG.end(FL.first); ++E) {
+                if (!UseCalleeSummaries || LS.mayAcquire(E->Callee, Group)) {
+                    Interest.set(MI.getBlockIdx(E->CallInst->getParent()));
                 }
             }
         }
     }
 
-    static void traceDropInst(LockInfo &MLI, std::set<Instruction *> &setDropInst) {
-        Value *LockGuardValue = MLI.ResultValue;
-        for (User *U : LockGuardValue->users()) {
-            Instruction *I = dyn_cast<Instruction>(U);
-            if (I == MLI.LockInst) {
-                continue;
+    // The CFG of one function without edges into landing pads, and for
+    // functions of at most MaxClosureBlocks blocks the blocks reachable from
+    // each block. Built on first use and shared by all lock sites of the
+    // function.
+    struct FuncCFG {
+        static const unsigned MaxClosureBlocks = 4096;
+
+        std::vector<BasicBlock *> vecBlocks;    // by block index
+        std::vector<unsigned> vecSuccOffsets;
+        std::vector<unsigned> vecSuccs;
+        std::vector<BitVector> vecReach;        // empty if too large
+
+        const unsigned *succ_begin(unsigned BB) const {
+            return vecSuccs.data() + vecSuccOffsets[BB];
+        }
+
+        const unsigned *succ_end(unsigned BB) const {
+            return vecSuccs.data() + vecSuccOffsets[BB + 1];
+        }
+
+        // Whether a walk from Start, which never enters LockBB unless it is
+        // Start, may scan a block of Interest. Scratch keeps its storage
+        // across calls.
+        bool mayReach(unsigned Start, unsigned LockBB, const BitVector &Interest, BitVector &Scratch) const {
+            if (vecReach.empty()) {
+                return true;
             }
-            if (!I) {
-                continue;
+            BitVector &Reach = Scratch;
+            Reach = vecReach[Start];
+            if (Start != LockBB) {
+                Reach.reset(LockBB);
             }
-            if (skipInst(I)) {
+            return Reach.anyCommon(Interest);
+        }
+    };
+
+    const unsigned FuncCFG::MaxClosureBlocks;
+
+    static void buildFuncCFG(Function *F, const ModuleIndex &MI, FuncCFG &CFG) {
+        for (BasicBlock &BB : *F) {
+            CFG.vecBlocks.push_back(&BB);
+        }
+        unsigned NumBlocks = CFG.vecBlocks.size();
+        BitVector IsLandingPad(NumBlocks);
+        for (unsigned i = 0; i < NumBlocks; ++i) {
+            if (isa<LandingPadInst>(CFG.vecBlocks[i]->getFirstNonPHIOrDbgOrLifetime())) {
+                IsLandingPad.set(i);
+            }
+        }
+        CFG.vecSuccOffsets.push_back(0);
+        for (unsigned i = 0; i < NumBlocks; ++i) {
+            Instruction *pTerm = CFG.vecBlocks[i]->getTerminator();
+            for (unsigned j = 0; j < pTerm->getNumSuccessors(); ++j) {
+                unsigned SuccIdx = MI.getBlockIdx(pTerm->getSuccessor(j));
+                if (!IsLandingPad.test(SuccIdx)) {
+                    CFG.vecSuccs.push_back(SuccIdx);
+                }
+            }
+            CFG.vecSuccOffsets.push_back(CFG.vecSuccs.size());
+        }
+        if (NumBlocks > FuncCFG::MaxClosureBlocks) {
+            return;
+        }
+
+        // Post order of a DFS from every block, so that the fixpoint below
+        // takes one round per loop nesting level.
+        std::vector<unsigned> vecPostOrder;
+        BitVector Seen(NumBlocks);
+        std::vector<std::pair<unsigned, const unsigned *>> Stack;
+        for (unsigned Root = 0; Root < NumBlocks; ++Root) {
+            if (Seen.test(Root)) {
                 continue;
             }
-            
-            if (isCallOrInvokeInst(I)) {
-                CallSite CS(I);
-                Function *F = CS.getCalledFunction();
-                if (!F) {
+            Seen.set(Root);
+            Stack.push_back(std::make_pair(Root, CFG.succ_begin(Root)));
+            while (!Stack.empty()) {
+                unsigned BB = Stack.back().first;
+                const unsigned *&Next = Stack.back().second;
+                if (Next == CFG.succ_end(BB)) {
+                    vecPostOrder.push_back(BB);
+                    Stack.pop_back();
                     continue;
                 }
-                if (isAutoDropAPI(F->getName())
-                    || isManualDropAPI(F->getName())) {
-                    setDropInst.insert(I);
+                unsigned Succ = *Next++;
+                if (!Seen.test(Succ)) {
+                    Seen.set(Succ);
+                    Stack.push_back(std::make_pair(Succ, CFG.succ_begin(Succ)));
                 }
-            } else if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
-                for (User *UL : LI->users()) {
-                    Instruction *I = dyn_cast<Instruction>(UL);
-                    if (!I) {
-                        continue;
-                    }
-                    if (skipInst(I)) {
-                        continue;
-                    }
-                    if (isCallOrInvokeInst(I)) {
-                        CallSite CS(I);
-                        Function *F = CS.getCalledFunction();
-                        if (!F) {
-                            continue;
-                        }
-                        if (isAutoDropAPI(F->getName())
-                        || isManualDropAPI(F->getName())) {
-                            setDropInst.insert(I);
-                        }
-                    }
+            }
+        }
+
+        CFG.vecReach.assign(NumBlocks, BitVector(NumBlocks));
+        for (unsigned i = 0; i < NumBlocks; ++i) {
+            CFG.vecReach[i].set(i);
+        }
+        bool Changed = true;
+        while (Changed) {
+            Changed = false;
+            for (unsigned BB : vecPostOrder) {
+                BitVector &Reach = CFG.vecReach[BB];
+                unsigned Count = Reach.count();
+                for (const unsigned *S = CFG.succ_begin(BB); S != CFG.succ_end(BB); ++S) {
+                    Reach |= CFG.vecReach[*S];
                 }
-            } else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
-                Value *Target = SI->getPointerOperand();
-                for (User *UL : Target->users()) {
-                    Instruction *I = dyn_cast<Instruction>(UL);
-                    if (!I) {
-                        continue;
-                    }
-                    if (skipInst(I)) {
-                        continue;
-                    }
-                    if (isCallOrInvokeInst(I)) {
-                        CallSite CS(I);
-                        Function *F = CS.getCalledFunction();
-                        if (!F) {
-                            continue;
-                        }
-                        if (isAutoDropAPI(F->getName())
-                        || isManualDropAPI(F->getName())) {
-                            setDropInst.insert(I);
-                        }
-                    } else if (LoadInst *LI = dyn_cast<LoadInst>(UL)) {
-                        traceDropInstForInstruction(LI, setDropInst);
-                    }
+                if (Reach.count() != Count) {
+                    Changed = true;
                 }
             }
         }
     }
 
-    static bool isGEP01(Instruction *I) {
-        GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I);
-        if (!GEP) {
-            return false;
+    class CFGIndex {
+    public:
+        explicit CFGIndex(const ModuleIndex &MI) : MI(MI), vecFuncs(MI.getNumFuncs()) {}
+
+        const FuncCFG &get(unsigned FuncIdx) {
+            std::unique_ptr<FuncCFG> &CFG = vecFuncs[FuncIdx];
+            if (!CFG) {
+                CFG.reset(new FuncCFG());
+                buildFuncCFG(MI.getFunc(FuncIdx), MI, *CFG);
+            }
+            return *CFG;
         }
-        if (GEP->getNumOperands() < 3) {
-            return false;
+
+    private:
+        const ModuleIndex &MI;
+        std::vector<std::unique_ptr<FuncCFG>> vecFuncs;
+    };
+
+    // Scratch state of the CFG walks from a lock site (trackLockInst,
+    // trackLockInstLocal and the lock order walk). Like CalleeWalk, it is
+    // sized once for the largest function of the module and reset in bulk
+    // per lock site, so the walks do not allocate.
+    struct BlockWalk {
+        StampSet Visited;
+        StampSet DropBlocks;
+        BitVector Interest;     // of trackLockInstLocal
+        BitVector Reach;        // of FuncCFG::mayReach
+        std::vector<unsigned> WorkList;
+
+        explicit BlockWalk(const ModuleIndex &MI) {
+            unsigned MaxBlocks = 0;
+            for (unsigned i = 0; i < MI.getNumFuncs(); ++i) {
+                MaxBlocks = std::max(MaxBlocks, MI.getNumBlocks(MI.getFunc(i)));
+            }
+            Visited.resize(MaxBlocks);
+            DropBlocks.resize(MaxBlocks);
+            Interest.reserve(MaxBlocks);
+            Reach.reserve(MaxBlocks);
         }
-        APInt idx0 = dyn_cast<ConstantInt>(GEP->getOperand(1))->getValue();
-        if (idx0 != 0) {
-            return false;
+
+        // Starts a walk from NextIdx that never enters LockBBIdx.
+        void start(unsigned LockBBIdx, unsigned NextIdx) {
+            WorkList.clear();
+            Visited.clear();
+            Visited.insert(LockBBIdx);
+            WorkList.push_back(NextIdx);
+            Visited.insert(NextIdx);
         }
-        APInt idx1 = dyn_cast<ConstantInt>(GEP->getOperand(2))->getValue();
-        if (idx1 != 1) {
-            return false; 
+    };
+
+    // Marks the blocks of F that hold one of setDrop.
+    static void markDropBlocks(const DropSet &setDrop, Function *F, const ModuleIndex &MI, StampSet &DropBlocks) {
+        DropBlocks.clear();
+        for (Instruction *Drop : setDrop) {
+            if (Drop->getFunction() == F) {
+                DropBlocks.insert(MI.getBlockIdx(Drop->getParent()));
+            }
         }
-        return true; 
     }
 
-    static bool isGEP00(Instruction *I) {
-        GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I);
-        if (!GEP) {
-            return false;
-        }
-        if (GEP->getNumOperands() < 3) {
-            return false;
+    // The group's sites in a function, unless LockInst is the only one.
+    static const std::vector<Instruction *> *getOtherLocks(const LockGroup &LG, unsigned F, Instruction *LockInst) {
+        auto it = LG.mapFuncLocks.find(F);
+        if (it == LG.mapFuncLocks.end()) {
+            return nullptr;
         }
-        APInt idx0 = dyn_cast<ConstantInt>(GEP->getOperand(1))->getValue();
-        if (idx0 != 0) {
-            return false;
-        }
-        APInt idx1 = dyn_cast<ConstantInt>(GEP->getOperand(2))->getValue();
-        if (idx1 != 0) {
-            return false; 
+        if (it->second.size() == 1 && it->second[0] == LockInst) {
+            return nullptr;
         }
-        return true; 
+        return &it->second;
     }
 
-    static bool isDropInst(Instruction *I) {
-        if (!isCallOrInvokeInst(I)) {
-            return false;
-        }
-        CallSite CS(I);
-        Function *F = CS.getCalledFunction();
-        if (!F) {
-            return false; 
-        }
-        if (isAutoDropAPI(F->getName())
-            || isManualDropAPI(F->getName())) {
-            return true; 
+    static void addOtherLocks(const std::vector<Instruction *> &vecLocks, Instruction *LockInst,
+                              DoubleLockFinding &Finding) {
+        for (Instruction *AliasLock : vecLocks) {
+            if (AliasLock != LockInst) {
+                Finding.vecSecondLocks.push_back(ReportLocation::get(AliasLock));
+            }
         }
-        return false; 
     }
 
-    static bool isICmpInst0(Instruction *I) {
-        ICmpInst *ICmp = dyn_cast<ICmpInst>(I);
-        if (!ICmp) {
-            return false;
-        }
-        ConstantInt *CI = dyn_cast<ConstantInt>(ICmp->getOperand(1));
-        if (!CI) {
-            return false;
-        }
-        APInt num = CI->getValue();
-        if (num == 0) {
-            return true;
-        }
-        return false; 
+    static void reportLocalDoubleLock(Instruction *LockInst, Instruction *SecondLock, ReportSink &Sink) {
+        DoubleLockFinding Finding;
+        Finding.FirstLock = ReportLocation::get(LockInst);
+        Finding.vecSecondLocks.push_back(ReportLocation::get(SecondLock));
+        Sink.add(Finding);
     }
 
-    static bool getICmp0Br0First(Instruction *ICmp, std::set<Instruction *> &setFirst) {
-        for (User *U : ICmp->users()) {
-            if (BranchInst *BI = dyn_cast<BranchInst>(U)) {
-                Value *V = BI->getOperand(1);
-                if (BasicBlock *B = dyn_cast<BasicBlock>(V)) {
-                    setFirst.insert(B->getFirstNonPHIOrDbgOrLifetime());
+    // Scratch state of trackCallee. It is reused by every call in a module,
+    // so the visited sets and the parent table are allocated only once.
+    struct CalleeWalk {
+        StampSet Visited;
+        StampSet TraceVisited;
+        std::vector<Instruction *> vecParentInst;  // by function index, valid if Visited
+        std::vector<unsigned> vecDepth;            // by function index, valid if Visited
+        std::vector<unsigned> WorkList;
+
+        explicit CalleeWalk(unsigned NumFuncs) :
+            Visited(NumFuncs),
+            TraceVisited(NumFuncs),
+            vecParentInst(NumFuncs, nullptr),
+            vecDepth(NumFuncs, 0) {
+        }
+    };
+
+    // Resource limits of the tracking walks of one module. Each block a walk
+    // visits in the function of the lock and each callee it visits is one
+    // step. The walk of a lock site may take -detect-lock-visit-budget steps,
+    // follow -detect-call-depth calls in a row and run for
+    // -detect-lock-timeout-ms; the walks of all lock sites of the module share
+    // -detect-module-visit-budget and -detect-module-timeout-ms, after which
+    // the remaining lock sites are skipped. Lock sites in functions on the
+    // skip list are never tracked. Every cut is reported as a TruncationNote.
+    class WalkLimits {
+    public:
+        explicit WalkLimits(const ModuleIndex &MI) :
+            MI(MI),
+            SkipFuncs(MI.getNumFuncs()),
+            ModuleStart(Clock::now()) {
+            const SkipList &List = getSkipList();
+            for (unsigned i = 0; i < MI.getNumFuncs(); ++i) {
+                if (List.match(MI.getFunc(i)->getName())) {
+                    SkipFuncs.set(i);
                 }
-            }    
+            }
         }
-        return !setFirst.empty(); 
-    }
 
-    static void visitUsersOfValue(Value *V, bool (*F)(Instruction *), std::set<Instruction *>& setOut) {
-        for (User *U : V->users()) {
-            if (Instruction *I = dyn_cast<Instruction>(U)) {
-                if (F(I)) {
-                    setOut.insert(I);
-                    //if (F == &isDropInst) {
-                    //    errs() << "DropInst:\n"; I->print(errs()); errs() << "\n"; 
-                    //}
+        // Starts the walk of LockInst. Returns false if it is not to be
+        // tracked, for the skip list or a module limit.
+        bool startLock(Instruction *LockInst) {
+            if (SkipFuncs.test(MI.getFuncIdx(LockInst->getFunction()))) {
+                ++NumSkipListed;
+                return false;
+            }
+            if (!ModuleDone && ModuleTimeoutMs && Clock::now() - ModuleStart >= getLimit(ModuleTimeoutMs)) {
+                stopModule(TruncationReason::ModuleTime);
+            }
+            if (ModuleDone) {
+                if (!FirstSkipped) {
+                    FirstSkipped = LockInst;
                 }
+                ++NumSkipped;
+                return false;
             }
+            CurrLock = LockInst;
+            LockSteps = 0;
+            Exhausted = false;
+            Truncated = false;
+            if (LockTimeoutMs) {
+                LockStart = Clock::now();
+            }
+            return true;
         }
-   }
 
-    static void traceResult(LockInfo &MLI, std::set<Instruction *> &setDropInst, const DataLayout &DL) {
-        Value *ResultValue = MLI.ResultValue;
-        for (User *U : ResultValue->users()) {
-            Instruction *I = dyn_cast<Instruction>(U);
-            if (I == MLI.LockInst) {
-                continue;
+        // Charges one step to the current walk. Returns false once the walk
+        // has to stop.
+        bool step() {
+            if (Exhausted) {
+                return false;
             }
-            if (!I) {
-                continue;
+            ++LockSteps;
+            ++ModuleSteps;
+            if (LockVisitBudget && LockSteps > LockVisitBudget) {
+                return exhaust(TruncationReason::LockVisits);
             }
-            if (skipInst(I)) {
-                continue;
+            if (ModuleVisitBudget && ModuleSteps > ModuleVisitBudget) {
+                stopModule(TruncationReason::ModuleVisits);
+                return exhaust(TruncationReason::ModuleVisits);
             }
-            
-            if (isCallOrInvokeInst(I)) {
-                CallSite CS(I);
-                Function *F = CS.getCalledFunction();
-                if (!F) {
-                    continue;
+            // Reading the clock costs more than a step.
+            if ((LockTimeoutMs || ModuleTimeoutMs) && (LockSteps & 63) == 0) {
+                Clock::time_point Now = Clock::now();
+                if (LockTimeoutMs && Now - LockStart >= getLimit(LockTimeoutMs)) {
+                    TimeLimited = true;
+                    return exhaust(TruncationReason::LockTime);
                 }
-                if (isAutoDropAPI(F->getName())
-                    || isManualDropAPI(F->getName())) {
-                    setDropInst.insert(I);
-                } else if (isResultToInnerAPI(F->getName())) {
-                    Value *LockGuardValue;
-                    if (F->getReturnType()->isVoidTy()) {
-                        LockGuardValue = GetUnderlyingObject(I->getOperand(0), DL);
-                    } else {
-                        LockGuardValue = I;
-                    }
-                    MLI.ResultValue = LockGuardValue;
-                    traceDropInst(MLI, setDropInst);
-                }
-            } else if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
-                for (User *UL : LI->users()) {
-                    Instruction *I = dyn_cast<Instruction>(UL);
-                    if (!I) {
-                        continue;
-                    }
-                    if (skipInst(I)) {
-                        continue;
-                    }
-                    if (isCallOrInvokeInst(I)) {
-                        CallSite CS(I);
-                        Function *F = CS.getCalledFunction();
-                        if (!F) {
-                            continue;
-                        }
-                        if (isAutoDropAPI(F->getName())
-                        || isManualDropAPI(F->getName())) {
-                            setDropInst.insert(I);
-                        }
-                    }
-                }
-            } else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
-                Value *Target = SI->getPointerOperand();
-                for (User *UL : Target->users()) {
-                    Instruction *I = dyn_cast<Instruction>(UL);
-                    if (!I) {
-                        continue;
-                    }
-                    if (skipInst(I)) {
-                        continue;
-                    }
-                    if (isCallOrInvokeInst(I)) {
-                        CallSite CS(I);
-                        Function *F = CS.getCalledFunction();
-                        if (!F) {
-                            continue;
-                        }
-                        if (isAutoDropAPI(F->getName())
-                        || isManualDropAPI(F->getName())) {
-                            setDropInst.insert(I);
-                        }
-                    } else if (LoadInst *LI = dyn_cast<LoadInst>(UL)) {
-                        traceDropInstForInstruction(LI, setDropInst);
-                    }
+                if (ModuleTimeoutMs && Now - ModuleStart >= getLimit(ModuleTimeoutMs)) {
+                    stopModule(TruncationReason::ModuleTime);
+                    return exhaust(TruncationReason::ModuleTime);
                 }
-            } else if (BitCastInst *BCI = dyn_cast<BitCastInst>(I)) {
-                //errs() << "BitCastInst" << "\n";
-                //BCI->print(errs());
-                //errs() << "\n";
-                std::set<Instruction *> setCastLoad;
-                visitUsersOfValue(BCI, [](Instruction *I) { return isa<LoadInst>(I); }, setCastLoad);
-                std::set<Instruction *> setICmp0;
-                for (Instruction *CastLoad : setCastLoad) {
-                    visitUsersOfValue(CastLoad, [](Instruction *I) { return isa<ICmpInst>(I); }, setICmp0);
-                }
-                for (Instruction *ICmp0 : setICmp0) {
-                    //errs() << "ICmp0:\n";
-                    //ICmp0->print(errs());
-                    //errs() << "\n";
-                    getICmp0Br0First(ICmp0, setDropInst);
-                }
-                std::set<Instruction *> setGEP01;
-                visitUsersOfValue(BCI, isGEP01, setGEP01);
-                //for (Instruction *GEP01 : setGEP01) {
-                //    errs() << "GEP01\n";
-                //    GEP01->print(errs());
-                //    errs() << "\n";
-                //}
-                for (Instruction *LockGuard: setGEP01) {
-                    visitUsersOfValue(LockGuard, isDropInst, setDropInst);     
-                }
-                std::set<Instruction *> setGEP00;
-                for (Instruction *GEP01 : setGEP01) {
-                    visitUsersOfValue(GEP01, isGEP00, setGEP00);
-                }
-                //for (Instruction *GEP00 : setGEP00) {
-                //    errs() << "GEP00\n";
-                //    GEP00->print(errs());
-                //    errs() << "\n";
-                //}
-                std::set<Instruction *> setLoad;
-                for (Instruction *GEP00: setGEP00) {
-                    visitUsersOfValue(GEP00, [](Instruction *I) { return isa<LoadInst>(I); }, setLoad);
-                }
-                //for (Instruction *Load : setLoad) {
-                //    errs() << "Load\n";
-                //    Load->print(errs());
-                //    errs() << "\n";
-                //}
-                std::set<Instruction *> setStore;
-                for (Instruction *Load: setLoad) {
-                    visitUsersOfValue(Load, [](Instruction *I) { return isa<StoreInst>(I); }, setStore);
-                }
-                //for (Instruction *Store : setStore) {
-                //    errs() << "Store\n";
-                //    Store->print(errs());
-                //    errs() << "\n";
-                //}
-                //errs() << "Store Target\n";
-                std::set<Instruction *> setGEPGuard;
-                for (Instruction *Store: setStore) {
-                    Value *TargetAddr = Store->getOperand(1);
-                    Value *Target = GetUnderlyingObject(TargetAddr, DL);
-                    //Target->print(errs());
-                    //errs() << "\n";
-                    visitUsersOfValue(Target, [](Instruction *I) { return isa<GetElementPtrInst>(I); }, setGEPGuard);
-                }
-                //for (Instruction *GEPGuard : setGEPGuard) {
-                //    errs() << "GEPGuard\n";
-                //    GEPGuard->print(errs());
-                //    errs() << "\n";
-                //}
-                std::set<Instruction *> setLockGuard;
-                for (Instruction *GEPGuard: setGEPGuard) {
-                    if (Instruction *LockGuard = dyn_cast<Instruction>(GEPGuard->getOperand(0))) {
-                        setLockGuard.insert(LockGuard);
-                    }
-                }
-                for (Instruction *LockGuard: setLockGuard) {
-                    //errs() << "LockGuard" << "\n";
-                    //errs() << LockGuard->getParent()->getName() << "\n";
-                    //LockGuard->print(errs());
-                    //errs() << "\n";
-                    visitUsersOfValue(LockGuard, isDropInst, setDropInst);     
-                }
-                std::set<Instruction *> setLoadLockGuard;
-                for (Instruction *LockGuard: setLockGuard) {
-                    visitUsersOfValue(LockGuard, [](Instruction *I) { return isa<LoadInst>(I); }, setLoadLockGuard);
-                }
-                for (Instruction *LoadLockGuard: setLoadLockGuard) {
-                    visitUsersOfValue(LoadLockGuard, isDropInst, setDropInst);     
+            }
+            return true;
+        }
+
+        // Whether a callee walk may follow a call from a function Depth calls
+        // away from the lock. The rest of the walk goes on either way.
+        bool mayDescend(unsigned Depth) {
+            if (MaxCallDepth && Depth >= MaxCallDepth) {
+                if (!Truncated) {
+                    Truncated = true;
+                    Reason = TruncationReason::CallDepth;
                 }
+                return false;
             }
+            return true;
         }
-    }
 
-        static bool trackCallee(Instruction *LockInst,
-                            std::pair<Instruction *, Function *> &DirectCalleeSite,
-                            std::map<Function *, std::map<Instruction *, Function *>> &mapCallerCallees,
-                            std::map<Function *, std::set<Instruction *>> &mapAliasFuncLock) {
+        // Reports the current lock site if its walk was cut short.
+        void finishLock(ReportSink &Sink, DetectStats &Stats) {
+            if (Truncated) {
+                Sink.add(TruncationNote{ReportLocation::get(CurrLock), Reason, 0});
+                ++Stats.NumTruncatedLocks;
+            }
+        }
 
-        bool HasDoubleLock = false;
+        // Reports the lock sites that were skipped for a module limit.
+        void finishModule(ReportSink &Sink, DetectStats &Stats) {
+            if (NumSkipped) {
+                Sink.add(TruncationNote{ReportLocation::get(FirstSkipped), ModuleReason, NumSkipped});
+            }
+            Stats.NumSkippedLocks = NumSkipped;
+            Stats.NumSkipListedLocks = NumSkipListed;
+        }
+
+        // Whether a wall time limit cut a walk short, so that the reports
+        // depend on the speed of the run.
+        bool hitTimeLimit() const {
+            return TimeLimited;
+        }
 
-        Function *DirectCallee = DirectCalleeSite.second;
+    private:
+        typedef std::chrono::steady_clock Clock;
 
-        if (mapAliasFuncLock.find(DirectCallee) != mapAliasFuncLock.end()) {
-            // Restore
-           HasDoubleLock = true;
-           errs() << "Double Lock Happens! First Lock:\n";
-           printDebugInfo(LockInst);
-        //    errs() << DirectCallee->getName() << '\n';
-           // Debug Require
-        //    LockInst->print(errs());
-        //    errs() << '\n';
-           //printDebugInfo(DirectCalleeSite.first);
-           errs() << "Second Lock(s):\n";
-           for (Instruction *AliasLock : mapAliasFuncLock[DirectCallee]) {
-               printDebugInfo(AliasLock);
-            //    AliasLock->print(errs());
-            //    errs() << '\n';
-           }
-           errs() << '\n';
+        static std::chrono::milliseconds getLimit(unsigned Ms) {
+            return std::chrono::milliseconds(Ms);
         }
 
-        std::stack<Function *> WorkList;
-        std::set<Function *> Visited;
+        bool exhaust(TruncationReason R) {
+            Exhausted = true;
+            Truncated = true;
+            Reason = R;
+            return false;
+        }
 
-        std::map<Function *, Instruction *> mapParentInst;
+        void stopModule(TruncationReason R) {
+            ModuleDone = true;
+            ModuleReason = R;
+            if (R == TruncationReason::ModuleTime) {
+                TimeLimited = true;
+            }
+        }
 
-        WorkList.push(DirectCallee);
-        Visited.insert(DirectCallee);
+        const ModuleIndex &MI;
+        BitVector SkipFuncs;
+        Clock::time_point ModuleStart;
+        Clock::time_point LockStart;
+        uint64_t ModuleSteps = 0;
+        uint64_t LockSteps = 0;
+        Instruction *CurrLock = nullptr;
+        bool Exhausted = false;
+        bool Truncated = false;
+        TruncationReason Reason = TruncationReason::LockVisits;
+        bool ModuleDone = false;
+        TruncationReason ModuleReason = TruncationReason::ModuleVisits;
+        Instruction *FirstSkipped = nullptr;
+        unsigned NumSkipped = 0;
+        unsigned NumSkipListed = 0;
+        bool TimeLimited = false;
+    };
 
-        mapParentInst[DirectCallee] = DirectCalleeSite.first;
+    static bool trackCallee(Instruction *LockInst,
+                            const CallEdge &DirectCalleeSite,
+                            const ModuleIndex &MI,
+                            const DenseCallGraph &CG,
+                            const LockGroup &LG,
+                            const LockSummaries &LS,
+                            unsigned Group,
+                            CalleeWalk &Walk,
+                            WalkLimits &Limits,
+                            DetectStats &Stats,
+                            ReportSink &Sink) {
 
-        while (!WorkList.empty()) {
-            Function *Curr = WorkList.top();
-            WorkList.pop();
-//            errs() << Curr->getName() << '\n';
-            auto itCallerCallInst = mapCallerCallees.find(Curr);
-            if (itCallerCallInst != mapCallerCallees.end()) {
-//                errs() << "Caller Found\n";
-                std::map<Instruction *, Function *> &mapCallInstCallee = itCallerCallInst->second;
-                for (auto &CallInstCallee : mapCallInstCallee) {
-                    Instruction *CallInst = CallInstCallee.first;
-                    Function *Callee = CallInstCallee.second;
-//                    errs() << "Callee Found " << Callee->getName() << '\n';
-                    if (Visited.find(Callee) == Visited.end()) {
-//                        errs() << "Not Visited\n";
-                        if (mapAliasFuncLock.find(Callee) != mapAliasFuncLock.end()) {
-                            // Restore
-                           errs() << "Double Lock Happens! First Lock:\n";
-                        //    errs() << LockInst->getParent()->getParent()->getName() << '\n';
-                           printDebugInfo(LockInst);
-                        //    LockInst->print(errs());
-                        //    errs() << '\n';
-                        //    errs() << Callee->getName() << '\n';
-                           errs() << "Second Lock(s):\n";
-                           for (Instruction *AliasLock : mapAliasFuncLock[Callee]) {
-                               printDebugInfo(AliasLock);
-                            //    LockInst->print(errs());
-                            //    errs() << '\n';
-                           }
-                           errs() << '\n';
-                            // backtrace print
-                            mapParentInst[Callee] = CallInst;
-                            std::set<Function *> TraceVisited;
-                            auto it = mapParentInst.find(Callee);
-                            while (it != mapParentInst.end()) {
-                                Instruction *ParentInst = it->second;
-                                printDebugInfo(ParentInst);
-                                // errs() << ParentInst->getParent()->getName() << ": ";
-                                // ParentInst->print(errs());
-                                // errs() << '\n';
-                                Function *ParentFunc = ParentInst->getParent()->getParent();
-                                it = mapParentInst.find(ParentFunc);
-                                if (it != mapParentInst.end()) {
-                                    if (TraceVisited.find(it->first) != TraceVisited.end()) {
-                                        break;
-                                    } else {
-                                        TraceVisited.insert(it->first);
-                                    }
-                                }
-                            }
-                            // end of backtrack
-                            HasDoubleLock = true;
+        bool HasDoubleLock = false;
+
+        unsigned DirectCallee = DirectCalleeSite.Callee;
+
+        // Nothing reachable from DirectCallee acquires a lock of this group.
+        if (UseCalleeSummaries && !LS.mayAcquire(DirectCallee, Group)) {
+            return false;
+        }
+
+        if (const std::vector<Instruction *> *DirectLocks = getOtherLocks(LG, DirectCallee, LockInst)) {
+            HasDoubleLock = true;
+            DoubleLockFinding Finding;
+            Finding.FirstLock = ReportLocation::get(LockInst);
+            addOtherLocks(*DirectLocks, LockInst, Finding);
+            Sink.add(Finding);
+        }
+
+        if (!Limits.step()) {
+            return HasDoubleLock;
+        }
+        Walk.Visited.clear();
+        Walk.WorkList.clear();
+
+        Walk.WorkList.push_back(DirectCallee);
+        Walk.Visited.insert(DirectCallee);
+        ++Stats.NumFuncsVisited;
+        Walk.vecParentInst[DirectCallee] = DirectCalleeSite.CallInst;
+        Walk.vecDepth[DirectCallee] = 1;
+
+        while (!Walk.WorkList.empty()) {
+            unsigned Curr = Walk.WorkList.back();
+            Walk.WorkList.pop_back();
+            for (const CallEdge *E = CG.begin(Curr); E != CG.end(Curr); ++E) {
+                unsigned Callee = E->Callee;
+                if (UseCalleeSummaries && !LS.mayAcquire(Callee, Group)) {
+                    continue;
+                }
+                if (Walk.Visited.count(Callee) || !Limits.mayDescend(Walk.vecDepth[Curr])) {
+                    continue;
+                }
+                if (!Limits.step()) {
+                    return HasDoubleLock;
+                }
+                Walk.Visited.insert(Callee);
+                ++Stats.NumFuncsVisited;
+                Walk.vecParentInst[Callee] = E->CallInst;
+                Walk.vecDepth[Callee] = Walk.vecDepth[Curr] + 1;
+                if (const std::vector<Instruction *> *AliasLocks = getOtherLocks(LG, Callee, LockInst)) {
+                    DoubleLockFinding Finding;
+                    Finding.FirstLock = ReportLocation::get(LockInst);
+                    addOtherLocks(*AliasLocks, LockInst, Finding);
+                    // backtrace
+                    Walk.TraceVisited.clear();
+                    unsigned TraceFunc = Callee;
+                    while (true) {
+                        Instruction *ParentInst = Walk.vecParentInst[TraceFunc];
+                        Finding.vecCallChain.push_back(ReportLocation::get(ParentInst));
+                        TraceFunc = MI.getFuncIdx(ParentInst->getFunction());
+                        if (!Walk.Visited.count(TraceFunc) || !Walk.TraceVisited.insert(TraceFunc)) {
+                            break;
                         }
-                        WorkList.push(Callee);
-                        mapParentInst[Callee] = CallInst;
-                        Visited.insert(Callee);
                     }
+                    // end of backtrack
+                    Sink.add(Finding);
+                    HasDoubleLock = true;
                 }
+                Walk.WorkList.push_back(Callee);
             }
         }
 
@@ -704,95 +1161,69 @@ namespace detector {
     }
 
     static bool trackLockInst(Instruction *LockInst,
-                              std::set<Instruction *> setMayAliasLock,
-                              std::set<Instruction *> setDrop,
-                              std::map<Function *, std::map<Instruction *, Function *>> &mapCallerCallees) {
-
-//        std::set<Function *> setMayAliasFunc;
-//        for (Instruction *I : setMayAliasLock) {
-//            if (I != LockInst) {
-//                setMayAliasFunc.insert(I->getParent()->getParent());
-//            }
-//        }
-        std::map<Function *, std::set<Instruction *>> mapMayAliasFuncLock;
-        for (Instruction *I : setMayAliasLock) {
-            if (I != LockInst) {
-                Function *AliasFunc = I->getParent()->getParent();
-                mapMayAliasFuncLock[AliasFunc].insert(I);
-            }
-        }
-//        // Debug
-//        printDebugInfo(LockInst);
-//        for (Function *F : setMayAliasFunc) {
-//            errs() << F->getName() << '\n';
-//        }
-        std::stack<BasicBlock *> WorkList;
-        std::set<BasicBlock *> Visited;
+                              const LockGroup &LG,
+                              const DropSet &setDrop,
+                              const ModuleIndex &MI,
+                              const DenseCallGraph &CG,
+                              const LockSummaries &LS,
+                              unsigned Group,
+                              CFGIndex &CFGs,
+                              BlockWalk &Blocks,
+                              CalleeWalk &Walk,
+                              WalkLimits &Limits,
+                              DetectStats &Stats,
+                              ReportSink &Sink) {
 
         Function *Caller = LockInst->getParent()->getParent();
-        auto &mapCallInstCallee = mapCallerCallees[Caller];
+        unsigned CallerIdx = MI.getFuncIdx(Caller);
 
-//        // Debug
-//        for (auto &kv : mapCallInstCallee) {
-//            kv.first->print(errs());
-//            errs() << '\n';
-//        }
-
-        if (Caller->getName().startswith("_ZN12ethcore_sync10light_sync18LightSync$LT$L$GT$13maintain_sync17h")) {
-            return false;
-        }
-        //errs() << "Begin:\n";
-        //errs() << LockInst->getFunction()->getName() << "\n";
         BasicBlock *LockInstBB = LockInst->getParent();
-        Visited.insert(LockInstBB);
         Instruction *pTerm = LockInstBB->getTerminator();
-        if (pTerm->getNumSuccessors() >= 1) {
-            BasicBlock *NextBB = pTerm->getSuccessor(0);
-            WorkList.push(NextBB);  // no unwind
-            Visited.insert(NextBB);
+        if (pTerm->getNumSuccessors() == 0) {
+            return true;
         }
-        while (!WorkList.empty()) {
-            BasicBlock *Curr = WorkList.top();
-            //errs() << Curr->getName() << "\n";
-            WorkList.pop();
+        const FuncCFG &CFG = CFGs.get(CallerIdx);
+        const BitVector &Interest = LG.mapFuncInterest.find(CallerIdx)->second;
+        unsigned LockBBIdx = MI.getBlockIdx(LockInstBB);
+        unsigned NextIdx = MI.getBlockIdx(pTerm->getSuccessor(0));  // no unwind
+        if (!CFG.mayReach(NextIdx, LockBBIdx, Interest, Blocks.Reach)) {
+            return true;
+        }
+        StampSet &DropBlocks = Blocks.DropBlocks;
+        markDropBlocks(setDrop, Caller, MI, DropBlocks);
+
+        std::vector<unsigned> &WorkList = Blocks.WorkList;
+        StampSet &Visited = Blocks.Visited;
+        Blocks.start(LockBBIdx, NextIdx);
+        while (!WorkList.empty() && Limits.step()) {
+            unsigned CurrIdx = WorkList.back();
+            WorkList.pop_back();
+            ++Stats.NumBlocksVisited;
             bool StopPropagation = false;
-            for (Instruction &II: *Curr) {
-                Instruction *I = &II;
-                if (I == LockInst) {
-                    continue;
-                }
-                // contains same Lock
-                if (setMayAliasLock.find(I) != setMayAliasLock.end()) {
-                    // Restore
-                   errs() << "Double Lock Happens! First Lock:\n";
-                   printDebugInfo(LockInst);
-                   errs() << "Second Lock(s):\n";
-                   printDebugInfo(I);
-                   // Debug Require
-                   // LockInst->print(errs());
-                   errs() << '\n';
-                    StopPropagation = true;
-                    // break;
-                } else if (setDrop.find(I) != setDrop.end()) {
-                    // contains same Drop
-                    //errs() << "dropped\n";
-                    StopPropagation = true;
-                    break;
-                } else {
-                    // is a CallInst
-                    auto it = mapCallInstCallee.find(I);
-                    if (it == mapCallInstCallee.end()) {
+            // Other blocks cannot report nor stop the walk.
+            if (Interest.test(CurrIdx) || DropBlocks.count(CurrIdx)) {
+                for (Instruction &II: *CFG.vecBlocks[CurrIdx]) {
+                    Instruction *I = &II;
+                    if (I == LockInst) {
                         continue;
+                    }
+                    // contains same Lock
+                    if (LG.setLocks.count(I)) {
+                        reportLocalDoubleLock(LockInst, I, Sink);
+                        StopPropagation = true;
+                        // break;
+                    } else if (setDrop.count(I)) {
+                        // contains same Drop
+                        StopPropagation = true;
+                        break;
                     } else {
-                        Instruction *CI = it->first;
-                        Function *Callee = it->second;
-//                        errs() << Callee->getName() << "\n";
-                        auto CalleeSite = std::make_pair(CI, Callee);
-//                        if (trackCallee(LockInst, CalleeSite, mapCallerCallees, setMayAliasFunc)) {
-//                            StopPropagation = true;
-//                            break;
-//                        }
-                        if (trackCallee(LockInst, CalleeSite, mapCallerCallees, mapMayAliasFuncLock)) {
+                        // is a CallInst
+                        auto Site = CG.getCallSite(CallerIdx, MI.getInstIdx(I));
+                        bool Reported = false;
+                        for (const CallEdge *E = Site.first; E != Site.second && !Reported; ++E) {
+                            Reported = trackCallee(LockInst, *E, MI, CG, LG, LS, Group, Walk, Limits, Stats, Sink);
+                        }
+                        if (Reported) {
                             StopPropagation = true;
                             break;
                         }
@@ -801,18 +1232,9 @@ namespace detector {
             }
 
             if (!StopPropagation) {
-                Instruction *pTerm = Curr->getTerminator();
-                for (unsigned i = 0; i < pTerm->getNumSuccessors(); ++i) {
-                    BasicBlock *Succ = pTerm->getSuccessor(i);
-                    // if (Succ->getName() == "_ZN3log9max_level17h461ecf87d921ec18E.exit92") {
-                    //     continue;
-                    // }
-                    if (isa<LandingPadInst>(Succ->getFirstNonPHIOrDbgOrLifetime())) {
-                         continue;
-                    }
-                    if (Visited.find(Succ) == Visited.end()) {
-                        WorkList.push(Succ);
-                        Visited.insert(Succ);
+                for (const unsigned *S = CFG.succ_begin(CurrIdx); S != CFG.succ_end(CurrIdx); ++S) {
+                    if (Visited.insert(*S)) {
+                        WorkList.push_back(*S);
                     }
                 }
             }
@@ -822,112 +1244,89 @@ namespace detector {
     }
 
     static bool trackLockInstLocal(Instruction *LockInst,
-                              std::set<Instruction *> setMayAliasLock,
-                              std::set<Instruction *> setDrop) {
-
-//        std::set<Function *> setMayAliasFunc;
-//        for (Instruction *I : setMayAliasLock) {
-//            if (I != LockInst) {
-//                setMayAliasFunc.insert(I->getParent()->getParent());
-//            }
-//        }
-        std::map<Function *, std::set<Instruction *>> mapMayAliasFuncLock;
-        for (Instruction *I : setMayAliasLock) {
-            if (I != LockInst) {
-                Function *AliasFunc = I->getParent()->getParent();
-                mapMayAliasFuncLock[AliasFunc].insert(I);
-            }
-        }
-//        // Debug
-//        printDebugInfo(LockInst);
-//        for (Function *F : setMayAliasFunc) {
-//            errs() << F->getName() << '\n';
-//        }
-        std::stack<BasicBlock *> WorkList;
-        std::set<BasicBlock *> Visited;
+                              const LockSiteSet &setMayAliasLock,
+                              const DropSet &setDrop,
+                              const ModuleIndex &MI,
+                              const LockAPIClassifier &LAC,
+                              CFGIndex &CFGs,
+                              BlockWalk &Blocks,
+                              WalkLimits &Limits,
+                              DetectStats &Stats,
+                              ReportSink &Sink) {
 
         Function *Caller = LockInst->getParent()->getParent();
 
-//        // Debug
-//        for (auto &kv : mapCallInstCallee) {
-//            kv.first->print(errs());
-//            errs() << '\n';
-//        }
-
-        if (Caller->getName().startswith("_ZN12ethcore_sync10light_sync18LightSync$LT$L$GT$13maintain_sync17h")) {
+        CallSite CS(LockInst);
+        Function *LockFunc = CS.getCalledFunction();
+        if (!LockFunc) {
             return false;
         }
-        // errs() << "Begin:\n";
-        // errs() << LockInst->getFunction()->getName() << "\n";
         BasicBlock *LockInstBB = LockInst->getParent();
-        Visited.insert(LockInstBB);
         Instruction *pTerm = LockInstBB->getTerminator();
-        if (pTerm->getNumSuccessors() >= 1) {
-            BasicBlock *NextBB = pTerm->getSuccessor(0);
-            WorkList.push(NextBB);  // no unwind
-            Visited.insert(NextBB);
+        if (pTerm->getNumSuccessors() == 0) {
+            return true;
         }
-        CallSite CS(LockInst);
-        Function *LockFunc = CS.getCalledFunction();
-        if (!LockFunc) {
-            return false;
+        const FuncCFG &CFG = CFGs.get(MI.getFuncIdx(Caller));
+        BitVector &Interest = Blocks.Interest;
+        Interest.clear();
+        Interest.resize(CFG.vecBlocks.size());
+        for (Instruction *AliasLock : setMayAliasLock) {
+            Interest.set(MI.getBlockIdx(AliasLock->getParent()));
+        }
+        unsigned LockBBIdx = MI.getBlockIdx(LockInstBB);
+        unsigned NextIdx = MI.getBlockIdx(pTerm->getSuccessor(0));  // no unwind
+        if (!CFG.mayReach(NextIdx, LockBBIdx, Interest, Blocks.Reach)) {
+            return true;
         }
+        StampSet &DropBlocks = Blocks.DropBlocks;
+        markDropBlocks(setDrop, Caller, MI, DropBlocks);
+
+        std::vector<unsigned> &WorkList = Blocks.WorkList;
+        StampSet &Visited = Blocks.Visited;
+        Blocks.start(LockBBIdx, NextIdx);
         bool FirstRead = false;
-        if (isStdRead(LockFunc->getName())) {
+        if (LAC.getKind(LockFunc) == LockAPIKind::StdRwLockRead) {
             FirstRead = true;
         }
-        while (!WorkList.empty()) {
-            BasicBlock *Curr = WorkList.top();
-            // errs() << Curr->getName() << "\n";
-            WorkList.pop();
+        while (!WorkList.empty() && Limits.step()) {
+            unsigned CurrIdx = WorkList.back();
+            WorkList.pop_back();
+            ++Stats.NumBlocksVisited;
             bool StopPropagation = false;
-            for (Instruction &II: *Curr) {
-                Instruction *I = &II;
-                if (I == LockInst) {
-                    continue;
-                }
-                // contains same Lock
-                if (setMayAliasLock.find(I) != setMayAliasLock.end()) {
-                    if (FirstRead) {
-                        CallSite CS(I);
-                        Function *SecondLockFunc = CS.getCalledFunction();
-                        if (!SecondLockFunc) {
-                            continue;
-                        }
-                        if (isStdRead(SecondLockFunc->getName())) {
-                            continue;
+            // Other blocks cannot report nor stop the walk.
+            if (Interest.test(CurrIdx) || DropBlocks.count(CurrIdx)) {
+                for (Instruction &II: *CFG.vecBlocks[CurrIdx]) {
+                    Instruction *I = &II;
+                    if (I == LockInst) {
+                        continue;
+                    }
+                    // contains same Lock
+                    if (setMayAliasLock.count(I)) {
+                        if (FirstRead) {
+                            CallSite CS(I);
+                            Function *SecondLockFunc = CS.getCalledFunction();
+                            if (!SecondLockFunc) {
+                                continue;
+                            }
+                            if (LAC.getKind(SecondLockFunc) == LockAPIKind::StdRwLockRead) {
+                                continue;
+                            }
                         }
+                        reportLocalDoubleLock(LockInst, I, Sink);
+                        StopPropagation = true;
+                        // break;
+                    } else if (setDrop.count(I)) {
+                        // contains same Drop
+                        StopPropagation = true;
+                        break;
                     }
-                    // Restore
-                   errs() << "Double Lock Happens! First Lock:\n";
-                   printDebugInfo(LockInst);
-                   errs() << "Second Lock(s):\n";
-                   printDebugInfo(I);
-                   // Debug Require
-                   // LockInst->print(errs());
-                   errs() << '\n';
-                    StopPropagation = true;
-                    // break;
-                } else if (setDrop.find(I) != setDrop.end()) {
-                    // contains same Drop
-                    StopPropagation = true;
-                    break;
                 }
             }
 
             if (!StopPropagation) {
-                Instruction *pTerm = Curr->getTerminator();
-                for (unsigned i = 0; i < pTerm->getNumSuccessors(); ++i) {
-                    BasicBlock *Succ = pTerm->getSuccessor(i);
-                    // if (Succ->getName() == "_ZN3log9max_level17h461ecf87d921ec18E.exit92") {
-                    //     continue;
-                    // }
-                    if (isa<LandingPadInst>(Succ->getFirstNonPHIOrDbgOrLifetime())) {
-                         continue;
-                    }
-                    if (Visited.find(Succ) == Visited.end()) {
-                        WorkList.push(Succ);
-                        Visited.insert(Succ);
+                for (const unsigned *S = CFG.succ_begin(CurrIdx); S != CFG.succ_end(CurrIdx); ++S) {
+                    if (Visited.insert(*S)) {
+                        WorkList.push_back(*S);
                     }
                 }
             }
@@ -937,121 +1336,606 @@ namespace detector {
     }
 
 
-    static void parseLockAPIRwLockRead(Instruction *LockInst, LockInfo &LI) {
-        assert(LockInst);
-        CallSite CS(LockInst);
-        assert(CS.getNumArgOperands() >= 1);
-        LI.LockValue = CS.getArgOperand(0);
-        LI.LockInst = LockInst;
-        LI.ResultValue = LockInst;
+    // Must-alias classes of the lock sites of one type in one function.
+    struct AliasClasses {
+        std::vector<LockSiteSet> vecClasses;
+        DenseMap<Instruction *, unsigned> mapClassIdx;
+    };
+
+    static unsigned findClass(std::vector<unsigned> &vecParent, unsigned i) {
+        while (vecParent[i] != i) {
+            vecParent[i] = vecParent[vecParent[i]];
+            i = vecParent[i];
+        }
+        return i;
     }
 
-    static void parseStdRead(Instruction *LockInst, LockInfo &LI) {
-        assert(LockInst);
-        CallSite CS(LockInst);
-        assert(CS.getNumArgOperands() >= 1);
-        for (auto it = LockInst->user_begin(); it != LockInst->user_end(); ++it) {
-            if (isa<ExtractValueInst>(*it)) {
-                LI.ResultValue = *it;
-                break;
+    // Partitions the sites into must-alias classes with a union-find. Alias
+    // results are symmetric, so each unordered pair is queried at most once,
+    // and not at all if both sites are already in the same class.
+    static void partitionMustAlias(const LockInfoMap &mapLocks,
+                                   AliasAnalysis &AA,
+                                   DetectStats &Stats,
+                                   AliasClasses &AC) {
+        std::vector<Instruction *> vecLocks;
+        for (auto &LI : mapLocks) {
+            vecLocks.push_back(LI.first);
+        }
+        std::vector<unsigned> vecParent(vecLocks.size());
+        for (unsigned i = 0; i < vecLocks.size(); ++i) {
+            vecParent[i] = i;
+        }
+        for (unsigned i = 0; i < vecLocks.size(); ++i) {
+            for (unsigned j = i + 1; j < vecLocks.size(); ++j) {
+                unsigned RootI = findClass(vecParent, i);
+                unsigned RootJ = findClass(vecParent, j);
+                if (RootI == RootJ) {
+                    continue;
+                }
+                ++Stats.NumAliasQueries;
+                if (AA.alias(vecLocks[i], vecLocks[j]) == AliasResult::MustAlias) {
+                    vecParent[RootJ] = RootI;
+                }
             }
         }
-        if (!LI.ResultValue) {
-            LI.ResultValue = LockInst;
+        DenseMap<unsigned, unsigned> mapRootClass;
+        for (unsigned i = 0; i < vecLocks.size(); ++i) {
+            unsigned Root = findClass(vecParent, i);
+            auto it = mapRootClass.find(Root);
+            if (it == mapRootClass.end()) {
+                it = mapRootClass.insert(std::make_pair(Root, AC.vecClasses.size())).first;
+                AC.vecClasses.emplace_back();
+            }
+            AC.vecClasses[it->second].insert(vecLocks[i]);
+            AC.mapClassIdx[vecLocks[i]] = it->second;
         }
-        LI.LockValue = CS.getArgOperand(0);
-        LI.LockInst = LockInst;
-        LI.ResultValue = LockInst;
     }
 
-    static void parseStdLockWrite(Instruction *LockInst, LockInfo &LI) {
-        assert(LockInst);
-        CallSite CS(LockInst);
-        assert(CS.getNumArgOperands() >= 2);
-        LI.LockValue = CS.getArgOperand(1);
-        LI.LockInst = LockInst;
-        LI.ResultValue = CS.getArgOperand(0);
+    // The locks of each function that are not lock fields, by function
+    // index and then by lock type in order of first use.
+    typedef std::map<unsigned, MapVector<Type *, LockInfoMap>> IntraProcLockMap;
+
+    static void countLockGroups(const IntraProcLockMap &mapIntraProcLockInfo,
+                                const MutexSourceLockMap &mapInterProcLockInfo,
+                                DetectStats &Stats) {
+        for (auto &FTLIS : mapIntraProcLockInfo) {
+            for (auto &TLIS : FTLIS.second) {
+                if (TLIS.second.size() > 1) {
+                    ++Stats.NumIntraGroups;
+                    Stats.addGroup(TLIS.second.size());
+                }
+            }
+        }
+        for (auto &MSLIS : mapInterProcLockInfo) {
+            if (MSLIS.second.size() > 1) {
+                ++Stats.NumInterGroups;
+                Stats.addGroup(MSLIS.second.size());
+            }
+        }
     }
 
-    bool RustDoubleLockDetector::runOnModule(Module &M) {
-        this->pModule = &M;
+    // A lock site on a lock field, as a source of lock order edges.
+    struct OrderSite {
+        Instruction *LockInst;
+        LockAPIKind Kind;
+        unsigned Node;          // index of its MutexSource
+        const DropSet *Drops;
+    };
 
-        std::map<Function *, std::map<Instruction *, Function *>> mapGlobalCallSite;
-        for (Function &F : M) {
-            collectGlobalCallSite(&F, mapGlobalCallSite[&F]);
+    // The first "held Held while acquiring Acquire" seen for an edge, or
+    // the first that is not read/read once there is one. ReadRead is set
+    // while both locks of every pair seen are read guards of std RwLocks.
+    struct OrderWitness {
+        Instruction *Held;
+        Instruction *Acquire;
+        bool ReadRead;
+    };
+
+    // Lock acquisition order over the MutexSources of a module. An edge
+    // A -> B means that B may be acquired while a guard of A is alive,
+    // either by a lock site of B or by a call whose callees may acquire B.
+    struct LockOrderGraph {
+        unsigned NumNodes = 0;
+        std::vector<OrderSite> vecSites;
+        DenseMap<Instruction *, unsigned> mapSiteIdx;
+        // By function index: the nodes it may acquire directly or through
+        // callees, and those of them it may acquire other than as a std
+        // RwLock reader; empty if none.
+        std::vector<BitVector> vecFuncAcquired;
+        std::vector<BitVector> vecFuncExclAcquired;
+        // By function with a site: the blocks that may add an edge.
+        DenseMap<unsigned, BitVector> mapFuncInterest;
+        DenseMap<std::pair<unsigned, unsigned>, OrderWitness> mapEdges;
+        std::vector<std::vector<unsigned>> vecSuccs;   // by node, in order of discovery
+    };
+
+    static void addOrderEdge(LockOrderGraph &G, unsigned From, unsigned To,
+                             Instruction *Held, Instruction *Acquire, bool ReadRead) {
+        if (From == To) {
+            // Acquiring the same lock again is a double lock.
+            return;
         }
+        OrderWitness W = {Held, Acquire, ReadRead};
+        auto Inserted = G.mapEdges.insert(std::make_pair(std::make_pair(From, To), W));
+        if (Inserted.second) {
+            G.vecSuccs[From].push_back(To);
+        } else if (Inserted.first->second.ReadRead && !ReadRead) {
+            Inserted.first->second = W;
+        }
+    }
 
-        std::map<Function *, std::set<Instruction *>> mapCalleeToCallSites;
-        for (auto &CallerCallSites : mapGlobalCallSite) {
-            for (auto &CallInstCallee : CallerCallSites.second) {
-                mapCalleeToCallSites[CallInstCallee.second].insert(CallInstCallee.first);
+    static const BitVector &getOrderInterest(LockOrderGraph &G, unsigned FuncIdx,
+                                             const ModuleIndex &MI, const DenseCallGraph &CG) {
+        auto It = G.mapFuncInterest.find(FuncIdx);
+        if (It != G.mapFuncInterest.end()) {
+            return It->second;
+        }
+        BitVector Interest(MI.getNumBlocks(MI.getFunc(FuncIdx)));
+        for (const CallEdge *E = CG.begin(FuncIdx); E != CG.end(FuncIdx); ++E) {
+            if (G.mapSiteIdx.count(E->CallInst) || !G.vecFuncAcquired[E->Callee].empty()) {
+                Interest.set(MI.getBlockIdx(E->CallInst->getParent()));
             }
         }
+        return G.mapFuncInterest[FuncIdx] = std::move(Interest);
+    }
 
-        std::map<Function *, std::map<Instruction *, Function *>> mapLockAPIRwLockRead;
-        std::map<Function *, std::map<Instruction *, Function *>> mapStdRead;
-        std::map<Function *, std::map<Instruction *, Function *>> mapStdWrite;
-        std::map<Function *, std::map<Instruction *, Function *>> mapStdLock;
-        for (auto &CallerCallSites : mapGlobalCallSite) {
-            for (auto &CallInstCallee : CallerCallSites.second) {
-                auto FuncName = CallInstCallee.second->getName();
-                if (isLockAPIRwLockRead(FuncName)) {
-                    if (mapLockAPIRwLockRead.find(CallerCallSites.first) == mapLockAPIRwLockRead.end()) {
-                        mapLockAPIRwLockRead[CallerCallSites.first] = std::map<Instruction *, Function *>();
-                    }
-                    mapLockAPIRwLockRead[CallerCallSites.first][CallInstCallee.first] = CallInstCallee.second;
-                } else if (isStdLock(FuncName)) {
-                    if (mapStdLock.find(CallerCallSites.first) == mapStdLock.end()) {
-                        mapStdLock[CallerCallSites.first] = std::map<Instruction *, Function *>();
-                    }
-                    mapStdLock[CallerCallSites.first][CallInstCallee.first] = CallInstCallee.second;
-                } else if (isStdRead(FuncName)) {
-                    if (mapStdRead.find(CallerCallSites.first) == mapStdRead.end()) {
-                        mapStdRead[CallerCallSites.first] = std::map<Instruction *, Function *>();
+    // Adds the edges from the node of Site to what I acquires. Returns
+    // false if I drops the guard of Site.
+    static bool addOrderEdges(const OrderSite &Site, Instruction *I, unsigned CallerIdx,
+                              LockOrderGraph &G, const ModuleIndex &MI, const DenseCallGraph &CG) {
+        if (Site.Drops->count(I)) {
+            return false;
+        }
+        auto It = G.mapSiteIdx.find(I);
+        if (It != G.mapSiteIdx.end()) {
+            const OrderSite &Second = G.vecSites[It->second];
+            bool ReadRead = Site.Kind == LockAPIKind::StdRwLockRead && Second.Kind == LockAPIKind::StdRwLockRead;
+            addOrderEdge(G, Site.Node, Second.Node, Site.LockInst, I, ReadRead);
+            return true;
+        }
+        bool HeldRead = Site.Kind == LockAPIKind::StdRwLockRead;
+        auto CallSite = CG.getCallSite(CallerIdx, MI.getInstIdx(I));
+        for (const CallEdge *E = CallSite.first; E != CallSite.second; ++E) {
+            const BitVector &Acquired = G.vecFuncAcquired[E->Callee];
+            if (Acquired.empty()) {
+                continue;
+            }
+            const BitVector &Excl = G.vecFuncExclAcquired[E->Callee];
+            for (int Node = Acquired.find_first(); Node != -1; Node = Acquired.find_next(Node)) {
+                bool ReadRead = HeldRead && (Excl.empty() || !Excl.test(Node));
+                addOrderEdge(G, Site.Node, Node, Site.LockInst, I, ReadRead);
+            }
+        }
+        return true;
+    }
+
+    // Adds the edges from the node of Site: everything acquired after it
+    // and before a drop of its guard, in the rest of its block and in the
+    // blocks that the walk of trackLockInst visits.
+    static void addOrderEdges(const OrderSite &Site,
+                              LockOrderGraph &G,
+                              const ModuleIndex &MI,
+                              const DenseCallGraph &CG,
+                              CFGIndex &CFGs,
+                              BlockWalk &Blocks) {
+        Instruction *LockInst = Site.LockInst;
+        Function *Caller = LockInst->getFunction();
+        unsigned CallerIdx = MI.getFuncIdx(Caller);
+        BasicBlock *LockInstBB = LockInst->getParent();
+        for (Instruction *I = LockInst->getNextNode(); I; I = I->getNextNode()) {
+            if (!addOrderEdges(Site, I, CallerIdx, G, MI, CG)) {
+                return;
+            }
+        }
+        Instruction *pTerm = LockInstBB->getTerminator();
+        if (pTerm->getNumSuccessors() == 0) {
+            return;
+        }
+        const FuncCFG &CFG = CFGs.get(CallerIdx);
+        const BitVector &Interest = getOrderInterest(G, CallerIdx, MI, CG);
+        unsigned LockBBIdx = MI.getBlockIdx(LockInstBB);
+        unsigned NextIdx = MI.getBlockIdx(pTerm->getSuccessor(0));  // no unwind
+        if (!CFG.mayReach(NextIdx, LockBBIdx, Interest, Blocks.Reach)) {
+            return;
+        }
+        StampSet &DropBlocks = Blocks.DropBlocks;
+        markDropBlocks(*Site.Drops, Caller, MI, DropBlocks);
+
+        std::vector<unsigned> &WorkList = Blocks.WorkList;
+        StampSet &Visited = Blocks.Visited;
+        Blocks.start(LockBBIdx, NextIdx);
+        while (!WorkList.empty()) {
+            unsigned CurrIdx = WorkList.back();
+            WorkList.pop_back();
+            bool StopPropagation = false;
+            if (Interest.test(CurrIdx) || DropBlocks.count(CurrIdx)) {
+                for (Instruction &II : *CFG.vecBlocks[CurrIdx]) {
+                    if (!addOrderEdges(Site, &II, CallerIdx, G, MI, CG)) {
+                        StopPropagation = true;
+                        break;
                     }
-                    mapStdRead[CallerCallSites.first][CallInstCallee.first] = CallInstCallee.second;
-                } else if (isStdWrite(FuncName)) {
-                    if (mapStdWrite.find(CallerCallSites.first) == mapStdWrite.end()) {
-                        mapStdWrite[CallerCallSites.first] = std::map<Instruction *, Function *>();
+                }
+            }
+
+            if (!StopPropagation) {
+                for (const unsigned *S = CFG.succ_begin(CurrIdx); S != CFG.succ_end(CurrIdx); ++S) {
+                    if (Visited.insert(*S)) {
+                        WorkList.push_back(*S);
                     }
-                    mapStdWrite[CallerCallSites.first][CallInstCallee.first] = CallInstCallee.second;
                 }
             }
         }
-#ifdef LOCKAPI
-{
-        std::map<Function *, std::map<Type *, std::map<Instruction *, LockInfo>>> mapIntraProcLockInfo;
-        std::unordered_map<MutexSource, std::map<Instruction *, LockInfo>, MutexSourceHasher> mapInterProcLockInfo;
-        std::map<Instruction *, std::set<Instruction *>> mapLockDropInst;
-        for (auto &CallerCallSites : mapLockAPIRwLockRead) {
-            for (auto &CallInstCallee : CallerCallSites.second) {
-                // errs() << "Caller: " << CallerCallSites.first->getName() << "\n";
-                // errs() << "Callee: " << CallInstCallee.second->getName() << "\n";
-                LockInfo LI;
-                parseLockAPIRwLockRead(CallInstCallee.first, LI);
-                MutexSource MS;
-                bool IsField = traceMutexSource(LI.LockValue, MS);
-                if (!IsField) {
-                    Function *F = LI.LockInst->getFunction();
-                    if (mapIntraProcLockInfo.find(F) == mapIntraProcLockInfo.end()) {
-                        mapIntraProcLockInfo[F] = std::map<Type *, std::map<Instruction *, LockInfo>>();
+    }
+
+    // Strongly connected components of the lock order graph with more
+    // than one node, each sorted, in order of their smallest node.
+    static void findOrderCycles(const LockOrderGraph &G, std::vector<std::vector<unsigned>> &vecSCCs) {
+        struct Frame {
+            unsigned Node;
+            unsigned NextSucc;
+        };
+
+        const unsigned Unvisited = ~0u;
+        std::vector<unsigned> vecIndex(G.NumNodes, Unvisited);
+        std::vector<unsigned> vecLowLink(G.NumNodes, 0);
+        BitVector OnStack(G.NumNodes);
+        std::vector<unsigned> SCCStack;
+        std::vector<Frame> Stack;
+        unsigned NextIndex = 0;
+
+        for (unsigned Root = 0; Root < G.NumNodes; ++Root) {
+            if (vecIndex[Root] != Unvisited) {
+                continue;
+            }
+            vecIndex[Root] = vecLowLink[Root] = NextIndex++;
+            SCCStack.push_back(Root);
+            OnStack.set(Root);
+            Stack.push_back({Root, 0});
+            while (!Stack.empty()) {
+                Frame &Top = Stack.back();
+                const std::vector<unsigned> &vecSuccs = G.vecSuccs[Top.Node];
+                if (Top.NextSucc < vecSuccs.size()) {
+                    unsigned Succ = vecSuccs[Top.NextSucc++];
+                    if (vecIndex[Succ] == Unvisited) {
+                        vecIndex[Succ] = vecLowLink[Succ] = NextIndex++;
+                        SCCStack.push_back(Succ);
+                        OnStack.set(Succ);
+                        Stack.push_back({Succ, 0});
+                    } else if (OnStack.test(Succ)) {
+                        vecLowLink[Top.Node] = std::min(vecLowLink[Top.Node], vecIndex[Succ]);
                     }
-                    Type *LockType = LI.LockValue->getType();
-                    if (mapIntraProcLockInfo[F].find(LockType) == mapIntraProcLockInfo[F].end()) {
-                        mapIntraProcLockInfo[F][LockType] = std::map<Instruction *, LockInfo>();
+                    continue;
+                }
+                unsigned Node = Top.Node;
+                Stack.pop_back();
+                if (!Stack.empty()) {
+                    unsigned Parent = Stack.back().Node;
+                    vecLowLink[Parent] = std::min(vecLowLink[Parent], vecLowLink[Node]);
+                }
+                if (vecLowLink[Node] != vecIndex[Node]) {
+                    continue;
+                }
+                std::vector<unsigned> SCC;
+                unsigned Member = 0;
+                do {
+                    Member = SCCStack.back();
+                    SCCStack.pop_back();
+                    OnStack.reset(Member);
+                    SCC.push_back(Member);
+                } while (Member != Node);
+                if (SCC.size() > 1) {
+                    std::sort(SCC.begin(), SCC.end());
+                    vecSCCs.push_back(std::move(SCC));
+                }
+            }
+        }
+        std::sort(vecSCCs.begin(), vecSCCs.end(),
+                  [](const std::vector<unsigned> &L, const std::vector<unsigned> &R) { return L[0] < R[0]; });
+    }
+
+    static bool isReadReadEdge(const LockOrderGraph &G, unsigned From, unsigned To) {
+        return G.mapEdges.find(std::make_pair(From, To))->second.ReadRead;
+    }
+
+    // A shortest path From -> ... -> To inside SCC, without To; empty if
+    // there is none.
+    static std::vector<unsigned> findOrderPath(const LockOrderGraph &G, const std::vector<unsigned> &SCC,
+                                               unsigned From, unsigned To) {
+        DenseMap<unsigned, unsigned> mapParent;
+        std::vector<unsigned> WorkList;
+        WorkList.push_back(From);
+        for (std::size_t Head = 0; Head < WorkList.size(); ++Head) {
+            unsigned Curr = WorkList[Head];
+            for (unsigned Succ : G.vecSuccs[Curr]) {
+                if (!std::binary_search(SCC.begin(), SCC.end(), Succ)) {
+                    continue;
+                }
+                if (Succ == To) {
+                    std::vector<unsigned> vecPath;
+                    for (unsigned Node = Curr; Node != From; Node = mapParent[Node]) {
+                        vecPath.push_back(Node);
                     }
-                    mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
-                } else {
-                    if (mapInterProcLockInfo.find(MS) == mapInterProcLockInfo.end()) {
-                        mapInterProcLockInfo[MS] = std::map<Instruction *, LockInfo>();
+                    vecPath.push_back(From);
+                    std::reverse(vecPath.begin(), vecPath.end());
+                    return vecPath;
+                }
+                if (Succ != From && mapParent.insert(std::make_pair(Succ, Curr)).second) {
+                    WorkList.push_back(Succ);
+                }
+            }
+        }
+        return std::vector<unsigned>();
+    }
+
+    // Reports one cycle of each SCC, so that the report grows with the
+    // number of SCCs, not of cycles. A cycle of read/read edges only is no
+    // deadlock, while a single other edge can make readers wait for a
+    // blocked writer; an SCC is skipped only if all its edges are read/read.
+    // The shortest cycle through the smallest node is preferred, otherwise
+    // a shortest one through the first edge that is not read/read.
+    static void reportOrderCycle(const LockOrderGraph &G, const std::vector<unsigned> &SCC, ReportSink &Sink) {
+        std::vector<unsigned> vecCycle = findOrderPath(G, SCC, SCC[0], SCC[0]);
+        bool AllReadRead = true;
+        for (std::size_t i = 0; i < vecCycle.size() && AllReadRead; ++i) {
+            AllReadRead = isReadReadEdge(G, vecCycle[i], vecCycle[(i + 1) % vecCycle.size()]);
+        }
+        if (vecCycle.empty() || AllReadRead) {
+            vecCycle.clear();
+            for (unsigned From : SCC) {
+                for (unsigned To : G.vecSuccs[From]) {
+                    if (std::binary_search(SCC.begin(), SCC.end(), To) && !isReadReadEdge(G, From, To)) {
+                        vecCycle = findOrderPath(G, SCC, To, From);
+                        vecCycle.insert(vecCycle.begin(), From);
+                        break;
                     }
-                    mapInterProcLockInfo[MS][LI.LockInst] = LI;
                 }
-                std::set<Instruction *> setDropInst;
-                traceDropInst(LI, setDropInst);
-                mapLockDropInst[LI.LockInst] = setDropInst;
+                if (!vecCycle.empty()) {
+                    break;
+                }
             }
         }
+        if (vecCycle.empty()) {
+            return;
+        }
+
+        LockOrderFinding Finding;
+        for (std::size_t i = 0; i < vecCycle.size(); ++i) {
+            unsigned From = vecCycle[i];
+            unsigned To = vecCycle[(i + 1) % vecCycle.size()];
+            const OrderWitness &W = G.mapEdges.find(std::make_pair(From, To))->second;
+            Finding.vecEdges.push_back({ReportLocation::get(W.Held), ReportLocation::get(W.Acquire)});
+        }
+        Sink.add(Finding);
+    }
+
+    // Lock order inversions between lock fields. One walk per lock site and
+    // per-function summaries of the acquired locks, as for double locks, so
+    // no pair of lock sites is ever enumerated.
+    static void detectLockOrder(LockSiteInfo &Info,
+                                const ModuleIndex &MI,
+                                const DenseCallGraph &CG,
+                                CFGIndex &CFGs,
+                                BlockWalk &Blocks,
+                                MutexSourceTable &Sources,
+                                DetectStats &Stats,
+                                ReportSink &Sink) {
+        const std::vector<LockSite> &vecSites = Info.getLockSites();
+        LockOrderGraph G;
+        DenseMap<unsigned, unsigned> mapNodeIdx;    // by MutexSource ID
+        for (unsigned SiteIdx = 0; SiteIdx < vecSites.size(); ++SiteIdx) {
+            const LockSite &Site = vecSites[SiteIdx];
+            if (!isLockKind(Site.Kind) || Site.Kind == LockAPIKind::GenericLock || !Site.LockValue) {
+                continue;
+            }
+            unsigned SourceID;
+            bool IsField = timePhase(Stats.TimeMutexSource, [&]() { return Sources.getSource(Site.LockValue, SourceID); });
+            if (!IsField) {
+                continue;
+            }
+            auto It = mapNodeIdx.insert(std::make_pair(SourceID, G.NumNodes)).first;
+            if (It->second == G.NumNodes) {
+                ++G.NumNodes;
+            }
+            const DropSet *Drops = timePhase(Stats.TimeDropTrace, [&]() { return &Info.getGuardDrops(SiteIdx); });
+            G.mapSiteIdx[Site.LockInst] = G.vecSites.size();
+            G.vecSites.push_back({Site.LockInst, Site.Kind, It->second, Drops});
+        }
+        if (G.NumNodes < 2) {
+            return;
+        }
+
+        PhaseTimer LockOrderTimer(Stats.TimeLockOrder);
+        std::vector<BitVector> vecFuncLocal(MI.getNumFuncs());
+        std::vector<BitVector> vecFuncExclLocal(MI.getNumFuncs());
+        for (const OrderSite &Site : G.vecSites) {
+            unsigned FuncIdx = MI.getFuncIdx(Site.LockInst->getFunction());
+            BitVector &Local = vecFuncLocal[FuncIdx];
+            if (Local.empty()) {
+                Local.resize(G.NumNodes);
+            }
+            Local.set(Site.Node);
+            if (Site.Kind != LockAPIKind::StdRwLockRead) {
+                BitVector &ExclLocal = vecFuncExclLocal[FuncIdx];
+                if (ExclLocal.empty()) {
+                    ExclLocal.resize(G.NumNodes);
+                }
+                ExclLocal.set(Site.Node);
+            }
+        }
+        propagateAcquired(CG, G.NumNodes, vecFuncLocal, G.vecFuncAcquired);
+        propagateAcquired(CG, G.NumNodes, vecFuncExclLocal, G.vecFuncExclAcquired);
+
+        G.vecSuccs.resize(G.NumNodes);
+        for (const OrderSite &Site : G.vecSites) {
+            addOrderEdges(Site, G, MI, CG, CFGs, Blocks);
+        }
+        Stats.NumLockOrderEdges = G.mapEdges.size();
+
+        std::vector<std::vector<unsigned>> vecSCCs;
+        findOrderCycles(G, vecSCCs);
+        for (const std::vector<unsigned> &SCC : vecSCCs) {
+            reportOrderCycle(G, SCC, Sink);
+        }
+    }
+
+    // State of a differential scan (-detect-diff-base), shared by the runs
+    // on the base and on the new module. Only lock groups that may see a
+    // change are tracked in either: those with a lock site in a function
+    // that changed or transitively calls one. Groups are matched across the
+    // modules by getGroupKey(), as MutexSources of different contexts
+    // cannot be compared.
+    struct DiffRun {
+        StringSet<> setChanged;         // functions that differ, by name
+        StringSet<> setDirtyGroups;     // by getGroupKey()
+        std::vector<DoubleLockFinding> vecBaseFindings;
+        std::vector<DoubleLockFinding> vecFindings;
+        bool IsBase = true;
+        bool BaseTimeLimited = false;
+
+        bool isDirty(const std::string &Key) const {
+            return setDirtyGroups.count(Key);
+        }
+    };
+
+    // A lock field by struct name and index path; a function's own locks,
+    // which are grouped by type inside it, by function name.
+    static std::string getGroupKey(const MutexSourceTable &Sources, bool IsField, unsigned SourceID,
+                                   const Function &F) {
+        if (!IsField) {
+            return "local:" + F.getName().str();
+        }
+        const MutexSource &MS = Sources.get(SourceID);
+        std::string Key = "field:" + stripTypeSuffix(cast<StructType>(MS.structTy)->getName()).str();
+        for (int64_t Idx : MS.index) {
+            Key += ':' + std::to_string(Idx);
+        }
+        return Key;
+    }
+
+    // Adds the groups of Info's module that may see a change to
+    // Run.setDirtyGroups.
+    static void addDirtyGroups(LockSiteInfo &Info, DiffRun &Run) {
+        const ModuleIndex &MI = Info.getIndex();
+        const DenseCallGraph &CG = Info.getCallGraph();
+        std::vector<BitVector> vecChanged(CG.getNumCallers());
+        for (unsigned F = 0; F < vecChanged.size(); ++F) {
+            if (Run.setChanged.count(MI.getFunc(F)->getName())) {
+                vecChanged[F] = BitVector(1, true);
+            }
+        }
+        std::vector<BitVector> vecAffected;
+        propagateAcquired(CG, 1, vecChanged, vecAffected);
+
+        MutexSourceTable Sources;
+        for (const LockSite &Site : Info.getLockSites()) {
+            if (!isLockKind(Site.Kind) || !Site.LockValue) {
+                continue;
+            }
+            const Function &F = *Site.LockInst->getFunction();
+            if (vecAffected[MI.getFuncIdx(&F)].empty()) {
+                continue;
+            }
+            unsigned SourceID;
+            bool IsField = Sources.getSource(Site.LockValue, SourceID);
+            Run.setDirtyGroups.insert(getGroupKey(Sources, IsField, SourceID, F));
+        }
+    }
+
+    // The detection of both the legacy and the new pass manager pass. The
+    // lock sites and the AA of a function come from the pass manager.
+    typedef function_ref<LockSiteInfo &(const LockAPIMatcher &, unsigned, unsigned, unsigned)> GetLockSitesFn;
+    typedef function_ref<AliasAnalysis &(Function &)> GetAAFn;
+
+    // Returns whether a wall time limit cut the tracking short.
+    // In a differential scan (Diff), only the groups of Diff->setDirtyGroups
+    // are tracked and findings are collected into Diff. The run on the new
+    // module then reports how they differ from those of the base module.
+    static bool detectModule(Module &M, GetLockSitesFn GetLockSites, GetAAFn GetAA,
+                             raw_ostream &OS, bool SarifFragment, DiffRun *Diff = nullptr) {
+        // Reports of a module are buffered and written at once, so runs
+        // sharing a stream do not interleave.
+        std::string Report;
+        raw_string_ostream ReportOS(Report);
+        ReportSink Sink(ReportOS, ReportFormatOpt, M.getModuleIdentifier(), SarifFragment);
+        if (Diff) {
+            Sink.setCollector(Diff->IsBase ? &Diff->vecBaseFindings : &Diff->vecFindings);
+        }
+
+        DetectStats Stats;
+        // The scan is shared with other passes that require LockSiteAnalysis
+        // (e.g. the manual drop printer) in the same opt run.
+        LockSiteInfo &Info = timePhase(Stats.TimeCollect, [&]() -> LockSiteInfo & {
+            return GetLockSites(getLockAPIMatcher(), DetectThreads, DropTraceBudget, IndirectFanOut);
+        });
+        const ModuleIndex &MI = Info.getIndex();
+        const LockAPIClassifier &LAC = Info.getClassifier();
+        const DenseCallGraph &CG = Info.getCallGraph();
+        const std::vector<LockSite> &vecSites = Info.getLockSites();
+        unsigned NumFuncs = MI.getNumFuncs();
+
+        // Lock sites by class, as indices into vecSites.
+        std::vector<unsigned> vecLockAPIRwLockRead;
+        std::vector<unsigned> vecStdRead;
+        std::vector<unsigned> vecStdWrite;
+        std::vector<unsigned> vecStdLock;
+        for (unsigned i = 0; i < vecSites.size(); ++i) {
+            switch (vecSites[i].Kind) {
+                case LockAPIKind::LockAPI:
+                    vecLockAPIRwLockRead.push_back(i);
+                    break;
+                case LockAPIKind::StdMutexLock:
+                    vecStdLock.push_back(i);
+                    break;
+                case LockAPIKind::StdRwLockRead:
+                    vecStdRead.push_back(i);
+                    break;
+                case LockAPIKind::StdRwLockWrite:
+                    vecStdWrite.push_back(i);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        Stats.NumFuncs = NumFuncs;
+        Stats.NumCallSites = CG.getNumEdges();
+        Stats.NumIndirectResolved = Info.getIndirectCallStats().NumResolved;
+        Stats.NumIndirectEdges = Info.getIndirectCallStats().NumEdges;
+        Stats.NumIndirectCapped = Info.getIndirectCallStats().NumCapped;
+        Stats.NumLockAPI = vecLockAPIRwLockRead.size();
+        Stats.NumStdMutex = vecStdLock.size();
+        Stats.NumStdRead = vecStdRead.size();
+        Stats.NumStdWrite = vecStdWrite.size();
+
+        CalleeWalk Walk(NumFuncs);
+        BlockWalk Blocks(MI);
+        WalkLimits Limits(MI);
+        CFGIndex CFGs(MI);
+        MutexSourceTable Sources;
+#ifdef LOCKAPI
+{
+        IntraProcLockMap mapIntraProcLockInfo;
+        MutexSourceLockMap mapInterProcLockInfo;
+        DenseMap<Instruction *, const DropSet *> mapLockDropInst;
+        for (unsigned SiteIdx : vecLockAPIRwLockRead) {
+            if (!vecSites[SiteIdx].LockValue) {
+                continue;
+            }
+            LockInfo LI(vecSites[SiteIdx]);
+            unsigned SourceID;
+            bool IsField = timePhase(Stats.TimeMutexSource, [&]() { return Sources.getSource(LI.LockValue, SourceID); });
+            if (Diff && !Diff->isDirty(getGroupKey(Sources, IsField, SourceID, *LI.LockInst->getFunction()))) {
+                continue;
+            }
+            if (!IsField) {
+                unsigned F = MI.getFuncIdx(LI.LockInst->getFunction());
+                Type *LockType = LI.LockValue->getType();
+                mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
+            } else {
+                mapInterProcLockInfo[SourceID][LI.LockInst] = LI;
+            }
+            mapLockDropInst[LI.LockInst] = timePhase(Stats.TimeDropTrace, [&]() { return &Info.getGuardDrops(SiteIdx); });
+        }
 
         // for (auto &FTLIS : mapIntraProcLockInfo) {
         //     for (auto &TLIS : FTLIS.second) {
@@ -1068,7 +1952,7 @@ namespace detector {
         // for (auto &MSLIS : mapInterProcLockInfo) {
         //     if (MSLIS.second.size() > 1) {
         //         errs() << "Set of Aliased Locks:\n";
-        //         MSLIS.first.print(errs());
+        //         Sources.get(MSLIS.first).print(errs());
         //         for (auto &LI : MSLIS.second) {
         //             printDebugInfo(LI.second.LockInst);
         //         }
@@ -1099,29 +1983,36 @@ namespace detector {
                 if (TLIS.second.size() <= 1) {
                     continue;
                 }
-                std::set<Instruction *> setMayAliasLock;
+                LockSiteSet setMayAliasLock;
                 for (auto &LI : TLIS.second) {
                     setMayAliasLock.insert(LI.first);
                 }
                 for (auto &LI : TLIS.second) {
-                   trackLockInstLocal(LI.first, setMayAliasLock, mapLockDropInst[LI.first]);
+                   timePhase(Stats.TimeTrack, [&]() {
+                       if (Limits.startLock(LI.first)) {
+                           trackLockInstLocal(LI.first, setMayAliasLock, *mapLockDropInst[LI.first], MI, LAC, CFGs, Blocks, Limits, Stats, Sink);
+                           Limits.finishLock(Sink, Stats);
+                       }
+                   });
                 }
             }
         }
 // #ifdef INTER
+        LockSummaries LS;
+        countLockGroups(mapIntraProcLockInfo, mapInterProcLockInfo, Stats);
+        timePhase(Stats.TimeSummaries, [&]() { computeLockSummaries(mapInterProcLockInfo, MI, CG, LS); });
         for (auto &MSLIS : mapInterProcLockInfo) {
             if (MSLIS.second.size() <= 1) {
                 continue;
             }
+            unsigned Group = LS.mapGroupIdx[MSLIS.first];
             // errs() << "Set of Aliased Locks:\n";
-            // MSLIS.first.print(errs());
+            // Sources.get(MSLIS.first).print(errs());
             // for (auto &LI : MSLIS.second) {
             //     printDebugInfo(LI.second.LockInst);
             // }
-            std::set<Instruction *> setMayAliasLock;
-            for (auto &LI : MSLIS.second) {
-                setMayAliasLock.insert(LI.first);
-            }
+            LockGroup LG;
+            buildLockGroup(MSLIS.second, MI, CG, LS, Group, LG);
             for (auto &LI : MSLIS.second) {
                 // if (LI.first->getFunction()->getName() != "_ZN12ethcore_sync10light_sync18LightSync$LT$L$GT$13maintain_sync17h404bd375d3a82a04E") {
                 //     continue;
@@ -1134,7 +2025,12 @@ namespace detector {
                 //     DI->print(errs());
                 //     errs() << "\n";
                 // }
-                trackLockInst(LI.first, setMayAliasLock, mapLockDropInst[LI.first], mapGlobalCallSite);
+                timePhase(Stats.TimeTrack, [&]() {
+                    if (Limits.startLock(LI.first)) {
+                        trackLockInst(LI.first, LG, *mapLockDropInst[LI.first], MI, CG, LS, Group, CFGs, Blocks, Walk, Limits, Stats, Sink);
+                        Limits.finishLock(Sink, Stats);
+                    }
+                });
                 // break;
                 // }
             }
@@ -1143,42 +2039,27 @@ namespace detector {
 #endif  // LOCKAPI
 #ifdef STDMUTEX
 {
-        std::map<Function *, std::map<Type *, std::map<Instruction *, LockInfo>>> mapIntraProcLockInfo;
-        std::unordered_map<MutexSource, std::map<Instruction *, LockInfo>, MutexSourceHasher> mapInterProcLockInfo;
-        std::map<Instruction *, std::set<Instruction *>> mapLockDropInst;
-        for (auto &CallerCallSites : mapStdLock) {
-            for (auto &CallInstCallee : CallerCallSites.second) {
-                // errs() << "Caller: " << CallerCallSites.first->getName() << "\n";
-                // errs() << "Callee: " << CallInstCallee.second->getName() << "\n";
-                LockInfo LI;
-                parseStdLockWrite(CallInstCallee.first, LI);
-                MutexSource MS;
-                bool IsField = traceMutexSource(LI.LockValue, MS);
-                if (!IsField) {
-                    Function *F = LI.LockInst->getFunction();
-                    if (mapIntraProcLockInfo.find(F) == mapIntraProcLockInfo.end()) {
-                        mapIntraProcLockInfo[F] = std::map<Type *, std::map<Instruction *, LockInfo>>();
-                    }
-                    Type *LockType = LI.LockValue->getType();
-                    if (mapIntraProcLockInfo[F].find(LockType) == mapIntraProcLockInfo[F].end()) {
-                        mapIntraProcLockInfo[F][LockType] = std::map<Instruction *, LockInfo>();
-                    }
-                    mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
-                } else {
-                    if (mapInterProcLockInfo.find(MS) == mapInterProcLockInfo.end()) {
-                        mapInterProcLockInfo[MS] = std::map<Instruction *, LockInfo>();
-                    }
-                    mapInterProcLockInfo[MS][LI.LockInst] = LI;
-                }
-                std::set<Instruction *> setDropInst;
-                traceResult(LI, setDropInst, M.getDataLayout());
-                //errs() << "setDropInst\n";
-                //for (Instruction *DI : setDropInst) {
-                //    DI->print(errs());
-                //    errs() << "\n";
-                //}
-                mapLockDropInst[LI.LockInst] = setDropInst;
+        IntraProcLockMap mapIntraProcLockInfo;
+        MutexSourceLockMap mapInterProcLockInfo;
+        DenseMap<Instruction *, const DropSet *> mapLockDropInst;
+        for (unsigned SiteIdx : vecStdLock) {
+            if (!vecSites[SiteIdx].LockValue) {
+                continue;
+            }
+            LockInfo LI(vecSites[SiteIdx]);
+            unsigned SourceID;
+            bool IsField = timePhase(Stats.TimeMutexSource, [&]() { return Sources.getSource(LI.LockValue, SourceID); });
+            if (Diff && !Diff->isDirty(getGroupKey(Sources, IsField, SourceID, *LI.LockInst->getFunction()))) {
+                continue;
             }
+            if (!IsField) {
+                unsigned F = MI.getFuncIdx(LI.LockInst->getFunction());
+                Type *LockType = LI.LockValue->getType();
+                mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
+            } else {
+                mapInterProcLockInfo[SourceID][LI.LockInst] = LI;
+            }
+            mapLockDropInst[LI.LockInst] = timePhase(Stats.TimeDropTrace, [&]() { return &Info.getGuardDrops(SiteIdx); });
         }
 
         // for (auto &FTLIS : mapIntraProcLockInfo) {
@@ -1196,7 +2077,7 @@ namespace detector {
         // for (auto &MSLIS : mapInterProcLockInfo) {
         //     if (MSLIS.second.size() > 1) {
         //         errs() << "Set of Aliased Locks:\n";
-        //         MSLIS.first.print(errs());
+        //         Sources.get(MSLIS.first).print(errs());
         //         for (auto &LI : MSLIS.second) {
         //             printDebugInfo(LI.second.LockInst);
         //         }
@@ -1223,49 +2104,53 @@ namespace detector {
         // }
 //#ifdef INTRA
         for (auto &FTLIS : mapIntraProcLockInfo) {
+            // AA is fetched once per function and only if it has a group.
+            AliasAnalysis *AA = nullptr;
             for (auto &TLIS : FTLIS.second) {
                 if (TLIS.second.size() <= 1) {
                     continue;
                 }
+                AliasClasses AC;
+                {
+                    PhaseTimer AliasTimer(Stats.TimeAlias);
+                    if (!AA) {
+                        AA = &GetAA(*MI.getFunc(FTLIS.first));
+                    }
+                    partitionMustAlias(TLIS.second, *AA, Stats, AC);
+                }
+                // Lock order is kept, so reports come out as before. A site
+                // alone in its class has nothing to double lock with.
                 for (auto &LI : TLIS.second) {
-                //errs() << "LockInst:";
-                //LI.first->print(errs());
-                //errs() << "\n";
-                //errs() << "DropInst:\n";
-                //for (Instruction *DI : mapLockDropInst[LI.first]) {
-                //    DI->print(errs());
-                //    errs() << "\n";
-                //}
-                   Function *MyFunc = FTLIS.first;
-                   AliasAnalysis &AA = getAnalysis<AAResultsWrapperPass>(*MyFunc).getAAResults();
-                   std::set<Instruction *> setMayAliasLock;
-                   for (auto &LI2 : TLIS.second) {
-                      if (LI.first == LI2.first) {
-                          continue;
-                      }
-                      if (AA.alias(LI.first, LI2.first) == AliasResult::MustAlias) {
-                          setMayAliasLock.insert(LI2.first);
-                      }
+                   const LockSiteSet &setMayAliasLock = AC.vecClasses[AC.mapClassIdx[LI.first]];
+                   if (setMayAliasLock.size() <= 1) {
+                       continue;
                    }
-                   trackLockInstLocal(LI.first, setMayAliasLock, mapLockDropInst[LI.first]);
+                   timePhase(Stats.TimeTrack, [&]() {
+                       if (Limits.startLock(LI.first)) {
+                           trackLockInstLocal(LI.first, setMayAliasLock, *mapLockDropInst[LI.first], MI, LAC, CFGs, Blocks, Limits, Stats, Sink);
+                           Limits.finishLock(Sink, Stats);
+                       }
+                   });
                 }
             }
         }
 //#endif // INTRA
 //#ifdef INTER
+        LockSummaries LS;
+        countLockGroups(mapIntraProcLockInfo, mapInterProcLockInfo, Stats);
+        timePhase(Stats.TimeSummaries, [&]() { computeLockSummaries(mapInterProcLockInfo, MI, CG, LS); });
         for (auto &MSLIS : mapInterProcLockInfo) {
             if (MSLIS.second.size() <= 1) {
                 continue;
             }
+            unsigned Group = LS.mapGroupIdx[MSLIS.first];
             // errs() << "Set of Aliased Locks:\n";
-            // MSLIS.first.print(errs());
+            // Sources.get(MSLIS.first).print(errs());
             // for (auto &LI : MSLIS.second) {
             //     printDebugInfo(LI.second.LockInst);
             // }
-            std::set<Instruction *> setMayAliasLock;
-            for (auto &LI : MSLIS.second) {
-                setMayAliasLock.insert(LI.first);
-            }
+            LockGroup LG;
+            buildLockGroup(MSLIS.second, MI, CG, LS, Group, LG);
             for (auto &LI : MSLIS.second) {
                 // if (LI.first->getFunction()->getName() != "_ZN12ethcore_sync10light_sync18LightSync$LT$L$GT$13maintain_sync17h404bd375d3a82a04E") {
                 //     continue;
@@ -1278,7 +2163,12 @@ namespace detector {
                 //    DI->print(errs());
                 //    errs() << "\n";
                 //}
-                trackLockInst(LI.first, setMayAliasLock, mapLockDropInst[LI.first], mapGlobalCallSite);
+                timePhase(Stats.TimeTrack, [&]() {
+                    if (Limits.startLock(LI.first)) {
+                        trackLockInst(LI.first, LG, *mapLockDropInst[LI.first], MI, CG, LS, Group, CFGs, Blocks, Walk, Limits, Stats, Sink);
+                        Limits.finishLock(Sink, Stats);
+                    }
+                });
                 // break;
                 // }
             }
@@ -1289,76 +2179,51 @@ namespace detector {
 
 #ifdef STDRWLOCK
 {
-        std::map<Function *, std::map<Type *, std::map<Instruction *, LockInfo>>> mapIntraProcLockInfo;
-        std::unordered_map<MutexSource, std::map<Instruction *, LockInfo>, MutexSourceHasher> mapInterProcLockInfo;
-        std::map<Instruction *, std::set<Instruction *>> mapLockDropInst;
-        //for (auto &CallerCallSites : mapStdRead) {
-        //    for (auto &CallInstCallee : CallerCallSites.second) {
-        //        // errs() << "Caller: " << CallerCallSites.first->getName() << "\n";
-        //        // errs() << "Callee: " << CallInstCallee.second->getName() << "\n";
-        //        LockInfo LI;
-        //        parseStdRead(CallInstCallee.first, LI);
-        //        MutexSource MS;
-        //        bool IsField = traceMutexSource(LI.LockValue, MS);
-        //        if (!IsField) {
-        //            Function *F = LI.LockInst->getFunction();
-        //            if (mapIntraProcLockInfo.find(F) == mapIntraProcLockInfo.end()) {
-        //                mapIntraProcLockInfo[F] = std::map<Type *, std::map<Instruction *, LockInfo>>();
-        //            }
-        //            Type *LockType = LI.LockValue->getType();
-        //            if (mapIntraProcLockInfo[F].find(LockType) == mapIntraProcLockInfo[F].end()) {
-        //                mapIntraProcLockInfo[F][LockType] = std::map<Instruction *, LockInfo>();
-        //            }
-        //            mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
-        //        } else {
-        //            if (mapInterProcLockInfo.find(MS) == mapInterProcLockInfo.end()) {
-        //                mapInterProcLockInfo[MS] = std::map<Instruction *, LockInfo>();
-        //            }
-        //            mapInterProcLockInfo[MS][LI.LockInst] = LI;
+        IntraProcLockMap mapIntraProcLockInfo;
+        MutexSourceLockMap mapInterProcLockInfo;
+        DenseMap<Instruction *, const DropSet *> mapLockDropInst;
+        //for (unsigned SiteIdx : vecStdRead) {
+        //    LockInfo LI(vecSites[SiteIdx]);
+        //    unsigned SourceID;
+        //    bool IsField = Sources.getSource(LI.LockValue, SourceID);
+        //    if (!IsField) {
+        //        Function *F = LI.LockInst->getFunction();
+        //        if (mapIntraProcLockInfo.find(F) == mapIntraProcLockInfo.end()) {
+        //            mapIntraProcLockInfo[F] = std::map<Type *, std::map<Instruction *, LockInfo>>();
         //        }
-        //        std::set<Instruction *> setDropInst;
-        //        traceResult(LI, setDropInst, M.getDataLayout());
-        //        mapLockDropInst[LI.LockInst] = setDropInst;
+        //        Type *LockType = LI.LockValue->getType();
+        //        if (mapIntraProcLockInfo[F].find(LockType) == mapIntraProcLockInfo[F].end()) {
+        //            mapIntraProcLockInfo[F][LockType] = std::map<Instruction *, LockInfo>();
+        //        }
+        //        mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
+        //    } else {
+        //        mapInterProcLockInfo[SourceID][LI.LockInst] = LI;
         //    }
+        //    mapLockDropInst[LI.LockInst] = &Info.getGuardDrops(SiteIdx);
         //}
 
-        for (auto &CallerCallSites : mapStdWrite) {
-            for (auto &CallInstCallee : CallerCallSites.second) {
-                // errs() << "Caller: " << CallerCallSites.first->getName() << "\n";
-                // errs() << "Callee: " << CallInstCallee.second->getName() << "\n";
-                LockInfo LI;
-                parseStdLockWrite(CallInstCallee.first, LI);
-                MutexSource MS;
-                bool IsField = traceMutexSource(LI.LockValue, MS);
-                if (!IsField) {
-                    Function *F = LI.LockInst->getFunction();
-                    if (mapIntraProcLockInfo.find(F) == mapIntraProcLockInfo.end()) {
-                        mapIntraProcLockInfo[F] = std::map<Type *, std::map<Instruction *, LockInfo>>();
-                    }
-                    Type *LockType = LI.LockValue->getType();
-                    if (mapIntraProcLockInfo[F].find(LockType) == mapIntraProcLockInfo[F].end()) {
-                        mapIntraProcLockInfo[F][LockType] = std::map<Instruction *, LockInfo>();
-                    }
-                    mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
-                } else {
-                    if (mapInterProcLockInfo.find(MS) == mapInterProcLockInfo.end()) {
-                        mapInterProcLockInfo[MS] = std::map<Instruction *, LockInfo>();
-                    }
-                    mapInterProcLockInfo[MS][LI.LockInst] = LI;
-                }
-                //errs() << "LockInst:\n";
-                //errs() << LI.LockInst->getParent()->getName() << ": ";
-                //LI.LockInst->print(errs());
-                //errs() << "\n";
-                std::set<Instruction *> setDropInst;
-                traceResult(LI, setDropInst, M.getDataLayout());
-                //for (Instruction *DI : setDropInst) {
-                //    errs() << DI->getParent()->getName() << ": ";
-                //    DI->print(errs());
-                //    errs() << "\n";
-                //}
-                mapLockDropInst[LI.LockInst] = setDropInst;
+        for (unsigned SiteIdx : vecStdWrite) {
+            if (!vecSites[SiteIdx].LockValue) {
+                continue;
+            }
+            LockInfo LI(vecSites[SiteIdx]);
+            unsigned SourceID;
+            bool IsField = timePhase(Stats.TimeMutexSource, [&]() { return Sources.getSource(LI.LockValue, SourceID); });
+            if (Diff && !Diff->isDirty(getGroupKey(Sources, IsField, SourceID, *LI.LockInst->getFunction()))) {
+                continue;
+            }
+            if (!IsField) {
+                unsigned F = MI.getFuncIdx(LI.LockInst->getFunction());
+                Type *LockType = LI.LockValue->getType();
+                mapIntraProcLockInfo[F][LockType][LI.LockInst] = LI;
+            } else {
+                mapInterProcLockInfo[SourceID][LI.LockInst] = LI;
             }
+            //errs() << "LockInst:\n";
+            //errs() << LI.LockInst->getParent()->getName() << ": ";
+            //LI.LockInst->print(errs());
+            //errs() << "\n";
+            mapLockDropInst[LI.LockInst] = timePhase(Stats.TimeDropTrace, [&]() { return &Info.getGuardDrops(SiteIdx); });
         }
 
         // for (auto &FTLIS : mapIntraProcLockInfo) {
@@ -1376,7 +2241,7 @@ namespace detector {
         // for (auto &MSLIS : mapInterProcLockInfo) {
         //     if (MSLIS.second.size() > 1) {
         //         errs() << "Set of Aliased Locks:\n";
-        //         MSLIS.first.print(errs());
+        //         Sources.get(MSLIS.first).print(errs());
         //         for (auto &LI : MSLIS.second) {
         //             printDebugInfo(LI.second.LockInst);
         //         }
@@ -1407,30 +2272,37 @@ namespace detector {
                 if (TLIS.second.size() <= 1) {
                     continue;
                 }
-                std::set<Instruction *> setMayAliasLock;
+                LockSiteSet setMayAliasLock;
                 for (auto &LI : TLIS.second) {
                     setMayAliasLock.insert(LI.first);
                 }
                 for (auto &LI : TLIS.second) {
-                   trackLockInstLocal(LI.first, setMayAliasLock, mapLockDropInst[LI.first]);
+                   timePhase(Stats.TimeTrack, [&]() {
+                       if (Limits.startLock(LI.first)) {
+                           trackLockInstLocal(LI.first, setMayAliasLock, *mapLockDropInst[LI.first], MI, LAC, CFGs, Blocks, Limits, Stats, Sink);
+                           Limits.finishLock(Sink, Stats);
+                       }
+                   });
                 }
             }
         }
 #endif
 // #ifdef INTER
+        LockSummaries LS;
+        countLockGroups(mapIntraProcLockInfo, mapInterProcLockInfo, Stats);
+        timePhase(Stats.TimeSummaries, [&]() { computeLockSummaries(mapInterProcLockInfo, MI, CG, LS); });
         for (auto &MSLIS : mapInterProcLockInfo) {
             if (MSLIS.second.size() <= 1) {
                 continue;
             }
+            unsigned Group = LS.mapGroupIdx[MSLIS.first];
             // errs() << "Set of Aliased Locks:\n";
-            // MSLIS.first.print(errs());
+            // Sources.get(MSLIS.first).print(errs());
             // for (auto &LI : MSLIS.second) {
             //     printDebugInfo(LI.second.LockInst);
             // }
-            std::set<Instruction *> setMayAliasLock;
-            for (auto &LI : MSLIS.second) {
-                setMayAliasLock.insert(LI.first);
-            }
+            LockGroup LG;
+            buildLockGroup(MSLIS.second, MI, CG, LS, Group, LG);
             for (auto &LI : MSLIS.second) {
                 
                 // if (LI.first->getFunction()->getName() != "_ZN12ethcore_sync10light_sync18LightSync$LT$L$GT$13maintain_sync17h404bd375d3a82a04E") {
@@ -1444,7 +2316,12 @@ namespace detector {
                 //     DI->print(errs());
                 //     errs() << "\n";
                 // }
-                trackLockInst(LI.first, setMayAliasLock, mapLockDropInst[LI.first], mapGlobalCallSite);
+                timePhase(Stats.TimeTrack, [&]() {
+                    if (Limits.startLock(LI.first)) {
+                        trackLockInst(LI.first, LG, *mapLockDropInst[LI.first], MI, CG, LS, Group, CFGs, Blocks, Walk, Limits, Stats, Sink);
+                        Limits.finishLock(Sink, Stats);
+                    }
+                });
                 // break;
                 // }
             }
@@ -1452,9 +2329,154 @@ namespace detector {
 
 }
 #endif // STDRWLOCK
+        // Lock order cycles span many groups and are not diffed.
+        if (DetectLockOrder && !Diff) {
+            detectLockOrder(Info, MI, CG, CFGs, Blocks, Sources, Stats, Sink);
+        }
+        Limits.finishModule(Sink, Stats);
+        if (Diff && !Diff->IsBase) {
+            Sink.setCollector(nullptr);
+            std::vector<const DoubleLockFinding *> vecAdded;
+            std::vector<const DoubleLockFinding *> vecRemoved;
+            diffFindings(Diff->vecBaseFindings, Diff->vecFindings, vecAdded, vecRemoved);
+            for (const DoubleLockFinding *Finding : vecAdded) {
+                Sink.add(*Finding, DiffState::Added);
+            }
+            for (const DoubleLockFinding *Finding : vecRemoved) {
+                Sink.add(*Finding, DiffState::Removed);
+            }
+        }
+        Sink.finish();
+
+        if (Diff && Diff->IsBase) {
+            // Only the run on the new module is a scan of its own.
+            return Limits.hitTimeLimit();
+        }
+        Stats.NumFindings = Sink.getNumFindings();
+        Stats.NumTruncatedTraces = Info.getNumTruncatedTraces();
+        NumLockSites += Stats.NumLockAPI + Stats.NumStdMutex + Stats.NumStdRead + Stats.NumStdWrite;
+        NumAliasedGroups += Stats.NumInterGroups + Stats.NumIntraGroups;
+        NumAliasQueries += Stats.NumAliasQueries;
+        NumDoubleLocks += Stats.NumFindings;
+        if (!StatsFile.empty()) {
+            writeStats(M, Stats);
+        }
+        OS << ReportOS.str();
+        OS.flush();
+        return Limits.hitTimeLimit();
+    }
+
+    // The scan of the base module of a differential scan. Its findings are
+    // kept in Run.
+    static void scanDiffBase(Module &Base, GetLockSitesFn GetLockSites, GetAAFn GetAA, DiffRun &Run) {
+        addDirtyGroups(GetLockSites(getLockAPIMatcher(), DetectThreads, DropTraceBudget, IndirectFanOut), Run);
+        Run.BaseTimeLimited = detectModule(Base, GetLockSites, GetAA, nulls(), false, &Run);
+    }
+
+    namespace {
+        // The detector on the base module of a differential scan.
+        struct DiffBaseDetector : public RustDoubleLockDetector {
+            explicit DiffBaseDetector(DiffRun &Run) : Run(Run) {}
+
+            bool runOnModule(Module &M) override {
+                auto GetLockSites = [this](const LockAPIMatcher &Matcher, unsigned NumThreads, unsigned Budget,
+                                           unsigned FanOut) -> LockSiteInfo & {
+                    return getAnalysis<LockSiteAnalysis>().getLockSites(Matcher, NumThreads, Budget, FanOut);
+                };
+                auto GetAA = [this](Function &F) -> AliasAnalysis & {
+                    return getAnalysis<AAResultsWrapperPass>(F).getAAResults();
+                };
+                scanDiffBase(M, GetLockSites, GetAA, Run);
+                return false;
+            }
+
+            DiffRun &Run;
+        };
+    }
+
+    // Scans the base module of a differential scan with the pass manager
+    // that runs the detector.
+    typedef function_ref<void(Module &, DiffRun &)> ScanDiffBaseFn;
+
+    // detectModule(), or with -detect-diff-base the differential scan of M
+    // against the base module. The dirty groups of both modules are known
+    // before either is tracked.
+    static bool runDetection(Module &M, GetLockSitesFn GetLockSites, GetAAFn GetAA, ScanDiffBaseFn ScanBase,
+                             raw_ostream &OS, bool SarifFragment) {
+        if (DiffBase.empty()) {
+            return detectModule(M, GetLockSites, GetAA, OS, SarifFragment);
+        }
+        LLVMContext BaseContext;
+        SMDiagnostic Err;
+        std::unique_ptr<Module> Base = parseIRFile(DiffBase, Err, BaseContext);
+        if (!Base) {
+            // Every finding is then new, rather than none.
+            errs() << "Cannot load diff base: " << DiffBase << ": " << Err.getMessage() << "\n";
+            return detectModule(M, GetLockSites, GetAA, OS, SarifFragment);
+        }
+
+        DiffRun Run;
+        getChangedFunctions(*Base, M, Run.setChanged);
+        addDirtyGroups(GetLockSites(getLockAPIMatcher(), DetectThreads, DropTraceBudget, IndirectFanOut), Run);
+        ScanBase(*Base, Run);
+        Run.IsBase = false;
+        bool TimeLimited = detectModule(M, GetLockSites, GetAA, OS, SarifFragment, &Run);
+        return TimeLimited || Run.BaseTimeLimited;
+    }
+
+    bool RustDoubleLockDetector::runOnModule(Module &M) {
+        this->pModule = &M;
+        auto GetLockSites = [this](const LockAPIMatcher &Matcher, unsigned NumThreads, unsigned Budget,
+                                   unsigned FanOut) -> LockSiteInfo & {
+            return getAnalysis<LockSiteAnalysis>().getLockSites(Matcher, NumThreads, Budget, FanOut);
+        };
+        auto GetAA = [this](Function &F) -> AliasAnalysis & {
+            return getAnalysis<AAResultsWrapperPass>(F).getAAResults();
+        };
+        auto ScanBase = [](Module &Base, DiffRun &Run) {
+            legacy::PassManager PM;
+            PM.add(new DiffBaseDetector(Run));
+            PM.run(Base);
+        };
+        this->TimeLimited = runDetection(M, GetLockSites, GetAA, ScanBase, *this->pReportOS, this->SarifFragment);
         return false;
     }
 
+    PreservedAnalyses RustDoubleLockDetectorPass::run(Module &M, ModuleAnalysisManager &MAM) {
+        // AA comes from the function analysis manager through the proxy, so
+        // it is computed once per function and shared with the pipeline.
+        FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        LockSiteResult &Sites = MAM.getResult<LockSiteModuleAnalysis>(M);
+        auto GetLockSites = [&Sites](const LockAPIMatcher &Matcher, unsigned NumThreads, unsigned Budget,
+                                     unsigned FanOut) -> LockSiteInfo & {
+            return Sites.getLockSites(Matcher, NumThreads, Budget, FanOut);
+        };
+        auto GetAA = [&FAM](Function &F) -> AliasAnalysis & {
+            return FAM.getResult<AAManager>(F);
+        };
+        // The base module gets analysis managers of its own, set up like
+        // those of the pipeline.
+        auto ScanBase = [this](Module &Base, DiffRun &Run) {
+            LoopAnalysisManager BaseLAM;
+            FunctionAnalysisManager BaseFAM;
+            CGSCCAnalysisManager BaseCGAM;
+            ModuleAnalysisManager BaseMAM;
+            RegisterAnalyses(BaseLAM, BaseFAM, BaseCGAM, BaseMAM);
+            FunctionAnalysisManager &FAM = BaseMAM.getResult<FunctionAnalysisManagerModuleProxy>(Base).getManager();
+            LockSiteResult &Sites = BaseMAM.getResult<LockSiteModuleAnalysis>(Base);
+            auto GetLockSites = [&Sites](const LockAPIMatcher &Matcher, unsigned NumThreads, unsigned Budget,
+                                         unsigned FanOut) -> LockSiteInfo & {
+                return Sites.getLockSites(Matcher, NumThreads, Budget, FanOut);
+            };
+            auto GetAA = [&FAM](Function &F) -> AliasAnalysis & {
+                return FAM.getResult<AAManager>(F);
+            };
+            scanDiffBase(Base, GetLockSites, GetAA, Run);
+        };
+        runDetection(M, GetLockSites, GetAA, ScanBase, OS, false);
+        return PreservedAnalyses::all();
+    }
+
 }  // namespace detector
 
 static RegisterPass<detector::RustDoubleLockDetector> X(
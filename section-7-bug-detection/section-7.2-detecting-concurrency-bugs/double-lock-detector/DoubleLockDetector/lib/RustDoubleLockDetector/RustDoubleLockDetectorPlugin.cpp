@@ -0,0 +1,36 @@
+// Entry point for opt -load-pass-plugin. Only the opt plugin has it; the
+// driver links the pass without it.
+
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+#include "Common/LockSiteAnalysis.h"
+#include "RustDoubleLockDetector/RustDoubleLockDetector.h"
+
+using namespace llvm;
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "RustDoubleLockDetector", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) {
+                PB.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &MAM) {
+                    MAM.registerPass([] { return LockSiteModuleAnalysis(); });
+                });
+                PB.registerPipelineParsingCallback(
+                        [&PB](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+                            if (Name != "detect-double-lock") {
+                                return false;
+                            }
+                            // The PassBuilder of opt outlives the pipeline.
+                            auto RegisterAnalyses = [&PB](LoopAnalysisManager &LAM, FunctionAnalysisManager &FAM,
+                                                          CGSCCAnalysisManager &CGAM, ModuleAnalysisManager &MAM) {
+                                PB.registerModuleAnalyses(MAM);
+                                PB.registerCGSCCAnalyses(CGAM);
+                                PB.registerFunctionAnalyses(FAM);
+                                PB.registerLoopAnalyses(LAM);
+                                PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+                            };
+                            MPM.addPass(detector::RustDoubleLockDetectorPass(RegisterAnalyses));
+                            return true;
+                        });
+            }};
+}
@@ -0,0 +1,408 @@
+// Standalone driver for RustDoubleLockDetector.
+//
+// Runs the detector over many bitcode files in one process. Each worker
+// thread owns its LLVMContext and analyses one module at a time into a
+// private buffer; buffers are written out in input order once all workers
+// are done, so the merged log does not depend on scheduling.
+//
+// With -cache-dir, the report of every module is stored under a hash of
+// its bitcode and the detector configuration, and reused as long as
+// neither changes.
+//
+// With -whole-program, all inputs are linked into one module first (see
+// WholeProgram.h), so lock chains that cross crates are found as well.
+//
+// With -serve, the driver stays resident and analyses the modules that
+// clients send over a local socket (see Server.h).
+
+#include "RustDoubleLockDetector/RustDoubleLockDetector.h"
+#include "Server.h"
+#include "WholeProgram.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> InputPaths(
+        cl::Positional,
+        cl::desc("<bitcode files or directories of *.m2r.bc>"),
+        cl::ZeroOrMore);
+
+static cl::opt<unsigned> NumJobs(
+        "j",
+        cl::desc("Number of worker threads (default: hardware concurrency)"),
+        cl::init(0));
+
+static cl::opt<std::string> OutputFilename(
+        "o",
+        cl::desc("Merged report file (default: stdout)"),
+        cl::value_desc("filename"),
+        cl::init("-"));
+
+static cl::opt<std::string> CacheDir(
+        "cache-dir",
+        cl::desc("Reuse the reports of unchanged modules from this directory"),
+        cl::value_desc("directory"));
+
+static cl::opt<bool> WholeProgram(
+        "whole-program",
+        cl::desc("Link all inputs into one module, materializing only lock-relevant functions"),
+        cl::init(false));
+
+static cl::opt<std::string> ServeSocket(
+        "serve",
+        cl::desc("Stay resident and analyse the modules sent to this Unix domain socket"),
+        cl::value_desc("socket"));
+
+static cl::opt<unsigned> ServeMemoEntries(
+        "serve-memo-entries",
+        cl::desc("Number of reports a server keeps in memory (default 4096, 0 for none)"),
+        cl::init(4096));
+
+// Orders "a9.m2r.bc" before "a10.m2r.bc", like `ls -v` in run.sh.
+static bool versionLess(const std::string &L, const std::string &R) {
+    std::size_t i = 0, j = 0;
+    while (i < L.size() && j < R.size()) {
+        if (isdigit(L[i]) && isdigit(R[j])) {
+            std::size_t ei = i, ej = j;
+            while (ei < L.size() && isdigit(L[ei])) {
+                ++ei;
+            }
+            while (ej < R.size() && isdigit(R[ej])) {
+                ++ej;
+            }
+            StringRef NL = StringRef(L).slice(i, ei).ltrim('0');
+            StringRef NR = StringRef(R).slice(j, ej).ltrim('0');
+            if (NL.size() != NR.size()) {
+                return NL.size() < NR.size();
+            }
+            if (NL != NR) {
+                return NL < NR;
+            }
+            i = ei;
+            j = ej;
+        } else {
+            if (L[i] != R[j]) {
+                return L[i] < R[j];
+            }
+            ++i;
+            ++j;
+        }
+    }
+    return L.size() - i < R.size() - j;
+}
+
+static bool collectInputs(std::vector<std::string> &Inputs) {
+    for (const std::string &Path : InputPaths) {
+        if (!sys::fs::is_directory(Path)) {
+            Inputs.push_back(Path);
+            continue;
+        }
+        std::vector<std::string> DirInputs;
+        std::error_code EC;
+        for (sys::fs::directory_iterator it(Path, EC), end; it != end && !EC; it.increment(EC)) {
+            if (StringRef(it->path()).endswith(".m2r.bc")) {
+                DirInputs.push_back(it->path());
+            }
+        }
+        if (EC) {
+            errs() << "Cannot read directory " << Path << ": " << EC.message() << "\n";
+            return false;
+        }
+        std::sort(DirInputs.begin(), DirInputs.end(), versionLess);
+        Inputs.insert(Inputs.end(), DirInputs.begin(), DirInputs.end());
+    }
+    return true;
+}
+
+// The MD5 of the bitcode and the detector configuration, in hex. JSONL and
+// SARIF reports name the module, so for them the key includes ModuleName:
+// an identical bitcode at another path gets its own report.
+static std::string getCacheKey(ArrayRef<StringRef> Bitcodes, StringRef ModuleName) {
+    MD5 Hash;
+    if (detector::RustDoubleLockDetector::getReportFormat() != detector::ReportFormat::Text) {
+        uint64_t Size = ModuleName.size();
+        Hash.update(makeArrayRef(reinterpret_cast<const uint8_t *>(&Size), sizeof(Size)));
+        Hash.update(ModuleName);
+    }
+    if (WholeProgram) {
+        Hash.update("whole-program");
+        for (StringRef Bitcode : Bitcodes) {
+            uint64_t Size = Bitcode.size();
+            Hash.update(makeArrayRef(reinterpret_cast<const uint8_t *>(&Size), sizeof(Size)));
+            Hash.update(Bitcode);
+        }
+    } else {
+        Hash.update(Bitcodes[0]);
+    }
+    detector::RustDoubleLockDetector::hashConfig(Hash);
+    MD5::MD5Result Digest;
+    Hash.final(Digest);
+    SmallString<32> Hex;
+    MD5::stringifyResult(Digest, Hex);
+    return std::string(Hex.str());
+}
+
+static std::string getCachePath(const std::string &Key) {
+    SmallString<128> CachePath(CacheDir);
+    sys::path::append(CachePath, Key + ".report");
+    return std::string(CachePath.str());
+}
+
+// Written to a temporary file first, so concurrent drivers sharing the
+// directory never see a partial report.
+static void writeCacheFile(const std::string &CachePath, StringRef Report) {
+    int FD;
+    SmallString<128> TmpPath;
+    std::error_code EC = sys::fs::createUniqueFile(CachePath + ".tmp-%%%%%%", FD, TmpPath);
+    if (!EC) {
+        raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << Report;
+        OS.close();
+        if (OS.has_error()) {
+            EC = std::make_error_code(std::errc::io_error);
+            OS.clear_error();
+        } else {
+            EC = sys::fs::rename(TmpPath, CachePath);
+        }
+        if (EC) {
+            sys::fs::remove(TmpPath);
+        }
+    }
+    if (EC) {
+        errs() << "Cannot write " << CachePath << ": " << EC.message() << "\n";
+    }
+}
+
+static void runDetector(Module &M, ModuleResult &Result) {
+    raw_string_ostream OS(Result.Report);
+    detector::RustDoubleLockDetector *Detector = new detector::RustDoubleLockDetector();
+    Detector->setReportStream(OS, /*SarifFragment=*/true);
+
+    legacy::PassManager PM;
+    PM.add(Detector);
+    PM.run(M);
+    Result.TimeLimited = Detector->hitTimeLimit();
+    OS.flush();
+}
+
+// Memo is the in-memory cache of a server, if any.
+static void analyseModule(const std::string &Path, ModuleResult &Result, ReportMemo *Memo = nullptr) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr = MemoryBuffer::getFile(Path);
+    if (!BufOrErr) {
+        Result.Error = Path + ": " + BufOrErr.getError().message() + "\n";
+        return;
+    }
+
+    std::string Key;
+    if (Memo || !CacheDir.empty()) {
+        Key = getCacheKey((*BufOrErr)->getBuffer(), (*BufOrErr)->getBufferIdentifier());
+    }
+    if (Memo && Memo->lookup(Key, Result.Report)) {
+        Result.MemoryHit = true;
+        return;
+    }
+    std::string CachePath;
+    if (!CacheDir.empty()) {
+        CachePath = getCachePath(Key);
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Cached = MemoryBuffer::getFile(CachePath);
+        if (Cached) {
+            Result.Report = (*Cached)->getBuffer().str();
+            Result.CacheHit = true;
+            if (Memo) {
+                Memo->insert(Key, Result.Report);
+            }
+            return;
+        }
+    }
+
+    LLVMContext Context;
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M = parseIR((*BufOrErr)->getMemBufferRef(), Err, Context);
+    if (!M) {
+        raw_string_ostream ES(Result.Error);
+        Err.print("rust-double-lock-driver", ES);
+        return;
+    }
+
+    runDetector(*M, Result);
+    if (Result.TimeLimited) {
+        return;
+    }
+    if (!CachePath.empty()) {
+        writeCacheFile(CachePath, Result.Report);
+    }
+    if (Memo) {
+        Memo->insert(Key, Result.Report);
+    }
+}
+
+// The scan of the inputs runs on Jobs threads; the link and the detector
+// run on one.
+static void analyseWholeProgram(const std::vector<std::string> &Inputs, unsigned Jobs, ModuleResult &Result) {
+    std::vector<std::unique_ptr<MemoryBuffer>> vecBuffers;
+    std::vector<StringRef> vecBitcodes;
+    for (const std::string &Path : Inputs) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr = MemoryBuffer::getFile(Path);
+        if (!BufOrErr) {
+            Result.Error += Path + ": " + BufOrErr.getError().message() + "\n";
+            continue;
+        }
+        vecBitcodes.push_back((*BufOrErr)->getBuffer());
+        vecBuffers.push_back(std::move(*BufOrErr));
+    }
+    if (!Result.Error.empty()) {
+        return;
+    }
+
+    StringRef Name = InputPaths.size() == 1 ? StringRef(InputPaths[0]) : StringRef("whole-program");
+    std::string CachePath;
+    if (!CacheDir.empty()) {
+        CachePath = getCachePath(getCacheKey(vecBitcodes, Name));
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Cached = MemoryBuffer::getFile(CachePath);
+        if (Cached) {
+            Result.Report = (*Cached)->getBuffer().str();
+            Result.CacheHit = true;
+            return;
+        }
+    }
+
+    LLVMContext Context;
+    WholeProgramStats Stats;
+    std::unique_ptr<Module> M = linkWholeProgram(Name, Inputs, vecBuffers,
+                                                 detector::RustDoubleLockDetector::getLockAPIMatcher(),
+                                                 Jobs, Context, Stats, Result.Error);
+    if (!M) {
+        return;
+    }
+    errs() << "rust-double-lock-driver: linked " << Inputs.size() << " module(s), materialized "
+           << Stats.NumMaterialized << " of " << Stats.NumFuncs << " function bodies\n";
+
+    runDetector(*M, Result);
+    if (!CachePath.empty() && !Result.TimeLimited) {
+        writeCacheFile(CachePath, Result.Report);
+    }
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Rust double-lock detector driver\n");
+
+    bool Serve = !ServeSocket.empty();
+    if (Serve && (WholeProgram || !InputPaths.empty())) {
+        errs() << "-serve takes its inputs from the socket and cannot be combined with -whole-program\n";
+        return 1;
+    }
+    if (!Serve && InputPaths.empty()) {
+        errs() << "No inputs; give bitcode files or directories, or -serve\n";
+        return 1;
+    }
+
+    std::vector<std::string> Inputs;
+    if (!collectInputs(Inputs)) {
+        return 1;
+    }
+
+    if (!CacheDir.empty()) {
+        if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+            errs() << "Cannot create " << CacheDir << ": " << EC.message() << "\n";
+            return 1;
+        }
+    }
+
+    unsigned Jobs = NumJobs;
+    if (Jobs == 0) {
+        Jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (Serve) {
+        ReportMemo Memo(ServeMemoEntries);
+        return runServer(ServeSocket, Jobs, [&Memo](const std::string &Path, ModuleResult &Result) {
+            analyseModule(Path, Result, &Memo);
+        });
+    }
+    Jobs = std::min<std::size_t>(Jobs, std::max<std::size_t>(1, Inputs.size()));
+
+    std::vector<ModuleResult> Results(WholeProgram ? 1 : Inputs.size());
+    if (WholeProgram) {
+        analyseWholeProgram(Inputs, Jobs, Results[0]);
+    } else {
+        std::atomic<std::size_t> NextInput(0);
+        std::vector<std::thread> Workers;
+        for (unsigned i = 0; i < Jobs; ++i) {
+            Workers.emplace_back([&]() {
+                for (std::size_t idx = NextInput++; idx < Inputs.size(); idx = NextInput++) {
+                    analyseModule(Inputs[idx], Results[idx]);
+                }
+            });
+        }
+        for (std::thread &T : Workers) {
+            T.join();
+        }
+    }
+
+    std::error_code EC;
+    raw_fd_ostream Out(OutputFilename, EC, sys::fs::OF_Text);
+    if (EC) {
+        errs() << "Cannot open " << OutputFilename << ": " << EC.message() << "\n";
+        return 1;
+    }
+
+    // Modules report SARIF results one per line; join them into one log.
+    bool Sarif = detector::RustDoubleLockDetector::getReportFormat() == detector::ReportFormat::SARIF;
+    bool FirstResult = true;
+    if (Sarif) {
+        detector::ReportSink::writeSarifHeader(Out);
+    }
+
+    int RetCode = 0;
+    std::size_t NumCacheHits = 0;
+    for (std::size_t i = 0; i < Results.size(); ++i) {
+        if (!Results[i].Error.empty()) {
+            errs() << Results[i].Error;
+            RetCode = 1;
+            continue;
+        }
+        NumCacheHits += Results[i].CacheHit;
+        if (!Sarif) {
+            Out << Results[i].Report;
+            continue;
+        }
+        SmallVector<StringRef, 16> Lines;
+        StringRef(Results[i].Report).split(Lines, '\n', -1, false);
+        for (StringRef Line : Lines) {
+            Out << (FirstResult ? "" : ",") << Line << '\n';
+            FirstResult = false;
+        }
+    }
+    if (Sarif) {
+        detector::ReportSink::writeSarifFooter(Out);
+    }
+    if (!CacheDir.empty()) {
+        errs() << "rust-double-lock-driver: " << NumCacheHits << " of " << Results.size()
+               << " module(s) reused from " << CacheDir << "\n";
+    }
+    return RetCode;
+}
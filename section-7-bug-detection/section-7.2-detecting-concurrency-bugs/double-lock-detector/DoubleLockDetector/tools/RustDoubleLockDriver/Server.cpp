@@ -0,0 +1,282 @@
+#include "Server.h"
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+// A request line longer than this closes the connection.
+static const std::size_t MaxRequestSize = 1 << 20;
+
+bool ReportMemo::lookup(const std::string &Key, std::string &Report) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = mapReports.find(Key);
+    if (It == mapReports.end()) {
+        return false;
+    }
+    Report = It->second;
+    return true;
+}
+
+void ReportMemo::insert(const std::string &Key, const std::string &Report) {
+    if (MaxEntries == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (!mapReports.insert(std::make_pair(Key, Report)).second) {
+        return;
+    }
+    queKeys.push_back(Key);
+    if (queKeys.size() > MaxEntries) {
+        mapReports.erase(queKeys.front());
+        queKeys.pop_front();
+    }
+}
+
+namespace {
+    // The listening socket, the connections waiting for a worker and the
+    // connections being served.
+    class ServerState {
+    public:
+        explicit ServerState(int ListenFD) : ListenFD(ListenFD) {}
+
+        void push(int FD) {
+            std::lock_guard<std::mutex> Guard(Lock);
+            if (Stopping) {
+                ::close(FD);
+                return;
+            }
+            queConns.push_back(FD);
+            Ready.notify_one();
+        }
+
+        // The next connection to serve, or -1 once the server stops.
+        int pop() {
+            std::unique_lock<std::mutex> Guard(Lock);
+            Ready.wait(Guard, [this]() { return Stopping || !queConns.empty(); });
+            if (Stopping) {
+                return -1;
+            }
+            int FD = queConns.front();
+            queConns.pop_front();
+            setActive.insert(FD);
+            return FD;
+        }
+
+        void finish(int FD) {
+            std::lock_guard<std::mutex> Guard(Lock);
+            setActive.erase(FD);
+            ::close(FD);
+        }
+
+        // Wakes up the accept loop and all workers. A worker answers the
+        // request it is on; reads of the connections then see their end.
+        void stop() {
+            std::lock_guard<std::mutex> Guard(Lock);
+            if (Stopping) {
+                return;
+            }
+            Stopping = true;
+            ::shutdown(ListenFD, SHUT_RDWR);
+            for (int FD : setActive) {
+                ::shutdown(FD, SHUT_RD);
+            }
+            for (int FD : queConns) {
+                ::close(FD);
+            }
+            queConns.clear();
+            Ready.notify_all();
+        }
+
+        bool isStopping() {
+            std::lock_guard<std::mutex> Guard(Lock);
+            return Stopping;
+        }
+
+    private:
+        int ListenFD;
+        std::mutex Lock;
+        std::condition_variable Ready;
+        bool Stopping = false;
+        std::deque<int> queConns;
+        DenseSet<int> setActive;
+    };
+}
+
+static bool writeAll(int FD, StringRef Data) {
+    while (!Data.empty()) {
+        ssize_t N = ::write(FD, Data.data(), Data.size());
+        if (N < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        Data = Data.drop_front(N);
+    }
+    return true;
+}
+
+// The answer to one request line. Sets Shutdown for a shutdown request.
+static json::Value answer(StringRef Line, AnalyseFn &Analyse, bool &Shutdown) {
+    Expected<json::Value> Request = json::parse(Line);
+    if (!Request) {
+        return json::Object{{"error", toString(Request.takeError())}};
+    }
+    const json::Object *Obj = Request->getAsObject();
+    if (!Obj) {
+        return json::Object{{"error", "request is not an object"}};
+    }
+    if (Optional<bool> Stop = Obj->getBoolean("shutdown")) {
+        Shutdown = *Stop;
+        return json::Object{{"shutdown", *Stop}};
+    }
+    Optional<StringRef> PathRef = Obj->getString("path");
+    if (!PathRef) {
+        return json::Object{{"error", "request has no \"path\""}};
+    }
+    // The answer outlives the request, which holds the path.
+    std::string Path = PathRef->str();
+
+    ModuleResult Result;
+    Analyse(Path, Result);
+    if (!Result.Error.empty()) {
+        return json::Object{{"path", Path}, {"error", Result.Error}};
+    }
+    const char *Cache = Result.MemoryHit ? "memory" : Result.CacheHit ? "disk" : "none";
+    // json::Value requires valid UTF-8; function names in a report need not be.
+    std::string Report = json::isUTF8(Result.Report) ? Result.Report : json::fixUTF8(Result.Report);
+    return json::Object{
+        {"path", Path},
+        {"report", std::move(Report)},
+        {"cache", Cache},
+        {"time_limited", Result.TimeLimited},
+    };
+}
+
+static void serveConnection(int FD, AnalyseFn &Analyse, ServerState &State) {
+    std::string Buffer;
+    char Chunk[4096];
+    while (true) {
+        std::size_t End = Buffer.find('\n');
+        if (End == std::string::npos) {
+            if (Buffer.size() > MaxRequestSize) {
+                return;
+            }
+            ssize_t N = ::read(FD, Chunk, sizeof(Chunk));
+            if (N < 0 && errno == EINTR) {
+                continue;
+            }
+            if (N <= 0) {
+                return;
+            }
+            Buffer.append(Chunk, N);
+            continue;
+        }
+        StringRef Line = StringRef(Buffer).take_front(End).trim();
+        if (!Line.empty()) {
+            bool Shutdown = false;
+            std::string Reply;
+            raw_string_ostream OS(Reply);
+            OS << answer(Line, Analyse, Shutdown) << '\n';
+            OS.flush();
+            if (!writeAll(FD, Reply)) {
+                return;
+            }
+            if (Shutdown) {
+                State.stop();
+            }
+        }
+        Buffer.erase(0, End + 1);
+        if (State.isStopping()) {
+            return;
+        }
+    }
+}
+
+int runServer(StringRef SocketPath, unsigned Jobs, AnalyseFn Analyse) {
+    sockaddr_un Addr;
+    std::memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+        errs() << "Socket path too long: " << SocketPath << "\n";
+        return 1;
+    }
+    std::memcpy(Addr.sun_path, SocketPath.data(), SocketPath.size());
+
+    // The socket of a server that did not shut down cleanly is in the way
+    // (sys::fs::remove does not remove sockets);
+    // that of a running one is not taken over.
+    sys::fs::file_status Status;
+    if (!sys::fs::status(SocketPath, Status) && Status.type() == sys::fs::file_type::socket_file) {
+        int ProbeFD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        bool Running = ProbeFD >= 0 && ::connect(ProbeFD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) == 0;
+        if (ProbeFD >= 0) {
+            ::close(ProbeFD);
+        }
+        if (Running) {
+            errs() << "A server is already listening on " << SocketPath << "\n";
+            return 1;
+        }
+        ::unlink(Addr.sun_path);
+    }
+
+    int ListenFD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ListenFD < 0 || ::bind(ListenFD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0
+        || ::listen(ListenFD, 64) < 0) {
+        errs() << "Cannot listen on " << SocketPath << ": " << std::strerror(errno) << "\n";
+        if (ListenFD >= 0) {
+            ::close(ListenFD);
+        }
+        return 1;
+    }
+    // A client that goes away before its answer must not stop the server.
+    std::signal(SIGPIPE, SIG_IGN);
+    errs() << "rust-double-lock-driver: serving on " << SocketPath << " with " << Jobs << " worker(s)\n";
+
+    ServerState State(ListenFD);
+    std::vector<std::thread> Workers;
+    for (unsigned i = 0; i < Jobs; ++i) {
+        Workers.emplace_back([&]() {
+            for (int FD = State.pop(); FD >= 0; FD = State.pop()) {
+                serveConnection(FD, Analyse, State);
+                State.finish(FD);
+            }
+        });
+    }
+
+    int RetCode = 0;
+    while (!State.isStopping()) {
+        int FD = ::accept(ListenFD, nullptr, nullptr);
+        if (FD >= 0) {
+            State.push(FD);
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED || State.isStopping()) {
+            continue;
+        }
+        errs() << "Cannot accept on " << SocketPath << ": " << std::strerror(errno) << "\n";
+        RetCode = 1;
+        State.stop();
+    }
+    for (std::thread &T : Workers) {
+        T.join();
+    }
+    ::close(ListenFD);
+    ::unlink(Addr.sun_path);
+    return RetCode;
+}
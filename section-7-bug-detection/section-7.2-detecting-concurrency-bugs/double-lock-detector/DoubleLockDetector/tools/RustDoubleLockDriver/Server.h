@@ -0,0 +1,58 @@
+#ifndef RUSTBUGDETECTOR_SERVER_H
+#define RUSTBUGDETECTOR_SERVER_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+struct ModuleResult {
+    std::string Report;
+    std::string Error;
+    bool CacheHit = false;
+    bool MemoryHit = false;     // reused from the ReportMemo of the server
+    bool TimeLimited = false;   // the report depends on the speed of the run
+};
+
+// Reports of the modules a server has analysed, under their cache key, so
+// that a module sent again is answered without reading the cache
+// directory. Holds at most MaxEntries reports and drops the oldest first.
+// Safe to use from all workers.
+class ReportMemo {
+public:
+    explicit ReportMemo(std::size_t MaxEntries) : MaxEntries(MaxEntries) {}
+
+    bool lookup(const std::string &Key, std::string &Report);
+
+    void insert(const std::string &Key, const std::string &Report);
+
+private:
+    std::mutex Lock;
+    std::size_t MaxEntries;
+    llvm::StringMap<std::string> mapReports;
+    std::deque<std::string> queKeys;    // in insertion order
+};
+
+typedef std::function<void(const std::string &Path, ModuleResult &Result)> AnalyseFn;
+
+// Listens on the Unix domain socket SocketPath and answers requests with
+// Jobs worker threads until a shutdown request, so that a client pays for
+// the start-up of LLVM, the pass registrations and the lock API tables
+// once rather than per module.
+//
+// A client sends one JSON object per line and gets one JSON object per line
+// back, in order. {"path": "<bitcode file>"} is answered with
+// {"path", "report", "cache", "time_limited"}, where "report" is what the
+// driver would write for the module and "cache" is "memory", "disk" or
+// "none"; a module that cannot be analysed is answered with {"path",
+// "error"}. {"shutdown": true} stops the server once the requests under
+// way are answered. Each connection is served by one worker, so a client
+// opens several connections to analyse modules in parallel.
+//
+// Returns the exit code of the driver.
+int runServer(llvm::StringRef SocketPath, unsigned Jobs, AnalyseFn Analyse);
+
+#endif //RUSTBUGDETECTOR_SERVER_H
@@ -0,0 +1,552 @@
+#include "WholeProgram.h"
+
+#include "Common/CallerFunc.h"
+#include "Common/LockAPI.h"
+#include "Common/TypeNames.h"
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Type.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+// What the first scan keeps of a function: enough to build the cross-module
+// call graph without holding any IR.
+struct ScannedFunc {
+    std::string Name;
+    bool Defined;
+    bool Local;
+    bool CallsLock;
+    std::vector<unsigned> vecCallees;   // indices in ScannedModule::vecFuncs
+};
+
+struct ScannedModule {
+    std::vector<ScannedFunc> vecFuncs;  // in module order
+    std::string Error;
+};
+
+static std::string toErrorString(const std::string &Path, Error E) {
+    return Path + ": " + toString(std::move(E)) + "\n";
+}
+
+// Materializes one function body at a time and deletes it once its calls
+// are recorded, so a worker never holds more than one body of the module.
+static void scanModule(const std::string &Path, const MemoryBuffer &Buffer,
+                       const LockAPIMatcher &Matcher, ScannedModule &Scan) {
+    LLVMContext Context;
+    Expected<std::unique_ptr<Module>> MOrErr = getLazyBitcodeModule(Buffer.getMemBufferRef(), Context);
+    if (!MOrErr) {
+        Scan.Error = toErrorString(Path, MOrErr.takeError());
+        return;
+    }
+    Module &M = **MOrErr;
+    LockAPIClassifier Classifier(Matcher);
+    Classifier.classifyModule(M);
+
+    DenseMap<const Function *, unsigned> mapFuncIdx;
+    for (Function &F : M) {
+        mapFuncIdx[&F] = Scan.vecFuncs.size();
+        Scan.vecFuncs.push_back({F.getName().str(), !F.isDeclaration(), F.hasLocalLinkage(), false, {}});
+    }
+    for (Function &F : M) {
+        if (!F.isMaterializable()) {
+            continue;
+        }
+        if (Error E = F.materialize()) {
+            Scan.Error = toErrorString(Path, std::move(E));
+            return;
+        }
+        ScannedFunc &SF = Scan.vecFuncs[mapFuncIdx[&F]];
+        for (BasicBlock &B : F) {
+            for (Instruction &II : B) {
+                Instruction *I = &II;
+                if (!isCallOrInvokeInst(I)) {
+                    continue;
+                }
+                CallSite CS;
+                if (Function *Callee = getCalledFunc(I, CS)) {
+                    SF.CallsLock |= Classifier.isLock(Callee);
+                    SF.vecCallees.push_back(mapFuncIdx[Callee]);
+                }
+            }
+        }
+        std::sort(SF.vecCallees.begin(), SF.vecCallees.end());
+        SF.vecCallees.erase(std::unique(SF.vecCallees.begin(), SF.vecCallees.end()), SF.vecCallees.end());
+        F.deleteBody();
+    }
+}
+
+// The functions of all modules, numbered module by module, and the kept
+// definition of every external symbol.
+class SymbolIndex {
+public:
+    static const unsigned InvalidIdx = ~0u;
+
+    explicit SymbolIndex(const std::vector<ScannedModule> &vecModules) : vecModules(vecModules) {
+        unsigned Base = 0;
+        for (unsigned m = 0; m < vecModules.size(); ++m) {
+            vecBase.push_back(Base);
+            const std::vector<ScannedFunc> &vecFuncs = vecModules[m].vecFuncs;
+            for (unsigned f = 0; f < vecFuncs.size(); ++f) {
+                if (vecFuncs[f].Defined && !vecFuncs[f].Local) {
+                    mapExternal.insert(std::make_pair(vecFuncs[f].Name, Base + f));
+                }
+            }
+            Base += vecFuncs.size();
+        }
+        NumFuncs = Base;
+    }
+
+    unsigned getNumFuncs() const {
+        return NumFuncs;
+    }
+
+    unsigned getIdx(unsigned Module, unsigned Func) const {
+        return vecBase[Module] + Func;
+    }
+
+    // The definition that the linked module keeps for Func of Module, or
+    // InvalidIdx if no module defines it.
+    unsigned resolve(unsigned Module, unsigned Func) const {
+        const ScannedFunc &SF = vecModules[Module].vecFuncs[Func];
+        if (SF.Local) {
+            return SF.Defined ? getIdx(Module, Func) : InvalidIdx;
+        }
+        auto It = mapExternal.find(SF.Name);
+        return It == mapExternal.end() ? InvalidIdx : It->second;
+    }
+
+private:
+    const std::vector<ScannedModule> &vecModules;
+    std::vector<unsigned> vecBase;
+    StringMap<unsigned> mapExternal;
+    unsigned NumFuncs;
+};
+
+const unsigned SymbolIndex::InvalidIdx;
+
+// The kept definitions reachable from a function that calls a lock API.
+static BitVector findLockRelevant(const std::vector<ScannedModule> &vecModules, const SymbolIndex &Index) {
+    BitVector Relevant(Index.getNumFuncs());
+    std::vector<std::pair<unsigned, unsigned>> WorkList;   // (module, function)
+    for (unsigned m = 0; m < vecModules.size(); ++m) {
+        const std::vector<ScannedFunc> &vecFuncs = vecModules[m].vecFuncs;
+        for (unsigned f = 0; f < vecFuncs.size(); ++f) {
+            if (vecFuncs[f].CallsLock && Index.resolve(m, f) == Index.getIdx(m, f)) {
+                Relevant.set(Index.getIdx(m, f));
+                WorkList.push_back(std::make_pair(m, f));
+            }
+        }
+    }
+    // Map a global index back to its module when following a call.
+    std::vector<unsigned> vecModuleOf;
+    vecModuleOf.reserve(Index.getNumFuncs());
+    for (unsigned m = 0; m < vecModules.size(); ++m) {
+        vecModuleOf.insert(vecModuleOf.end(), vecModules[m].vecFuncs.size(), m);
+    }
+    while (!WorkList.empty()) {
+        unsigned m = WorkList.back().first;
+        unsigned f = WorkList.back().second;
+        WorkList.pop_back();
+        for (unsigned Callee : vecModules[m].vecFuncs[f].vecCallees) {
+            unsigned Idx = Index.resolve(m, Callee);
+            if (Idx == SymbolIndex::InvalidIdx || Relevant.test(Idx)) {
+                continue;
+            }
+            Relevant.set(Idx);
+            unsigned CalleeModule = vecModuleOf[Idx];
+            WorkList.push_back(std::make_pair(CalleeModule, Idx - Index.getIdx(CalleeModule, 0)));
+        }
+    }
+    return Relevant;
+}
+
+// Whether A and B are the same type up to copies of named struct types.
+static bool sameShape(Type *A, Type *B) {
+    if (A == B) {
+        return true;
+    }
+    if (A->getTypeID() != B->getTypeID() || A->getNumContainedTypes() != B->getNumContainedTypes()) {
+        return false;
+    }
+    if (StructType *SA = dyn_cast<StructType>(A)) {
+        StructType *SB = cast<StructType>(B);
+        if (!SA->isLiteral() && !SB->isLiteral()) {
+            // Compared by name only, which also ends recursive types.
+            return SA->hasName() && SB->hasName() && stripTypeSuffix(SA->getName()) == stripTypeSuffix(SB->getName());
+        }
+        if (SA->isLiteral() != SB->isLiteral() || SA->isPacked() != SB->isPacked()) {
+            return false;
+        }
+    } else if (ArrayType *AA = dyn_cast<ArrayType>(A)) {
+        if (AA->getNumElements() != cast<ArrayType>(B)->getNumElements()) {
+            return false;
+        }
+    } else if (PointerType *PA = dyn_cast<PointerType>(A)) {
+        if (PA->getAddressSpace() != cast<PointerType>(B)->getAddressSpace()) {
+            return false;
+        }
+    } else if (FunctionType *FA = dyn_cast<FunctionType>(A)) {
+        if (FA->isVarArg() != cast<FunctionType>(B)->isVarArg()) {
+            return false;
+        }
+    } else {
+        // Other types are uniqued by the context.
+        return false;
+    }
+    for (unsigned i = 0; i < A->getNumContainedTypes(); ++i) {
+        if (!sameShape(A->getContainedType(i), B->getContainedType(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Maps the copy "T.N" that a crate has of a named struct type T of an
+// earlier crate to T, if their bodies match. Unlike llvm::Linker, types are
+// never merged by layout alone: the Mutex and RwLock of a crate or two
+// structs with the same fields are different locks to the detector.
+// Struct types that merely contain a copy are rebuilt on top of T.
+class StructCopyMapper : public ValueMapTypeRemapper {
+public:
+    StructCopyMapper(Module &M, const StringMap<StructType *> &mapCanonical) {
+        std::vector<StructType *> vecTypes = M.getIdentifiedStructTypes();
+        for (StructType *ST : vecTypes) {
+            if (!ST->hasName()) {
+                continue;
+            }
+            auto It = mapCanonical.find(stripTypeSuffix(ST->getName()));
+            if (It == mapCanonical.end() || It->second == ST) {
+                continue;
+            }
+            StructType *Canonical = It->second;
+            if (ST->isOpaque() || Canonical->isOpaque() || sameShape(ST, Canonical)) {
+                mapTypes[ST] = Canonical;
+            }
+        }
+        if (mapTypes.empty()) {
+            return;
+        }
+        // The types that contain a copy, up to a fixpoint.
+        std::vector<StructType *> vecRebuilt;
+        bool Changed = true;
+        while (Changed) {
+            Changed = false;
+            for (StructType *ST : vecTypes) {
+                if (!mapTypes.count(ST) && mentionsMapped(ST)) {
+                    // Renamed now so that the rebuilt type keeps the name.
+                    std::string Name = ST->getName().str();
+                    ST->setName("");
+                    mapTypes[ST] = StructType::create(ST->getContext(), Name);
+                    vecRebuilt.push_back(ST);
+                    Changed = true;
+                }
+            }
+        }
+        for (StructType *ST : vecRebuilt) {
+            if (ST->isOpaque()) {
+                continue;
+            }
+            std::vector<Type *> vecElements;
+            for (Type *Element : ST->elements()) {
+                vecElements.push_back(remapType(Element));
+            }
+            cast<StructType>(mapTypes[ST])->setBody(vecElements, ST->isPacked());
+        }
+    }
+
+    bool empty() const {
+        return mapTypes.empty();
+    }
+
+    Type *remapType(Type *Ty) override {
+        auto It = mapTypes.find(Ty);
+        if (It != mapTypes.end()) {
+            return It->second;
+        }
+        Type *Result = Ty;
+        if (!isa<StructType>(Ty) || cast<StructType>(Ty)->isLiteral()) {
+            std::vector<Type *> vecContained;
+            bool AnyChange = false;
+            for (Type *Contained : Ty->subtypes()) {
+                vecContained.push_back(remapType(Contained));
+                AnyChange |= vecContained.back() != Contained;
+            }
+            if (AnyChange) {
+                Result = rebuild(Ty, vecContained);
+            }
+        }
+        mapTypes[Ty] = Result;
+        return Result;
+    }
+
+private:
+    bool mentionsMapped(Type *Ty) {
+        for (Type *Contained : Ty->subtypes()) {
+            if (mapTypes.count(Contained)) {
+                return true;
+            }
+            StructType *ST = dyn_cast<StructType>(Contained);
+            if ((!ST || ST->isLiteral()) && mentionsMapped(Contained)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static Type *rebuild(Type *Ty, ArrayRef<Type *> Contained) {
+        if (PointerType *PT = dyn_cast<PointerType>(Ty)) {
+            return PointerType::get(Contained[0], PT->getAddressSpace());
+        }
+        if (ArrayType *AT = dyn_cast<ArrayType>(Ty)) {
+            return ArrayType::get(Contained[0], AT->getNumElements());
+        }
+        if (FunctionType *FT = dyn_cast<FunctionType>(Ty)) {
+            return FunctionType::get(Contained[0], Contained.slice(1), FT->isVarArg());
+        }
+        if (StructType *ST = dyn_cast<StructType>(Ty)) {
+            return StructType::get(Ty->getContext(), Contained, ST->isPacked());
+        }
+        // Vectors only hold scalars and pointers to them.
+        return Ty;
+    }
+
+    DenseMap<Type *, Type *> mapTypes;
+};
+
+// Rewrites M on top of the canonical struct types, in place. Functions and
+// variables whose types change are recreated under their old names.
+static void remapStructCopies(Module &M, StringMap<StructType *> &mapCanonical) {
+    StructCopyMapper Mapper(M, mapCanonical);
+    if (!Mapper.empty()) {
+        ValueToValueMapTy VMap;
+        std::vector<GlobalValue *> vecReplaced;
+        std::vector<Function *> vecFuncs;
+        for (Function &F : M) {
+            vecFuncs.push_back(&F);
+        }
+        for (Function *F : vecFuncs) {
+            FunctionType *FTy = cast<FunctionType>(Mapper.remapType(F->getFunctionType()));
+            if (FTy == F->getFunctionType()) {
+                continue;
+            }
+            Function *NewF = Function::Create(FTy, F->getLinkage(), F->getAddressSpace(), "", &M);
+            NewF->copyAttributesFrom(F);
+            NewF->copyMetadata(F, 0);
+            NewF->takeName(F);
+            NewF->getBasicBlockList().splice(NewF->end(), F->getBasicBlockList());
+            Function::arg_iterator NewArg = NewF->arg_begin();
+            for (Argument &Arg : F->args()) {
+                NewArg->takeName(&Arg);
+                VMap[&Arg] = &*NewArg++;
+            }
+            VMap[F] = NewF;
+            vecReplaced.push_back(F);
+        }
+        std::vector<GlobalVariable *> vecVars;
+        for (GlobalVariable &GV : M.globals()) {
+            vecVars.push_back(&GV);
+        }
+        for (GlobalVariable *GV : vecVars) {
+            Type *Ty = Mapper.remapType(GV->getValueType());
+            if (Ty == GV->getValueType()) {
+                continue;
+            }
+            GlobalVariable *NewGV = new GlobalVariable(M, Ty, GV->isConstant(), GV->getLinkage(), nullptr, "", GV,
+                                                       GV->getThreadLocalMode(), GV->getAddressSpace());
+            NewGV->copyAttributesFrom(GV);
+            NewGV->copyMetadata(GV, 0);
+            NewGV->takeName(GV);
+            VMap[GV] = NewGV;
+            vecReplaced.push_back(GV);
+        }
+        std::vector<GlobalAlias *> vecAliases;
+        for (GlobalAlias &GA : M.aliases()) {
+            vecAliases.push_back(&GA);
+        }
+        for (GlobalAlias *GA : vecAliases) {
+            Type *Ty = Mapper.remapType(GA->getValueType());
+            if (Ty == GA->getValueType()) {
+                continue;
+            }
+            GlobalAlias *NewGA = GlobalAlias::create(Ty, GA->getAddressSpace(), GA->getLinkage(), "",
+                                                     UndefValue::get(Mapper.remapType(GA->getType())), &M);
+            NewGA->copyAttributesFrom(GA);
+            NewGA->takeName(GA);
+            VMap[GA] = NewGA;
+            vecReplaced.push_back(GA);
+        }
+
+        RemapFlags Flags = RF_IgnoreMissingLocals | RF_NoModuleLevelChanges;
+        for (GlobalVariable *GV : vecVars) {
+            if (GV->hasInitializer()) {
+                GlobalVariable *Dst = VMap.count(GV) ? cast<GlobalVariable>(VMap.lookup(GV)) : GV;
+                Dst->setInitializer(MapValue(GV->getInitializer(), VMap, Flags, &Mapper));
+            }
+        }
+        for (GlobalAlias *GA : vecAliases) {
+            GlobalAlias *Dst = VMap.count(GA) ? cast<GlobalAlias>(VMap.lookup(GA)) : GA;
+            Dst->setAliasee(MapValue(GA->getAliasee(), VMap, Flags, &Mapper));
+        }
+        for (Function &F : M) {
+            if (!F.isDeclaration()) {
+                RemapFunction(F, VMap, Flags, &Mapper);
+            }
+        }
+        for (GlobalValue *Old : vecReplaced) {
+            Old->removeDeadConstantUsers();
+            if (!Old->use_empty()) {
+                Old->replaceAllUsesWith(ConstantExpr::getPointerBitCastOrAddrSpaceCast(cast<Constant>(VMap.lookup(Old)),
+                                                                                       Old->getType()));
+            }
+            Old->eraseFromParent();
+        }
+    }
+    for (StructType *ST : M.getIdentifiedStructTypes()) {
+        if (ST->hasName()) {
+            mapCanonical.insert(std::make_pair(stripTypeSuffix(ST->getName()), ST));
+        }
+    }
+}
+
+// Moves all globals of M into Composite and resolves external symbols by
+// name; the first definition of a symbol wins.
+static void moveModule(Module &M, Module &Composite, bool First) {
+    if (First) {
+        Composite.setDataLayout(M.getDataLayout());
+        Composite.setTargetTriple(M.getTargetTriple());
+    }
+    std::vector<GlobalValue *> vecValues;
+    for (Function &F : M) {
+        vecValues.push_back(&F);
+    }
+    for (GlobalVariable &GV : M.globals()) {
+        vecValues.push_back(&GV);
+    }
+    for (GlobalAlias &GA : M.aliases()) {
+        vecValues.push_back(&GA);
+    }
+    for (GlobalValue *GV : vecValues) {
+        // Comdats belong to their module and mean nothing to the detector.
+        if (GlobalObject *GO = dyn_cast<GlobalObject>(GV)) {
+            GO->setComdat(nullptr);
+        }
+        if (!GV->hasLocalLinkage()) {
+            GlobalValue *Existing = Composite.getNamedValue(GV->getName());
+            if (Existing && Existing->hasLocalLinkage()) {
+                // A local of an earlier module; let the symbol keep its name.
+                Existing->setName(Existing->getName().str() + ".local");
+                Existing = nullptr;
+            }
+            if (Existing && (GV->isDeclaration() || !Existing->isDeclaration())) {
+                GV->replaceAllUsesWith(ConstantExpr::getPointerBitCastOrAddrSpaceCast(Existing, GV->getType()));
+                GV->eraseFromParent();
+                continue;
+            }
+            if (Existing) {
+                Existing->replaceAllUsesWith(ConstantExpr::getPointerBitCastOrAddrSpaceCast(GV, Existing->getType()));
+                Existing->eraseFromParent();
+            }
+        }
+        GV->removeFromParent();
+        if (Function *F = dyn_cast<Function>(GV)) {
+            Composite.getFunctionList().push_back(F);
+        } else if (GlobalVariable *Var = dyn_cast<GlobalVariable>(GV)) {
+            Composite.getGlobalList().push_back(Var);
+        } else {
+            Composite.getAliasList().push_back(cast<GlobalAlias>(GV));
+        }
+    }
+    for (NamedMDNode &NMD : M.named_metadata()) {
+        if (!First && NMD.getName() == "llvm.module.flags") {
+            continue;
+        }
+        NamedMDNode *Dst = Composite.getOrInsertNamedMetadata(NMD.getName());
+        for (MDNode *Op : NMD.operands()) {
+            Dst->addOperand(Op);
+        }
+    }
+}
+
+std::unique_ptr<Module> linkWholeProgram(StringRef Name,
+                                         ArrayRef<std::string> Paths,
+                                         ArrayRef<std::unique_ptr<MemoryBuffer>> Buffers,
+                                         const LockAPIMatcher &Matcher,
+                                         unsigned Jobs,
+                                         LLVMContext &Context,
+                                         WholeProgramStats &Stats,
+                                         std::string &ErrMsg) {
+    std::vector<ScannedModule> vecModules(Paths.size());
+    std::atomic<std::size_t> NextInput(0);
+    std::vector<std::thread> Workers;
+    for (unsigned i = 0; i < std::max(1u, Jobs); ++i) {
+        Workers.emplace_back([&]() {
+            for (std::size_t idx = NextInput++; idx < Paths.size(); idx = NextInput++) {
+                scanModule(Paths[idx], *Buffers[idx], Matcher, vecModules[idx]);
+            }
+        });
+    }
+    for (std::thread &T : Workers) {
+        T.join();
+    }
+    for (const ScannedModule &Scan : vecModules) {
+        ErrMsg += Scan.Error;
+    }
+    if (!ErrMsg.empty()) {
+        return nullptr;
+    }
+
+    SymbolIndex Index(vecModules);
+    BitVector Relevant = findLockRelevant(vecModules, Index);
+
+    std::unique_ptr<Module> Composite(new Module(Name, Context));
+    StringMap<StructType *> mapCanonical;   // base name -> first struct type
+    for (unsigned m = 0; m < Paths.size(); ++m) {
+        Expected<std::unique_ptr<Module>> MOrErr = getLazyBitcodeModule(Buffers[m]->getMemBufferRef(), Context);
+        if (!MOrErr) {
+            ErrMsg = toErrorString(Paths[m], MOrErr.takeError());
+            return nullptr;
+        }
+        std::unique_ptr<Module> M = std::move(*MOrErr);
+        unsigned f = 0;
+        for (Function &F : *M) {
+            unsigned Func = f++;
+            if (!F.isMaterializable()) {
+                continue;
+            }
+            ++Stats.NumFuncs;
+            unsigned Idx = Index.getIdx(m, Func);
+            if (Index.resolve(m, Func) == Idx && Relevant.test(Idx)) {
+                if (Error E = F.materialize()) {
+                    ErrMsg = toErrorString(Paths[m], std::move(E));
+                    return nullptr;
+                }
+                ++Stats.NumMaterialized;
+            } else {
+                F.deleteBody();
+            }
+        }
+        // Only metadata and global initializers are left to read.
+        if (Error E = M->materializeAll()) {
+            ErrMsg = toErrorString(Paths[m], std::move(E));
+            return nullptr;
+        }
+        remapStructCopies(*M, mapCanonical);
+        moveModule(*M, *Composite, m == 0);
+    }
+    return Composite;
+}
@@ -0,0 +1,45 @@
+#ifndef RUSTBUGDETECTOR_WHOLEPROGRAM_H
+#define RUSTBUGDETECTOR_WHOLEPROGRAM_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <memory>
+#include <string>
+
+class LockAPIMatcher;
+
+struct WholeProgramStats {
+    std::size_t NumFuncs = 0;           // function bodies in all modules
+    std::size_t NumMaterialized = 0;    // bodies linked into the whole program
+};
+
+// Links the bitcode of all modules of an application into one module named
+// Name, for locks taken in one crate and re-acquired through a call into
+// another.
+//
+// Only the functions reachable in the call graph from a function that
+// calls a lock API are materialized; all other functions stay declarations,
+// so peak memory follows the lock-relevant code rather than the whole
+// application. The call graph comes from a first scan that loads each
+// module lazily in its own context, Jobs modules at a time, and resolves
+// calls across modules by symbol name. The first definition of an external
+// symbol, in input order, is the one that is kept.
+//
+// The copy "T.N" that a crate has of a named struct type T of an earlier
+// crate is replaced by T if their bodies agree. Unlike llvm::Linker, struct
+// types are not merged by layout alone.
+//
+// Returns null and sets ErrMsg if a module cannot be read.
+std::unique_ptr<llvm::Module> linkWholeProgram(llvm::StringRef Name,
+                                               llvm::ArrayRef<std::string> Paths,
+                                               llvm::ArrayRef<std::unique_ptr<llvm::MemoryBuffer>> Buffers,
+                                               const LockAPIMatcher &Matcher,
+                                               unsigned Jobs,
+                                               llvm::LLVMContext &Context,
+                                               WholeProgramStats &Stats,
+                                               std::string &ErrMsg);
+
+#endif //RUSTBUGDETECTOR_WHOLEPROGRAM_H
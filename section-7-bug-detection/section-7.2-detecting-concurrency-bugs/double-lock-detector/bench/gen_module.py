@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Generates a synthetic Rust-like LLVM module for benchmarking the double
+# lock detector and the manual drop printer. The module uses the std and
+# lock_api lock functions and the drop functions both passes look for, and
+# carries debug info so that every report has a source location.
+#
+# The output only depends on the arguments, so a (seed, knobs) pair pins a
+# module as well as a checked-in bitcode file would.
+
+import argparse
+import random
+import sys
+
+MUTEX = '_ZN3std4sync5mutex14Mutex$LT$T$GT$4lock17h1111E'
+WRITE = '_ZN3std4sync6rwlock15RwLock$LT$T$GT$5write17h2222E'
+READ = '_ZN3std4sync6rwlock15RwLock$LT$T$GT$4read17h3333E'
+LAPI = '_ZN8lock_api5mutex18Mutex$LT$R$C$T$GT$4lock17h4444E'
+LAPIR = '_ZN8lock_api6rwlock19RwLock$LT$R$C$T$GT$4read17h4445E'
+ADROP = '_ZN4core3ptr18real_drop_in_place17h5555E'
+MDROPP = '_ZN4core3mem4drop17h6666E'
+MDROPR = '_ZN4core3mem4drop17h7777E'
+
+# Every function takes the same parameters and passes them on to its callees,
+# so that locks of callers and callees alias.
+PARAMS = '%Locks* %a, %Mutex* %lm0, %Mutex* %lm1, %RwLock* %lr, i1 %c'
+
+# Average number of blocks and instruction slots per block, used to size
+# the lock fields for the requested group size.
+AVG_BLOCKS = 4
+AVG_SLOTS = 2
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Generate a synthetic module for the benchmarks.')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--functions', type=int, default=200)
+    parser.add_argument('--lock-density', type=float, default=0.35,
+                        help='fraction of instruction slots that acquire a lock')
+    parser.add_argument('--call-density', type=float, default=0.45,
+                        help='fraction of instruction slots that call a function')
+    parser.add_argument('--call-depth', type=int, default=0,
+                        help='longest call chain; 0 allows arbitrary (recursive) calls')
+    parser.add_argument('--group-size', type=float, default=8.0,
+                        help='average number of lock sites on one lock field')
+    parser.add_argument('--drop-ratio', type=float, default=0.6,
+                        help='fraction of guards that are dropped explicitly')
+    parser.add_argument('--llvm-version', type=int, default=9,
+                        help='major version of llvm-as; sret is typed from LLVM 12 on')
+    parser.add_argument('-o', '--output', default='-')
+    return parser.parse_args()
+
+
+class Generator:
+    def __init__(self, args):
+        self.args = args
+        self.rand = random.Random(args.seed)
+        self.sret = 'sret(%Res)' if args.llvm_version >= 12 else 'sret'
+        expected_locks = args.functions * AVG_BLOCKS * AVG_SLOTS * args.lock_density
+        self.num_fields = max(1, int(round(expected_locks / max(args.group_size, 1.0))))
+        self.dbg = []
+        self.next_md = 100 + args.functions
+
+    def field_kind(self, idx):
+        return 'Mutex' if idx % 2 == 0 else 'RwLock'
+
+    def loc(self, sp):
+        self.next_md += 1
+        self.dbg.append('!%d = !DILocation(line: %d, scope: !%d)' % (self.next_md, self.next_md, sp))
+        return ', !dbg !%d' % self.next_md
+
+    def layer(self, fi):
+        depth = self.args.call_depth
+        return fi * (depth + 1) // self.args.functions
+
+    def pick_callee(self, fi):
+        nf = self.args.functions
+        if self.args.call_depth <= 0:
+            return self.rand.randrange(nf)
+        # Only call into the next layer, so no chain is longer than call_depth.
+        depth = self.args.call_depth
+        layer = self.layer(fi) + 1
+        if layer > depth:
+            return None
+        lo = (layer * nf + depth) // (depth + 1)
+        hi = ((layer + 1) * nf + depth) // (depth + 1)
+        if lo >= hi:
+            return None
+        return self.rand.randrange(lo, hi)
+
+    def header(self):
+        fields = ', '.join('%%%s' % self.field_kind(i) for i in range(self.num_fields))
+        text = '''%%Locks = type { %s }
+%%Mutex = type { i8*, i8 }
+%%RwLock = type { i8*, i8 }
+%%Res = type { i64, i8* }
+define void @"%s"(%%Res* %s %%a, %%Mutex* %%b) {
+  ret void
+}
+define void @"%s"(%%Res* %s %%a, %%RwLock* %%b) {
+  ret void
+}
+define void @"%s"(%%Res* %s %%a, %%RwLock* %%b) {
+  ret void
+}
+define i8* @"%s"(%%Mutex* %%a) {
+  ret i8* null
+}
+define i8* @"%s"(%%RwLock* %%a) {
+  ret i8* null
+}
+declare void @"%s"(%%Res*)
+declare void @"%s"(i8*)
+declare void @"%s"(%%Res*)
+declare void @opaque()
+declare i32 @__gxx_personality_v0(...)
+''' % (fields, MUTEX, self.sret, WRITE, self.sret, READ, self.sret, LAPI, LAPIR, ADROP, MDROPP, MDROPR)
+        return text
+
+    def function(self, fi):
+        args = self.args
+        rand = self.rand
+        sp = 10 + fi
+        num_tmps = [0]
+
+        def tmp():
+            num_tmps[0] += 1
+            return '%%v%d' % num_tmps[0]
+
+        entry = []
+        pending = []
+        blocks = []
+        landing_pads = []
+        num_slots = 0
+        num_blocks = rand.randint(1, 2 * AVG_BLOCKS - 1)
+
+        def emit_drop(cur, drop):
+            kind, value = drop
+            if kind == 'guard':
+                v = tmp()
+                cur.append('  %s = load i8*, i8** %s' % (v, value))
+                cur.append('  call void @"%s"(i8* %s)%s' % (MDROPP, v, self.loc(sp)))
+            else:
+                cur.append('  call void @"%s"(%%Res* %s)%s' % (rand.choice([ADROP, MDROPR]), value, self.loc(sp)))
+
+        sub = 0
+        for bi in range(num_blocks):
+            label = 'bb%d' % bi
+            cur = []
+            for _ in range(rand.randint(0, 2 * AVG_SLOTS)):
+                r = rand.random()
+                if r < args.lock_density:
+                    if rand.random() < 0.15:
+                        kind = 'Mutex' if rand.random() < 0.5 else 'RwLock'
+                        ptr = ('%%lm%d' % rand.randint(0, 1)) if kind == 'Mutex' else '%lr'
+                    else:
+                        idx = rand.randrange(self.num_fields)
+                        kind = self.field_kind(idx)
+                        ptr = tmp()
+                        cur.append('  %s = getelementptr inbounds %%Locks, %%Locks* %%a, i32 0, i32 %d' % (ptr, idx))
+                    api = rand.random()
+                    if kind == 'Mutex' and api < 0.6 or kind == 'RwLock' and api < 0.5:
+                        slot = '%%r%d' % num_slots
+                        entry.append('  %s = alloca %%Res' % slot)
+                        fn = MUTEX if kind == 'Mutex' else (WRITE if api < 0.35 else READ)
+                        cur.append('  call void @"%s"(%%Res* %s %s, %%%s* %s)%s'
+                                   % (fn, self.sret, slot, kind, ptr, self.loc(sp)))
+                        drop = ('result', slot)
+                    else:
+                        slot = '%%g%d' % num_slots
+                        entry.append('  %s = alloca i8*' % slot)
+                        v = tmp()
+                        fn = LAPI if kind == 'Mutex' else LAPIR
+                        cur.append('  %s = call i8* @"%s"(%%%s* %s)%s' % (v, fn, kind, ptr, self.loc(sp)))
+                        cur.append('  store i8* %s, i8** %s' % (v, slot))
+                        drop = ('guard', slot)
+                    num_slots += 1
+                    # Lock calls end their block, as rustc emits them.
+                    sub += 1
+                    cur.append('  br label %%s%d' % sub)
+                    blocks.append((label, cur))
+                    label = 's%d' % sub
+                    cur = []
+                    if rand.random() < args.drop_ratio:
+                        pending.append(drop)
+                elif r < args.lock_density + args.call_density:
+                    callee = self.pick_callee(fi)
+                    if callee is None:
+                        cur.append('  call void @opaque()' + self.loc(sp))
+                    elif rand.random() < 0.3:
+                        sub += 1
+                        lp = 'lp%d' % sub
+                        cur.append('  invoke void @f%d(%s) to label %%s%d unwind label %%%s%s'
+                                   % (callee, PARAMS, sub, lp, self.loc(sp)))
+                        landing_pads.append(lp)
+                        blocks.append((label, cur))
+                        label = 's%d' % sub
+                        cur = []
+                    else:
+                        cur.append('  call void @f%d(%s)%s' % (callee, PARAMS, self.loc(sp)))
+                else:
+                    cur.append('  call void @opaque()' + self.loc(sp))
+            while pending and rand.random() < 0.5:
+                emit_drop(cur, pending.pop(rand.randrange(len(pending))))
+            if bi == num_blocks - 1:
+                for drop in pending:
+                    emit_drop(cur, drop)
+                cur.append('  ret void')
+            elif rand.random() < 0.6:
+                cur.append('  br label %%bb%d' % (bi + 1))
+            else:
+                target = rand.randrange(num_blocks)
+                if target == 0:
+                    target = bi + 1
+                cur.append('  br i1 %%c, label %%bb%d, label %%bb%d' % (bi + 1, target))
+            blocks.append((label, cur))
+
+        body = ['start:'] + entry + ['  br label %bb0']
+        for label, cur in blocks:
+            body.append(label + ':')
+            body.extend(cur)
+        for lp in landing_pads:
+            v = tmp()
+            body.append(lp + ':')
+            body.append('  %s = landingpad { i8*, i32 } cleanup' % v)
+            body.append('  resume { i8*, i32 } %s' % v)
+        self.dbg.append('!%d = distinct !DISubprogram(name: "f%d", scope: !1, file: !1, line: 1, '
+                        'type: !3, unit: !0, spFlags: DISPFlagDefinition)' % (sp, fi))
+        return ('define void @f%d(%s) personality i32 (...)* @__gxx_personality_v0 !dbg !%d {\n%s\n}\n'
+                % (fi, PARAMS, sp, '\n'.join(body)))
+
+    def module(self):
+        functions = [self.function(fi) for fi in range(self.args.functions)]
+        return (self.header() + '\n'.join(functions) + '''
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!9}
+!0 = distinct !DICompileUnit(language: DW_LANG_Rust, file: !1, producer: "rustc", emissionKind: FullDebug)
+!1 = !DIFile(filename: "src/lib.rs", directory: "/bench")
+!3 = !DISubroutineType(types: !{})
+!9 = !{i32 2, !"Debug Info Version", i32 3}
+''' + '\n'.join(self.dbg) + '\n')
+
+
+def main():
+    args = parse_args()
+    text = Generator(args).module()
+    if args.output == '-':
+        sys.stdout.write(text)
+    else:
+        with open(args.output, 'w') as outfile:
+            outfile.write(text)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Runs the double lock detector and the manual drop printer over the
+# benchmark corpus (corpus.txt) and reports, per module and pass, the wall
+# time, functions/s, call sites/s, peak RSS and the number of findings.
+#
+# The finding counts are compared against baseline.json: fewer findings
+# than recorded make the run fail, so a speedup cannot silently drop true
+# positives. After an intended change of the reports, rerun with
+# --update-baseline and commit the new baseline.
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+DETECTOR_DIR = os.path.join(BENCH_DIR, '..', 'DoubleLockDetector')
+MANUAL_DROP_DIR = os.path.join(BENCH_DIR, '..', '..', '..', '..', 'section-6-thread-safety-issues',
+                               'section-6-1-blocking-bugs', 'ManualDropPrinter')
+
+DETECTOR_LIB = os.path.join('lib', 'RustDoubleLockDetector', 'libRustDoubleLockDetector.so')
+DRIVER = os.path.join('tools', 'RustDoubleLockDriver', 'rust-double-lock-driver')
+MANUAL_DROP_LIB = os.path.join('lib', 'PrintManualDrop', 'libPrintManualDrop.so')
+# The detector runs with the skip list of run.sh.
+SKIP_LIST_FLAG = '-detect-skip-list=' + os.path.join(BENCH_DIR, '..', 'skip_list.txt')
+
+DOUBLE_LOCK = 'Double Lock Happens!'
+MANUAL_DROP = 'Manual Drop Info:'
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Benchmark the double lock and manual drop passes.')
+    parser.add_argument('--detector-build', default=os.path.join(DETECTOR_DIR, 'build'))
+    parser.add_argument('--manual-drop-build', default=os.path.join(MANUAL_DROP_DIR, 'build'))
+    parser.add_argument('--build', action='store_true',
+                        help='configure and build both passes before running')
+    parser.add_argument('--build-manual-drop', action='store_true',
+                        help='configure and build the manual drop printer before running')
+    parser.add_argument('--opt', default='opt')
+    parser.add_argument('--llvm-as', default='llvm-as')
+    parser.add_argument('--opt-flag', action='append', default=[],
+                        help='extra flag for opt, e.g. -enable-new-pm=0 on LLVM 13 and later')
+    parser.add_argument('--corpus', default=os.path.join(BENCH_DIR, 'corpus.txt'))
+    parser.add_argument('--corpus-dir', help='directory of the pinned bitcode files of corpus.txt')
+    parser.add_argument('--work-dir', default=os.path.join(tempfile.gettempdir(), 'double-lock-bench'),
+                        help='where the synthetic modules are generated')
+    parser.add_argument('--filter', default='', help='only run modules whose name contains this')
+    parser.add_argument('--repeat', type=int, default=3, help='runs per module and pass; the median is reported')
+    parser.add_argument('-j', '--jobs', type=int, default=os.cpu_count() or 1,
+                        help='worker threads of the driver run over the whole corpus')
+    parser.add_argument('--baseline', default=os.path.join(BENCH_DIR, 'baseline.json'))
+    parser.add_argument('--update-baseline', action='store_true')
+    parser.add_argument('--json', help='also write the results to this file')
+    return parser.parse_args()
+
+
+def build(src_dir, build_dir):
+    os.makedirs(build_dir, exist_ok=True)
+    subprocess.check_call(['cmake', os.path.abspath(src_dir)], cwd=build_dir)
+    subprocess.check_call(['cmake', '--build', '.', '--', '-j%d' % (os.cpu_count() or 1)], cwd=build_dir)
+
+
+def llvm_version(llvm_as):
+    out = subprocess.check_output([llvm_as, '--version'], universal_newlines=True)
+    match = re.search(r'LLVM version (\d+)', out)
+    return int(match.group(1)) if match else 9
+
+
+def sha256(path):
+    digest = hashlib.sha256()
+    with open(path, 'rb') as infile:
+        for chunk in iter(lambda: infile.read(1 << 20), b''):
+            digest.update(chunk)
+    return digest.hexdigest()
+
+
+# Each corpus line is either
+#   synthetic <name> <gen_module.py arguments>
+#   bitcode <name> <sha256> <path relative to --corpus-dir>
+def read_corpus(path):
+    entries = []
+    with open(path) as infile:
+        for line in infile:
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            fields = shlex.split(line)
+            if fields[0] == 'synthetic' and len(fields) >= 2:
+                entries.append({'kind': 'synthetic', 'name': fields[1], 'args': fields[2:]})
+            elif fields[0] == 'bitcode' and len(fields) == 4:
+                entries.append({'kind': 'bitcode', 'name': fields[1], 'sha256': fields[2], 'path': fields[3]})
+            else:
+                sys.exit('%s: cannot parse line: %s' % (path, line))
+    return entries
+
+
+def prepare(entry, args, version):
+    if entry['kind'] == 'bitcode':
+        if not args.corpus_dir:
+            return None
+        path = os.path.join(args.corpus_dir, entry['path'])
+        if not os.path.exists(path):
+            sys.exit('%s: missing from the corpus' % path)
+        if sha256(path) != entry['sha256']:
+            sys.exit('%s: sha256 does not match corpus.txt' % path)
+        return path
+    os.makedirs(args.work_dir, exist_ok=True)
+    ll = os.path.join(args.work_dir, entry['name'] + '.ll')
+    bc = os.path.join(args.work_dir, entry['name'] + '.m2r.bc')
+    subprocess.check_call([sys.executable, os.path.join(BENCH_DIR, 'gen_module.py'),
+                           '--llvm-version', str(version), '-o', ll] + entry['args'])
+    subprocess.check_call([args.llvm_as, ll, '-o', bc])
+    return bc
+
+
+# Runs cmd once and returns (seconds, peak RSS in KiB, stderr).
+def measure(cmd):
+    with tempfile.TemporaryFile(mode='w+') as err:
+        start = time.monotonic()
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=err)
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.monotonic() - start
+        proc.returncode = os.waitstatus_to_exitcode(status) if hasattr(os, 'waitstatus_to_exitcode') else status
+        err.seek(0)
+        output = err.read()
+    if proc.returncode != 0:
+        sys.exit('%s failed:\n%s' % (' '.join(cmd), output[-4000:]))
+    return elapsed, usage.ru_maxrss, output
+
+
+def run_pass(cmd, marker, repeat):
+    times = []
+    peak_rss = 0
+    findings = None
+    for _ in range(repeat):
+        elapsed, rss, output = measure(cmd)
+        times.append(elapsed)
+        peak_rss = max(peak_rss, rss)
+        count = output.count(marker)
+        if findings is not None and count != findings:
+            sys.exit('%s: nondeterministic number of findings' % ' '.join(cmd))
+        findings = count
+    times.sort()
+    return {'seconds': times[len(times) // 2], 'peak_rss_kib': peak_rss, 'findings': findings}
+
+
+def module_size(args, bc):
+    with tempfile.NamedTemporaryFile(mode='r', suffix='.json') as stats:
+        cmd = [args.opt] + args.opt_flag + ['-load', os.path.join(args.detector_build, DETECTOR_LIB),
+                                            '-detect', bc, '-o', os.devnull, SKIP_LIST_FLAG,
+                                            '-detect-stats=' + stats.name]
+        measure(cmd)
+        record = json.loads(stats.read().splitlines()[-1])
+    return record['functions'], record['call_sites']
+
+
+def rate(count, seconds):
+    return count / seconds if seconds > 0 else float('inf')
+
+
+def print_row(name, functions, call_sites, pass_name, result):
+    print('%-24s %-12s %9.3f %12.0f %12.0f %9.1f %9d' % (
+        name, pass_name, result['seconds'], rate(functions, result['seconds']),
+        rate(call_sites, result['seconds']), result['peak_rss_kib'] / 1024.0, result['findings']))
+
+
+def compare(results, baseline):
+    failed = False
+    for name, result in sorted(results.items()):
+        expected = baseline.get(name)
+        if expected is None:
+            print('note: %s has no baseline' % name)
+            continue
+        for key in ('double_lock', 'manual_drop'):
+            got = result[key]['findings']
+            want = expected[key]
+            if got < want:
+                print('FAIL: %s %s: %d findings, baseline has %d' % (name, key, got, want))
+                failed = True
+            elif got > want:
+                print('note: %s %s: %d findings, baseline has %d (--update-baseline to accept)'
+                      % (name, key, got, want))
+    return not failed
+
+
+def main():
+    args = parse_args()
+    if args.build:
+        build(DETECTOR_DIR, args.detector_build)
+    if args.build or args.build_manual_drop:
+        build(MANUAL_DROP_DIR, args.manual_drop_build)
+    version = llvm_version(args.llvm_as)
+    detector_lib = os.path.join(args.detector_build, DETECTOR_LIB)
+    manual_drop_lib = os.path.join(args.manual_drop_build, MANUAL_DROP_LIB)
+
+    results = {}
+    modules = []
+    print('%-24s %-12s %9s %12s %12s %9s %9s' % (
+        'module', 'pass', 'seconds', 'functions/s', 'sites/s', 'rss MiB', 'findings'))
+    for entry in read_corpus(args.corpus):
+        if args.filter not in entry['name']:
+            continue
+        bc = prepare(entry, args, version)
+        if bc is None:
+            print('%-24s skipped, no --corpus-dir' % entry['name'])
+            continue
+        modules.append(bc)
+        functions, call_sites = module_size(args, bc)
+        opt = [args.opt] + args.opt_flag
+        double_lock = run_pass(opt + ['-load', detector_lib, '-detect', bc, '-o', os.devnull, SKIP_LIST_FLAG],
+                               DOUBLE_LOCK, args.repeat)
+        manual_drop = run_pass(opt + ['-load', manual_drop_lib, '-print', bc, '-o', os.devnull],
+                               MANUAL_DROP, args.repeat)
+        print_row(entry['name'], functions, call_sites, 'double-lock', double_lock)
+        print_row(entry['name'], functions, call_sites, 'manual-drop', manual_drop)
+        results[entry['name']] = {'functions': functions, 'call_sites': call_sites,
+                                  'double_lock': double_lock, 'manual_drop': manual_drop}
+
+    if modules:
+        # The driver is what run.sh uses; measure it over the whole corpus.
+        driver = os.path.join(args.detector_build, DRIVER)
+        with tempfile.TemporaryDirectory() as log_dir:
+            parallel_log = os.path.join(log_dir, 'parallel.log')
+            serial_log = os.path.join(log_dir, 'serial.log')
+            elapsed, rss, _ = measure([driver, '-j', str(args.jobs), '-o', parallel_log, SKIP_LIST_FLAG] + modules)
+            # Modules are merged in input order and their findings listed in
+            # module order, so the log must not depend on the workers.
+            measure([driver, '-j', '1', '-o', serial_log, SKIP_LIST_FLAG] + modules)
+            if sha256(parallel_log) != sha256(serial_log):
+                sys.exit('driver: the log of -j %d differs from that of -j 1' % args.jobs)
+        functions = sum(r['functions'] for r in results.values())
+        call_sites = sum(r['call_sites'] for r in results.values())
+        print('%-24s %-12s %9.3f %12.0f %12.0f %9.1f' % (
+            'all (-j %d)' % args.jobs, 'driver', elapsed, rate(functions, elapsed),
+            rate(call_sites, elapsed), rss / 1024.0))
+
+    if args.json:
+        with open(args.json, 'w') as outfile:
+            json.dump(results, outfile, indent=2, sort_keys=True)
+
+    if args.update_baseline:
+        baseline = {}
+        if os.path.exists(args.baseline):
+            with open(args.baseline) as infile:
+                baseline = json.load(infile)
+        for name, result in results.items():
+            baseline[name] = {'double_lock': result['double_lock']['findings'],
+                              'manual_drop': result['manual_drop']['findings']}
+        with open(args.baseline, 'w') as outfile:
+            json.dump(baseline, outfile, indent=2, sort_keys=True)
+            outfile.write('\n')
+        return 0
+
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as infile:
+            baseline = json.load(infile)
+    return 0 if compare(results, baseline) else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
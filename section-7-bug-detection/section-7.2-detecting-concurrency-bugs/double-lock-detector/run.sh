@@ -1,11 +1,12 @@
 #!/usr/bin/env bash
 
 BC_DIR="$1"
-DOUBLE_LOCK_DETECTOR_LIB=DoubleLockDetector/build/lib/RustDoubleLockDetector/libRustDoubleLockDetector.so
+DOUBLE_LOCK_DRIVER=DoubleLockDetector/build/tools/RustDoubleLockDriver/rust-double-lock-driver
 LOG_FILE=./double_lock.log
 
-for bc in `ls -1v ${BC_DIR}/*.m2r.bc`
-do
-    #echo $bc
-    opt -load ${DOUBLE_LOCK_DETECTOR_LIB} -detect $bc 1>/dev/null
-done 2>>${LOG_FILE}
+# The driver analyses all *.m2r.bc in BC_DIR in parallel and appends the
+# reports in `ls -v` order, as the former serial opt loop did.
+# Set CACHE_DIR to reuse the reports of unchanged modules across runs, and
+# WHOLE_PROGRAM=1 to analyse all modules of BC_DIR as one program.
+# SKIP_LIST names the functions whose lock sites are not tracked.
+${DOUBLE_LOCK_DRIVER} -j "${JOBS:-$(nproc)}" -detect-skip-list="${SKIP_LIST:-skip_list.txt}" ${CACHE_DIR:+-cache-dir "${CACHE_DIR}"} ${WHOLE_PROGRAM:+-whole-program} ${BC_DIR} >>${LOG_FILE}